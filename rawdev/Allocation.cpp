@@ -0,0 +1,442 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Allocation.h"
+#include "OsHelpers.h"
+
+static const DWORD sectorAlign = 4096;
+static const DWORD bounceSize = 1024*1024;
+
+template<class T> static T Get(const byte * p, size_t offset)
+{
+	T v;
+	memcpy(&v, p + offset, sizeof(v));
+	return v;
+}
+
+static bool IsPowerOfTwo(UINT64 v)
+{
+	return v!=0 && (v & (v - 1))==0;
+}
+
+// Reads len bytes at offset through an aligned bounce buffer, so unbuffered handles work at any offset
+static HRESULT ReadBytes(HANDLE h, UINT64 offset, void * data, size_t len)
+{
+	auto bounce = (byte *) VirtualAlloc(nullptr, bounceSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (!bounce)
+		return GetLastError();
+	HRESULT hr = 0;
+	auto p = (byte *) data;
+	while (len>0)
+	{
+		auto start = offset / sectorAlign * sectorAlign;
+		auto skip = (DWORD)(offset - start);
+		// never more than the sectors holding what is left, the end of a device may be near
+		auto ioLen = bounceSize;
+		if (skip + len < bounceSize)
+			ioLen = (DWORD)((skip + len + sectorAlign - 1) / sectorAlign * sectorAlign);
+		DWORD done;
+		hr = ReadAt(h, bounce, ioLen, start, done);
+		if (hr) break;
+		if (done<=skip)
+		{
+			hr = ERROR_HANDLE_EOF;
+			break;
+		}
+		size_t n = done - skip;
+		if (n>len)
+			n = len;
+		memcpy(p, bounce + skip, n);
+		p += n;
+		offset += n;
+		len -= n;
+	}
+	VirtualFree(bounce, 0, MEM_RELEASE);
+	return hr;
+}
+
+// Turns runs of used units into marked blocks
+struct Mapper
+{
+	HANDLE h;
+	UINT64 offset;
+	UINT64 size;
+	DWORD blockSize;
+	Allocation & alloc;
+	UINT64 runBase;
+	UINT64 runUnit;
+	UINT64 runStart;
+	UINT64 runPos;
+	bool inRun;
+
+	Mapper(HANDLE hvol, UINT64 off, UINT64 sz, DWORD bs, Allocation & a) : h(hvol), offset(off), size(sz), blockSize(bs), alloc(a)
+	{
+		runBase = 0;
+		runUnit = 1;
+		runStart = 0;
+		runPos = 0;
+		inRun = false;
+		alloc.usedBlocks.assign((size_t)((size + blockSize - 1) / blockSize), false);
+	}
+
+	HRESULT Read(UINT64 pos, void * data, size_t len)
+	{
+		return ReadBytes(h, offset + pos, data, len);
+	}
+
+	// Marks the blocks holding len bytes at pos of the volume
+	void Mark(UINT64 pos, UINT64 len)
+	{
+		if (pos>=size || len==0)
+			return;
+		if (len>size - pos)
+			len = size - pos;
+		auto last = (pos + len - 1) / blockSize;
+		for (auto b=pos / blockSize; b<=last; b++)
+			alloc.usedBlocks[(size_t)b] = true;
+	}
+
+	void BeginRuns(UINT64 base, UINT64 unit)
+	{
+		runBase = base;
+		runUnit = unit;
+		runPos = 0;
+		inRun = false;
+	}
+
+	// count units in a row that are all used or all free
+	void AddRun(bool used, UINT64 count)
+	{
+		if (used && !inRun)
+			runStart = runPos;
+		else if (!used && inRun)
+			Mark(runBase + runStart * runUnit, (runPos - runStart) * runUnit);
+		inRun = used;
+		runPos += count;
+	}
+
+	void EndRuns()
+	{
+		AddRun(false, 0);
+	}
+
+	// Marks the set bits of a bitmap of count units starting at base, returns how many were set
+	UINT64 Scan(const byte * bits, UINT64 count, UINT64 base, UINT64 unit)
+	{
+		UINT64 used = 0;
+		BeginRuns(base, unit);
+		for (UINT64 i=0; i<count; )
+		{
+			auto b = bits[(size_t)(i / 8)];
+			if (i%8==0 && count - i>=8 && (b==0 || b==0xFF))
+			{
+				AddRun(b!=0, 8);
+				used += b ? 8 : 0;
+				i += 8;
+				continue;
+			}
+			auto set = ((b >> (i % 8)) & 1)!=0;
+			AddRun(set, 1);
+			used += set ? 1 : 0;
+			i++;
+		}
+		EndRuns();
+		return used;
+	}
+
+	HRESULT MapNtfs(const byte * boot);
+	HRESULT MapFat(const byte * boot);
+	HRESULT MapExt(const byte * sb);
+};
+
+// Restores the last two bytes of every sector of an MFT record from its update sequence array
+static bool ApplyFixups(vector<byte> & rec)
+{
+	if (memcmp(rec.data(), "FILE", 4)!=0)
+		return false;
+	auto usaOffset = Get<WORD>(rec.data(), 4);
+	auto usaCount = Get<WORD>(rec.data(), 6);
+	if (usaCount<2 || usaOffset + usaCount * 2u > rec.size())
+		return false;
+	auto stride = rec.size() / (usaCount - 1);
+	auto usn = Get<WORD>(rec.data(), usaOffset);
+	for (DWORD i=1; i<usaCount; i++)
+	{
+		auto pos = i * stride - 2;
+		if (Get<WORD>(rec.data(), pos)!=usn)
+			return false;
+		memcpy(&rec[pos], &rec[usaOffset + i * 2], 2);
+	}
+	return true;
+}
+
+struct ClusterRun
+{
+	UINT64 lcn;
+	UINT64 count;
+};
+
+// Decodes the mapping pairs of a non-resident attribute
+static bool ParseRuns(const byte * p, const byte * end, vector<ClusterRun> & runs)
+{
+	INT64 lcn = 0;
+	while (p<end && *p!=0)
+	{
+		DWORD lenBytes = *p & 0xF;
+		DWORD offBytes = *p >> 4;
+		p++;
+		if (lenBytes==0 || lenBytes>8 || offBytes==0 || offBytes>8 || p + lenBytes + offBytes > end)
+			return false;
+		UINT64 count = 0;
+		for (DWORD i=0; i<lenBytes; i++)
+			count |= (UINT64)p[i] << (8 * i);
+		p += lenBytes;
+		UINT64 delta = 0;
+		for (DWORD i=0; i<offBytes; i++)
+			delta |= (UINT64)p[i] << (8 * i);
+		if (offBytes<8 && (p[offBytes-1] & 0x80))
+			delta |= ~0ull << (8 * offBytes);
+		p += offBytes;
+		lcn += (INT64)delta;
+		ClusterRun r = { (UINT64)lcn, count };
+		runs.push_back(r);
+	}
+	return true;
+}
+
+HRESULT Mapper::MapNtfs(const byte * boot)
+{
+	auto bps = Get<WORD>(boot, 0x0B);
+	DWORD spc = boot[0x0D];
+	// large clusters store the power of two of their sector count, negated
+	auto clusterSize = (spc<=0x80 ? spc : 1u << (256 - spc)) * bps;
+	auto totalSectors = Get<UINT64>(boot, 0x28);
+	auto mftLcn = Get<UINT64>(boot, 0x30);
+	auto cpr = (signed char) boot[0x40];
+	auto recordSize = cpr<0 ? 1u << -cpr : cpr * clusterSize;
+	if (!IsPowerOfTwo(bps) || bps<512 || bps>4096 || !IsPowerOfTwo(clusterSize) || recordSize<1024 || recordSize>65536)
+		return ERROR_BAD_FORMAT;
+	alloc.fileSystem = L"NTFS";
+	alloc.clusterSize = clusterSize;
+	alloc.clusters = totalSectors * bps / clusterSize;
+	// $Bitmap is MFT record 6
+	vector<byte> rec(recordSize);
+	auto hr = Read(mftLcn * clusterSize + 6 * recordSize, rec.data(), rec.size());
+	if (hr) return hr;
+	if (!ApplyFixups(rec))
+		return ERROR_BAD_FORMAT;
+	vector<ClusterRun> runs;
+	bool found = false;
+	for (DWORD a = Get<WORD>(rec.data(), 0x14); a + 16 <= recordSize; )
+	{
+		auto type = Get<DWORD>(rec.data(), a);
+		auto len = Get<DWORD>(rec.data(), a + 4);
+		if (type==0xFFFFFFFF || len==0 || a + len > recordSize)
+			break;
+		// the unnamed, non-resident $DATA attribute
+		if (type==0x80 && rec[a+8]==1 && rec[a+9]==0)
+		{
+			auto runOffset = Get<WORD>(rec.data(), a + 0x20);
+			if (runOffset>=len || !ParseRuns(&rec[a + runOffset], &rec[a] + len, runs))
+				return ERROR_BAD_FORMAT;
+			found = true;
+			break;
+		}
+		a += len;
+	}
+	// a $Bitmap fragmented enough to need an attribute list is not followed
+	if (!found)
+		return ERROR_NOT_SUPPORTED;
+	vector<byte> bitmap((size_t)((alloc.clusters + 7) / 8));
+	size_t filled = 0;
+	for (size_t i=0; i<runs.size() && filled<bitmap.size(); i++)
+	{
+		auto n = runs[i].count * clusterSize;
+		if (n>bitmap.size() - filled)
+			n = bitmap.size() - filled;
+		hr = Read(runs[i].lcn * clusterSize, &bitmap[filled], (size_t)n);
+		if (hr) return hr;
+		filled += (size_t)n;
+	}
+	if (filled<bitmap.size())
+		return ERROR_BAD_FORMAT;
+	alloc.usedClusters = Scan(bitmap.data(), alloc.clusters, 0, clusterSize);
+	// the backup boot sector sits past the last cluster
+	Mark(alloc.clusters * clusterSize, size);
+	return 0;
+}
+
+HRESULT Mapper::MapFat(const byte * boot)
+{
+	auto bps = Get<WORD>(boot, 11);
+	DWORD spc = boot[13];
+	DWORD reserved = Get<WORD>(boot, 14);
+	DWORD fats = boot[16];
+	DWORD rootEntries = Get<WORD>(boot, 17);
+	DWORD total = Get<WORD>(boot, 19) ? Get<WORD>(boot, 19) : Get<DWORD>(boot, 32);
+	DWORD fatSize = Get<WORD>(boot, 22) ? Get<WORD>(boot, 22) : Get<DWORD>(boot, 36);
+	if (boot[510]!=0x55 || boot[511]!=0xAA)
+		return ERROR_UNRECOGNIZED_VOLUME;
+	if (!IsPowerOfTwo(bps) || bps<512 || bps>4096 || !IsPowerOfTwo(spc) || fats==0 || reserved==0 || fatSize==0)
+		return ERROR_UNRECOGNIZED_VOLUME;
+	auto rootSectors = (rootEntries * 32 + bps - 1) / bps;
+	auto firstData = (UINT64)reserved + (UINT64)fats * fatSize + rootSectors;
+	if (firstData>=total)
+		return ERROR_UNRECOGNIZED_VOLUME;
+	auto clusters = (total - firstData) / spc;
+	auto bits = clusters<4085 ? 12 : clusters<65525 ? 16 : 32;
+	alloc.fileSystem = bits==12 ? L"FAT12" : bits==16 ? L"FAT16" : L"FAT32";
+	alloc.clusterSize = spc * bps;
+	alloc.clusters = clusters;
+	// the FAT has entries 0 and 1 before the first cluster
+	auto fatBytes = ((UINT64)clusters + 2) * bits / 8 + 1;
+	if (fatBytes>(UINT64)fatSize * bps)
+		return ERROR_BAD_FORMAT;
+	vector<byte> fat((size_t)fatBytes);
+	auto hr = Read((UINT64)reserved * bps, fat.data(), fat.size());
+	if (hr) return hr;
+	// boot sector, FATs and the FAT12/16 root directory
+	Mark(0, firstData * bps);
+	DWORD bad = bits==12 ? 0xFF7 : bits==16 ? 0xFFF7 : 0x0FFFFFF7;
+	BeginRuns(firstData * bps, alloc.clusterSize);
+	for (UINT64 n=2; n<clusters + 2; n++)
+	{
+		DWORD entry;
+		if (bits==12)
+		{
+			auto v = Get<WORD>(fat.data(), (size_t)(n + n / 2));
+			entry = n & 1 ? v >> 4 : v & 0xFFF;
+		}
+		else if (bits==16)
+			entry = Get<WORD>(fat.data(), (size_t)n * 2);
+		else
+			entry = Get<DWORD>(fat.data(), (size_t)n * 4) & 0x0FFFFFFF;
+		// bad clusters cannot be read anyway
+		auto used = entry!=0 && entry!=bad;
+		alloc.usedClusters += used ? 1 : 0;
+		AddRun(used, 1);
+	}
+	EndRuns();
+	return 0;
+}
+
+// Groups 0 and 1 and powers of 3, 5 and 7 hold superblock backups under sparse_super
+static bool HasSuperBackup(UINT64 group, bool sparse)
+{
+	if (group<=1 || !sparse)
+		return true;
+	for (UINT64 base=3; base<=7; base+=2)
+	{
+		auto p = base;
+		while (p<group)
+			p *= base;
+		if (p==group)
+			return true;
+	}
+	return false;
+}
+
+HRESULT Mapper::MapExt(const byte * sb)
+{
+	auto blocks = (UINT64)Get<DWORD>(sb, 0x04);
+	auto firstDataBlock = Get<DWORD>(sb, 0x14);
+	auto logBlock = Get<DWORD>(sb, 0x18);
+	auto bpg = Get<DWORD>(sb, 0x20);
+	auto ipg = Get<DWORD>(sb, 0x28);
+	DWORD inodeSize = Get<DWORD>(sb, 0x4C)>=1 ? Get<WORD>(sb, 0x58) : 128;
+	auto compat = Get<DWORD>(sb, 0x5C);
+	auto incompat = Get<DWORD>(sb, 0x60);
+	auto roCompat = Get<DWORD>(sb, 0x64);
+	DWORD reservedGdt = compat & 0x10 ? Get<WORD>(sb, 0xCE) : 0;
+	DWORD descSize = 32;
+	if (incompat & 0x80)
+	{
+		blocks |= (UINT64)Get<DWORD>(sb, 0x150) << 32;
+		descSize = Get<WORD>(sb, 0xFE);
+	}
+	if (logBlock>6 || bpg==0 || !IsPowerOfTwo(descSize) || descSize<32 || descSize>1024 || blocks<=firstDataBlock)
+		return ERROR_BAD_FORMAT;
+	// with meta_bg the descriptors are spread over the groups
+	if (incompat & 0x10)
+		return ERROR_NOT_SUPPORTED;
+	DWORD bs = 1024 << logBlock;
+	alloc.fileSystem = incompat & 0x40 ? L"ext4" : compat & 0x4 ? L"ext3" : L"ext2";
+	alloc.clusterSize = bs;
+	alloc.clusters = blocks;
+	auto groups = (blocks - firstDataBlock + bpg - 1) / bpg;
+	auto gdtBlocks = (groups * descSize + bs - 1) / bs;
+	auto itableBlocks = ((UINT64)ipg * inodeSize + bs - 1) / bs;
+	vector<byte> descs((size_t)(groups * descSize));
+	auto hr = Read(((UINT64)firstDataBlock + 1) * bs, descs.data(), descs.size());
+	if (hr) return hr;
+	// boot block, superblock and descriptors of group 0
+	Mark(0, ((UINT64)firstDataBlock + 1 + gdtBlocks + reservedGdt) * bs);
+	alloc.usedClusters = firstDataBlock;
+	vector<byte> bitmap(bs);
+	for (UINT64 g=0; g<groups; g++)
+	{
+		auto d = &descs[(size_t)(g * descSize)];
+		auto wide = descSize>=64;
+		auto blockBitmap = Get<DWORD>(d, 0x0) | (wide ? (UINT64)Get<DWORD>(d, 0x20) << 32 : 0);
+		auto inodeBitmap = Get<DWORD>(d, 0x4) | (wide ? (UINT64)Get<DWORD>(d, 0x24) << 32 : 0);
+		auto inodeTable = Get<DWORD>(d, 0x8) | (wide ? (UINT64)Get<DWORD>(d, 0x28) << 32 : 0);
+		auto freeBlocks = Get<WORD>(d, 0xC) | (wide ? (DWORD)Get<WORD>(d, 0x2C) << 16 : 0);
+		auto flags = Get<WORD>(d, 0x12);
+		auto groupStart = firstDataBlock + g * bpg;
+		auto groupBlocks = blocks - groupStart < bpg ? blocks - groupStart : bpg;
+		alloc.usedClusters += groupBlocks - (freeBlocks<groupBlocks ? freeBlocks : groupBlocks);
+		// the metadata is marked on its own, a group whose bitmap is not initialized has nothing else
+		Mark(blockBitmap * bs, bs);
+		Mark(inodeBitmap * bs, bs);
+		Mark(inodeTable * bs, itableBlocks * bs);
+		if (HasSuperBackup(g, (roCompat & 0x1)!=0))
+			Mark(groupStart * bs, (1 + gdtBlocks + reservedGdt) * bs);
+		if (flags & 0x2)
+			continue;
+		hr = Read(blockBitmap * bs, bitmap.data(), bitmap.size());
+		if (hr) return hr;
+		Scan(bitmap.data(), groupBlocks, groupStart * bs, bs);
+	}
+	return 0;
+}
+
+HRESULT ReadAllocation(HANDLE h, UINT64 offset, UINT64 size, DWORD blockSize, Allocation & alloc)
+{
+	// the boot sector, and the ext superblock at 1024
+	byte head[2048];
+	Mapper m(h, offset, size, blockSize, alloc);
+	auto hr = m.Read(0, head, sizeof(head));
+	if (hr) return hr;
+	if (memcmp(head + 3, "NTFS    ", 8)==0)
+		return m.MapNtfs(head);
+	if (Get<WORD>(head, 1024 + 0x38)==0xEF53)
+		return m.MapExt(head + 1024);
+	return m.MapFat(head);
+}
@@ -0,0 +1,64 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ALLOCATION_H_
+#define ALLOCATION_H_
+
+#include <Windows.h>
+#include <vector>
+
+using namespace std;
+
+// What a file system has in use, read from its own structures on the raw
+// volume: the NTFS $Bitmap, the FAT, or the ext2/3/4 block group bitmaps.
+// File system metadata outside those maps counts as used.
+struct Allocation
+{
+	LPCWSTR fileSystem;
+	DWORD clusterSize;
+	UINT64 clusters;
+	UINT64 usedClusters;
+	// one entry per blockSize bytes of the range, true when any of it is in use
+	vector<bool> usedBlocks;
+	Allocation()
+	{
+		fileSystem = nullptr;
+		clusterSize = 0;
+		clusters = 0;
+		usedClusters = 0;
+	}
+};
+
+// Reads the allocation of the file system starting at offset in h, which may
+// be a volume, a partition or an image file, buffered or not. Only the first
+// size bytes are mapped. ERROR_UNRECOGNIZED_VOLUME for other file systems.
+HRESULT ReadAllocation(HANDLE h, UINT64 offset, UINT64 size, DWORD blockSize, Allocation & alloc);
+
+#endif//ALLOCATION_H_
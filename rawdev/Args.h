@@ -35,6 +35,9 @@
 #include "OsHelpers.h"
 #include <cwchar>
 
+const DWORD maxDeltas = 64;
+const DWORD maxTargets = 32;
+
 struct Args
 {
 	bool hasLv;
@@ -43,11 +46,57 @@ struct Args
 	bool hasHelp;
 	bool hasCp;
 	bool hasRead;
+	bool hasBench;
+	bool hasCmp;
+	bool random;
+	bool discard;
+	bool raw;
+	bool write;
+	bool direct;
+	bool sparse;
+	bool zeroed;
+	bool crc;
+	bool verify;
+	bool compress;
+	bool used;
+	bool tune;
+	bool background;
+	bool resume;
+	bool lowPriority;
+	bool map;
+	bool largePages;
 	LPWSTR cpSource;
+	LPWSTR benchTarget;
+	LPWSTR json;
 	LPWSTR cpDest;
+	LPWSTR cmpA;
+	LPWSTR cmpB;
+	LPWSTR fill;
+	LPWSTR pattern;
 	UINT64 offsetSource;
 	UINT64 offsetDest;
 	UINT64 length;
+	LPWSTR manifest;
+	LPWSTR base;
+	LPWSTR store;
+	LPWSTR rateFile;
+	LPWSTR journal;
+	LPWSTR rescue;
+	LPWSTR faults;
+	LPWSTR batch;
+	UINT64 rate;
+	DWORD iops;
+	LPWSTR deltas[maxDeltas];
+	DWORD deltaCount;
+	// destinations beyond the -cp one
+	LPWSTR targets[maxTargets];
+	DWORD targetCount;
+	DWORD queueDepth;
+	DWORD threads;
+	DWORD blockSize;
+	DWORD seconds;
+	DWORD maxDiffs;
+	UINT64 seed;
 	
 	Args() { memset(this, 0, sizeof(Args)); }
 	bool Parse(int argc, LPWSTR argv[])
@@ -67,6 +116,62 @@ struct Args
 				cpDest = CopyString(argv[i+2], wcslen(argv[i+2]));
 				i += 2;
 			}
+			else if (lstrcmp(argv[i], L"-bench")==0 && (i+1)<argc)
+			{
+				hasBench = true;
+				benchTarget = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-cmp")==0 && (i+2)<argc)
+			{
+				hasCmp = true;
+				cmpA = CopyString(argv[i+1], wcslen(argv[i+1]));
+				cmpB = CopyString(argv[i+2], wcslen(argv[i+2]));
+				i += 2;
+			}
+			else if (lstrcmp(argv[i], L"-maxdiffs")==0 && (i+1)<argc)
+			{
+				maxDiffs = _wtoi(argv[i+1]);
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-fill")==0 && (i+1)<argc)
+			{
+				fill = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-pattern")==0 && (i+1)<argc)
+			{
+				pattern = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-random")==0)
+				random = true;
+			else if (lstrcmp(argv[i], L"-seed")==0 && (i+1)<argc)
+			{
+				seed = _wtoi64(argv[i+1]);
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-discard")==0)
+				discard = true;
+			else if (lstrcmp(argv[i], L"-raw")==0)
+				raw = true;
+			else if (lstrcmp(argv[i], L"-write")==0)
+				write = true;
+			else if (lstrcmp(argv[i], L"-bs")==0 && (i+1)<argc)
+			{
+				blockSize = _wtoi(argv[i+1]);
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-seconds")==0 && (i+1)<argc)
+			{
+				seconds = _wtoi(argv[i+1]);
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-json")==0 && (i+1)<argc)
+			{
+				json = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
 			else if (lstrcmp(argv[i], L"-so")==0 && (i+1)<argc)
 			{
 				offsetSource = _wtoi64(argv[i+1]);
@@ -82,6 +187,102 @@ struct Args
 				length = _wtoi64(argv[i+1]);
 				i += 1;
 			}
+			else if (lstrcmp(argv[i], L"-qd")==0 && (i+1)<argc)
+			{
+				queueDepth = _wtoi(argv[i+1]);
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-threads")==0 && (i+1)<argc)
+			{
+				threads = _wtoi(argv[i+1]);
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-direct")==0)
+				direct = true;
+			else if (lstrcmp(argv[i], L"-sparse")==0)
+				sparse = true;
+			else if (lstrcmp(argv[i], L"-zeroed")==0)
+				zeroed = true;
+			else if (lstrcmp(argv[i], L"-crc")==0)
+				crc = true;
+			else if (lstrcmp(argv[i], L"-verify")==0)
+				verify = true;
+			else if (lstrcmp(argv[i], L"-z")==0)
+				compress = true;
+			else if (lstrcmp(argv[i], L"-used")==0)
+				used = true;
+			else if (lstrcmp(argv[i], L"-tune")==0)
+				tune = true;
+			else if (lstrcmp(argv[i], L"-rate")==0 && (i+1)<argc)
+			{
+				rate = _wtoi64(argv[i+1]);
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-iops")==0 && (i+1)<argc)
+			{
+				iops = _wtoi(argv[i+1]);
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-ratefile")==0 && (i+1)<argc)
+			{
+				rateFile = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-journal")==0 && (i+1)<argc)
+			{
+				journal = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-rescue")==0 && (i+1)<argc)
+			{
+				rescue = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-faults")==0 && (i+1)<argc)
+			{
+				faults = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-resume")==0)
+				resume = true;
+			else if (lstrcmp(argv[i], L"-lowprio")==0)
+				lowPriority = true;
+			else if (lstrcmp(argv[i], L"-map")==0)
+				map = true;
+			else if (lstrcmp(argv[i], L"-batch")==0 && (i+1)<argc)
+			{
+				batch = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-largepages")==0)
+				largePages = true;
+			else if (lstrcmp(argv[i], L"-background")==0)
+				background = true;
+			else if (lstrcmp(argv[i], L"-manifest")==0 && (i+1)<argc)
+			{
+				manifest = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-base")==0 && (i+1)<argc)
+			{
+				base = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-store")==0 && (i+1)<argc)
+			{
+				store = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-delta")==0 && (i+1)<argc && deltaCount<maxDeltas)
+			{
+				deltas[deltaCount++] = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
+			else if (lstrcmp(argv[i], L"-to")==0 && (i+1)<argc && targetCount<maxTargets)
+			{
+				targets[targetCount++] = CopyString(argv[i+1], wcslen(argv[i+1]));
+				i += 1;
+			}
 			else if (lstrcmp(argv[i], L"-all")==0 || lstrcmp(argv[i], L"-a")==0)
 				allVolumes = true;
 			else
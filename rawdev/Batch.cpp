@@ -0,0 +1,389 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Batch.h"
+#include "Finders.h"
+#include "Histogram.h"
+#include "PartitionTable.h"
+#include "Volume.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+enum BatchState { BatchWaiting, BatchRunning, BatchDone };
+
+struct BatchJob
+{
+	wstring line;
+	wstring json;
+	bool ownJson;
+	// disk numbers, or unknownDevice and up for endpoints on no known disk
+	vector<DWORD> devices;
+	BatchState state;
+	HANDLE process;
+	DWORD exitCode;
+	UINT64 start;
+	UINT64 elapsedNs;
+	UINT64 bytes;
+	BatchJob()
+	{
+		ownJson = false;
+		state = BatchWaiting;
+		process = nullptr;
+		exitCode = 0;
+		start = 0;
+		elapsedNs = 0;
+		bytes = 0;
+	}
+};
+
+static const DWORD unknownDevice = 0x80000000;
+
+// Splits a command line the way the C runtime does for the simple cases:
+// blanks separate arguments, double quotes group them
+static vector<wstring> SplitArgs(const wstring & line)
+{
+	vector<wstring> args;
+	wstring arg;
+	auto quoted = false;
+	auto any = false;
+	for (auto c : line)
+	{
+		if (c==L'"')
+		{
+			quoted = !quoted;
+			any = true;
+		}
+		else if (!quoted && (c==L' ' || c==L'\t'))
+		{
+			if (any)
+				args.push_back(arg);
+			arg.clear();
+			any = false;
+		}
+		else
+		{
+			arg += c;
+			any = true;
+		}
+	}
+	if (any)
+		args.push_back(arg);
+	return args;
+}
+
+static void AddDevice(vector<DWORD> & devices, DWORD device)
+{
+	for (auto d : devices)
+		if (d==device)
+			return;
+	devices.push_back(device);
+}
+
+static void AddVolume(vector<DWORD> & devices, const Volume * v)
+{
+	for (auto &e : v->extents)
+		AddDevice(devices, e.DiskNumber);
+}
+
+// The disks name lives on. A file counts as the volume it is on; what
+// cannot be traced to a disk gets a device of its own per volume root.
+static void ResolveDevices(LPCWSTR name, vector<wstring> & unknown, vector<DWORD> & devices)
+{
+	WCHAR path[MAX_PATH+1];
+	lstrcpyn(path, name, ARRAYSIZE(path));
+	auto v = FindVolume(path);
+	if (v)
+		return AddVolume(devices, v);
+	auto d = FindDrive(path);
+	if (d)
+		return AddDevice(devices, d->number);
+	auto p = FindPartition(path);
+	if (p)
+		return AddDevice(devices, p->disk);
+	WCHAR file[MAX_PATH+1];
+	DWORD number;
+	if (!SplitPartitionName(name, file, ARRAYSIZE(file), number))
+		lstrcpyn(file, name, ARRAYSIZE(file));
+	WCHAR root[MAX_PATH+1];
+	WCHAR volume[MAX_PATH+1];
+	if (GetVolumePathName(file, root, ARRAYSIZE(root)))
+	{
+		v = FindVolume(root);
+		if (!v && GetVolumeNameForVolumeMountPoint(root, volume, ARRAYSIZE(volume)))
+			v = FindVolume(volume);
+		if (v && !v->extents.empty())
+			return AddVolume(devices, v);
+	}
+	else
+		lstrcpyn(root, file, ARRAYSIZE(root));
+	for (size_t i=0; i<unknown.size(); i++)
+	{
+		if (lstrcmpi(unknown[i].c_str(), root)==0)
+			return AddDevice(devices, unknownDevice + (DWORD)i);
+	}
+	unknown.push_back(root);
+	AddDevice(devices, unknownDevice + (DWORD)(unknown.size() - 1));
+}
+
+// The log and JSON summary of job n are kept next to the batch file
+static wstring JobFile(LPCWSTR file, size_t n, LPCWSTR extension)
+{
+	return wstring(file) + L"." + to_wstring((unsigned long long)n) + extension;
+}
+
+// the longest ".n.json" or ".n.log" a job file name adds
+static const size_t jobFileSuffix = 16;
+
+static HRESULT LoadBatch(LPCWSTR file, vector<BatchJob> & jobs)
+{
+	if (wcslen(file) + jobFileSuffix >= MAX_PATH)
+	{
+		wprintf(L"%s: the path is too long to name the job logs after it\n", file);
+		return ERROR_FILENAME_EXCED_RANGE;
+	}
+	FILE * f;
+	if (_wfopen_s(&f, file, L"r")!=0)
+		return ERROR_OPEN_FAILED;
+	HRESULT hr = 0;
+	vector<wstring> unknown;
+	WCHAR line[4096];
+	DWORD lineNumber = 0;
+	while (!hr && fgetws(line, ARRAYSIZE(line), f))
+	{
+		lineNumber++;
+		auto len = wcslen(line);
+		while (len>0 && (line[len-1]==L'\n' || line[len-1]==L'\r'))
+			line[--len] = 0;
+		auto args = SplitArgs(line);
+		if (args.empty() || args[0][0]==L'#')
+			continue;
+		BatchJob job;
+		job.line = line;
+		auto hasCp = false;
+		for (size_t i=0; i<args.size(); i++)
+		{
+			if (args[i]==L"-cp" && i+2<args.size())
+			{
+				hasCp = true;
+				ResolveDevices(args[i+1].c_str(), unknown, job.devices);
+				ResolveDevices(args[i+2].c_str(), unknown, job.devices);
+				i += 2;
+			}
+			else if (args[i]==L"-to" && i+1<args.size())
+				ResolveDevices(args[++i].c_str(), unknown, job.devices);
+			else if (args[i]==L"-json" && i+1<args.size())
+				job.json = args[++i];
+			else if (args[i]==L"-batch")
+				hasCp = false;
+		}
+		if (!hasCp)
+		{
+			wprintf(L"%s(%u): each line must be one -cp job\n", file, lineNumber);
+			hr = ERROR_BAD_FORMAT;
+			break;
+		}
+		// the child reports how much it moved through its JSON summary
+		job.ownJson = job.json.empty();
+		if (job.ownJson)
+			job.json = JobFile(file, jobs.size() + 1, L".json");
+		jobs.push_back(job);
+	}
+	fclose(f);
+	return hr;
+}
+
+static HRESULT StartJob(LPCWSTR exe, LPCWSTR file, DWORD index, BatchJob & job)
+{
+	auto log = JobFile(file, index + 1, L".log");
+	SECURITY_ATTRIBUTES sa;
+	sa.nLength = sizeof(sa);
+	sa.lpSecurityDescriptor = nullptr;
+	sa.bInheritHandle = TRUE;
+	auto hlog = CreateFile(log.c_str(), GENERIC_WRITE, FILE_SHARE_READ, &sa, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hlog==INVALID_HANDLE_VALUE)
+		return GetLastError();
+	auto command = L"\"" + wstring(exe) + L"\" " + job.line;
+	if (job.ownJson)
+		command += L" -json \"" + job.json + L"\"";
+	vector<WCHAR> buf(command.begin(), command.end());
+	buf.push_back(0);
+	STARTUPINFO si;
+	memset(&si, 0, sizeof(si));
+	si.cb = sizeof(si);
+	si.dwFlags = STARTF_USESTDHANDLES;
+	si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+	si.hStdOutput = hlog;
+	si.hStdError = hlog;
+	PROCESS_INFORMATION pi;
+	auto ok = CreateProcess(nullptr, buf.data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr, &si, &pi);
+	auto error = GetLastError();
+	CloseHandle(hlog);
+	if (!ok)
+		return error;
+	CloseHandle(pi.hThread);
+	job.process = pi.hProcess;
+	job.state = BatchRunning;
+	job.start = Now();
+	wprintf(L"Job %u started: %s\n", index + 1, job.line.c_str());
+	return 0;
+}
+
+// Takes the bytes moved from the child's JSON summary
+static void ReadJobBytes(BatchJob & job)
+{
+	FILE * f;
+	if (_wfopen_s(&f, job.json.c_str(), L"r")!=0)
+		return;
+	WCHAR line[1024];
+	while (fgetws(line, ARRAYSIZE(line), f))
+	{
+		UINT64 bytes;
+		auto p = wcsstr(line, L"\"bytes\": ");
+		if (p && swscanf(p, L"\"bytes\": %I64u", &bytes)==1)
+		{
+			job.bytes = bytes;
+			break;
+		}
+	}
+	fclose(f);
+	if (job.ownJson)
+		DeleteFile(job.json.c_str());
+}
+
+static void FinishJob(DWORD index, BatchJob & job)
+{
+	job.elapsedNs = TicksToNs(Now() - job.start);
+	GetExitCodeProcess(job.process, &job.exitCode);
+	CloseHandle(job.process);
+	job.process = nullptr;
+	job.state = BatchDone;
+	if (job.exitCode==0)
+		ReadJobBytes(job);
+	wprintf(L"Job %u %s after %.1f s\n", index + 1, job.exitCode==0 ? L"finished" : L"failed", job.elapsedNs / 1e9);
+}
+
+static bool Shares(const vector<DWORD> & a, const vector<DWORD> & b)
+{
+	for (auto x : a)
+		for (auto y : b)
+			if (x==y)
+				return true;
+	return false;
+}
+
+static void Report(const vector<BatchJob> & jobs, UINT64 elapsedNs)
+{
+	UINT64 total = 0;
+	DWORD failed = 0;
+	wprintf(L"\n%5s %8s %16s %9s %9s  %s\n", L"Job", L"Result", L"Bytes", L"Seconds", L"MB/s", L"Command");
+	for (size_t i=0; i<jobs.size(); i++)
+	{
+		const auto & j = jobs[i];
+		auto seconds = j.elapsedNs / 1e9;
+		WCHAR result[16];
+		if (j.state!=BatchDone)
+			lstrcpyn(result, L"not run", ARRAYSIZE(result));
+		else if (j.exitCode==0)
+			lstrcpyn(result, L"ok", ARRAYSIZE(result));
+		else
+			wsprintf(result, L"%u", j.exitCode);
+		wprintf(L"%5u %8s %16I64u %9.1f %9.1f  %s\n", (DWORD)i + 1, result, j.bytes, seconds, seconds>0 ? j.bytes / seconds / 1024 / 1024 : 0.0, j.line.c_str());
+		total += j.bytes;
+		if (j.state!=BatchDone || j.exitCode!=0)
+			failed++;
+	}
+	auto seconds = elapsedNs / 1e9;
+	wprintf(L"%u jobs, %u failed, %I64u bytes in %.1f s, %.1f MB/s overall\n", (DWORD)jobs.size(), failed, total, seconds, seconds>0 ? total / seconds / 1024 / 1024 : 0.0);
+}
+
+int RunBatch(LPCWSTR file)
+{
+	vector<BatchJob> jobs;
+	auto hr = LoadBatch(file, jobs);
+	if (hr) return hr;
+	WCHAR exe[MAX_PATH+1];
+	if (!GetModuleFileName(nullptr, exe, ARRAYSIZE(exe)))
+		return GetLastError();
+	auto start = Now();
+	size_t done = 0;
+	while (done<jobs.size())
+	{
+		// a job waits while any of its disks is busy or claimed by an earlier waiting job
+		vector<DWORD> claimed;
+		DWORD running = 0;
+		for (auto &j : jobs)
+		{
+			if (j.state==BatchRunning)
+			{
+				claimed.insert(claimed.end(), j.devices.begin(), j.devices.end());
+				running++;
+			}
+		}
+		for (size_t i=0; i<jobs.size() && !hr; i++)
+		{
+			auto & j = jobs[i];
+			if (j.state!=BatchWaiting)
+				continue;
+			if (running<MAXIMUM_WAIT_OBJECTS && !Shares(j.devices, claimed))
+			{
+				hr = StartJob(exe, file, (DWORD)i, j);
+				if (!hr)
+					running++;
+			}
+			claimed.insert(claimed.end(), j.devices.begin(), j.devices.end());
+		}
+		if (running==0)
+			break;
+		HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+		DWORD indexes[MAXIMUM_WAIT_OBJECTS];
+		DWORD count = 0;
+		for (size_t i=0; i<jobs.size(); i++)
+		{
+			if (jobs[i].state!=BatchRunning)
+				continue;
+			indexes[count] = (DWORD)i;
+			handles[count++] = jobs[i].process;
+		}
+		auto wait = WaitForMultipleObjects(count, handles, FALSE, INFINITE);
+		if (wait>=WAIT_OBJECT_0 + count)
+			return GetLastError();
+		FinishJob(indexes[wait - WAIT_OBJECT_0], jobs[indexes[wait - WAIT_OBJECT_0]]);
+		done++;
+	}
+	Report(jobs, TicksToNs(Now() - start));
+	if (hr) return hr;
+	for (auto &j : jobs)
+		if (j.state!=BatchDone || j.exitCode!=0)
+			return ERROR_GEN_FAILURE;
+	return 0;
+}
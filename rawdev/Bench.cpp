@@ -0,0 +1,257 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Bench.h"
+#include "BufferPool.h"
+#include "Report.h"
+
+static const BenchTest readTests[] = { { L"seqread", false, false }, { L"randread", false, true } };
+static const BenchTest writeTests[] = { { L"seqwrite", true, false }, { L"randwrite", true, true } };
+static const DWORD fillBlockSize = 1024*1024;
+static const DWORD fillQueueDepth = 4;
+
+struct BenchIo
+{
+	OVERLAPPED ov;
+	byte * buf;
+	UINT64 start;
+};
+
+// One completion port for the handle, reused by every test on it
+struct BenchRunner
+{
+	const BenchJob & job;
+	HANDLE port;
+	byte * mem;
+	vector<BenchIo> ios;
+	vector<OVERLAPPED_ENTRY> entries;
+	const BenchTest * test;
+	DWORD blockSize;
+	UINT64 blocks;
+	UINT64 cursor;
+	UINT64 random;
+	DWORD inFlight;
+
+	BenchRunner(const BenchJob & j) : job(j)
+	{
+		port = nullptr;
+		mem = nullptr;
+		test = nullptr;
+		blockSize = 0;
+		blocks = 0;
+		cursor = 0;
+		random = 0x9E3779B97F4A7C15ull;
+		inFlight = 0;
+	}
+
+	~BenchRunner()
+	{
+		if (port) CloseHandle(port);
+		FreeIoBuffer(mem);
+	}
+
+	HRESULT Init()
+	{
+		DWORD maxBlock = fillBlockSize;
+		for (auto bs : job.blockSizes)
+			if (bs>maxBlock) maxBlock = bs;
+		DWORD maxDepth = fillQueueDepth;
+		for (auto qd : job.queueDepths)
+			if (qd>maxDepth) maxDepth = qd;
+		mem = AllocIoBuffer((SIZE_T)maxBlock * maxDepth);
+		if (!mem)
+			return GetLastError();
+		// incompressible, so devices that compress or deduplicate get no shortcut
+		auto words = (UINT64 *) mem;
+		for (SIZE_T i=0; i<(SIZE_T)maxBlock * maxDepth / sizeof(UINT64); i++)
+			words[i] = Next();
+		ios.resize(maxDepth);
+		for (DWORD i=0; i<maxDepth; i++)
+			ios[i].buf = mem + (SIZE_T)i * maxBlock;
+		entries.resize(maxDepth);
+		port = CreateIoCompletionPort(job.h, nullptr, 0, 1);
+		if (!port)
+			return GetLastError();
+		return 0;
+	}
+
+	// xorshift64*, plenty for picking offsets
+	UINT64 Next()
+	{
+		random ^= random >> 12;
+		random ^= random << 25;
+		random ^= random >> 27;
+		return random * 2685821657736338717ull;
+	}
+
+	HRESULT Submit(BenchIo & io)
+	{
+		auto block = test->random ? Next() % blocks : cursor++ % blocks;
+		auto offset = job.offset + block * blockSize;
+		memset(&io.ov, 0, sizeof(io.ov));
+		io.ov.Offset = (DWORD)offset;
+		io.ov.OffsetHigh = (DWORD)(offset >> 32);
+		io.start = Now();
+		auto ok = test->write
+			? WriteFile(job.h, io.buf, blockSize, nullptr, &io.ov)
+			: ReadFile(job.h, io.buf, blockSize, nullptr, &io.ov);
+		if (!ok && GetLastError()!=ERROR_IO_PENDING)
+			return GetLastError();
+		inFlight++;
+		return 0;
+	}
+
+	// Keeps queueDepth I/Os in flight until the time is up, or with once, until every block was done once
+	HRESULT Run(const BenchTest & t, DWORD bs, DWORD qd, bool once, BenchResult & r)
+	{
+		test = &t;
+		blockSize = bs;
+		blocks = job.size / bs;
+		cursor = 0;
+		r.test = &t;
+		r.blockSize = bs;
+		r.queueDepth = qd;
+		r.ios = 0;
+		r.bytes = 0;
+		r.latency.Clear();
+		if (blocks==0)
+			return ERROR_INVALID_PARAMETER;
+		auto limitNs = (UINT64)job.seconds * 1000000000;
+		auto start = Now();
+		HRESULT hr = 0;
+		for (DWORD i=0; i<qd && !hr && (!once || cursor<blocks); i++)
+			hr = Submit(ios[i]);
+		auto stopping = hr!=0;
+		while (inFlight>0)
+		{
+			ULONG count;
+			if (!GetQueuedCompletionStatusEx(port, entries.data(), qd, &count, INFINITE, FALSE))
+				return GetLastError();
+			auto now = Now();
+			if (!once && TicksToNs(now - start)>=limitNs)
+				stopping = true;
+			for (ULONG i=0; i<count; i++)
+			{
+				auto & io = *(BenchIo *) entries[i].lpOverlapped;
+				inFlight--;
+				DWORD len;
+				HRESULT ihr = 0;
+				if (!GetOverlappedResult(job.h, &io.ov, &len, FALSE))
+					ihr = GetLastError();
+				else if (len!=blockSize)
+					ihr = ERROR_HANDLE_EOF;
+				if (ihr)
+				{
+					if (!hr) hr = ihr;
+					stopping = true;
+					continue;
+				}
+				r.latency.Add(TicksToNs(now - io.start));
+				r.ios++;
+				r.bytes += len;
+				if (stopping || (once && cursor>=blocks))
+					continue;
+				hr = Submit(io);
+				if (hr) stopping = true;
+			}
+		}
+		r.elapsedNs = TicksToNs(Now() - start);
+		return hr;
+	}
+};
+
+HRESULT PrepareBench(const BenchJob & job)
+{
+	BenchRunner runner(job);
+	auto hr = runner.Init();
+	if (hr) return hr;
+	BenchResult r;
+	return runner.Run(writeTests[0], fillBlockSize, fillQueueDepth, true, r);
+}
+
+static void Print(const BenchResult & r)
+{
+	auto seconds = r.elapsedNs / 1e9;
+	wprintf(L"%-9s bs=%5uK qd=%-3u %9.1f MB/s %9.0f IOPS  p50=%.1fus p99=%.1fus p999=%.1fus\n",
+		r.test->name, r.blockSize / 1024, r.queueDepth,
+		seconds>0 ? r.bytes / seconds / 1024 / 1024 : 0.0, seconds>0 ? r.ios / seconds : 0.0,
+		r.latency.Percentile(500) / 1000.0, r.latency.Percentile(990) / 1000.0, r.latency.Percentile(999) / 1000.0);
+}
+
+HRESULT RunBench(const BenchJob & job, vector<BenchResult> & results)
+{
+	BenchRunner runner(job);
+	auto hr = runner.Init();
+	if (hr) return hr;
+	for (DWORD w=0; w<(job.write ? 2u : 1u); w++)
+	{
+		for (DWORD t=0; t<2; t++)
+		{
+			const auto & test = w ? writeTests[t] : readTests[t];
+			for (auto bs : job.blockSizes)
+			{
+				for (auto qd : job.queueDepths)
+				{
+					results.push_back(BenchResult());
+					hr = runner.Run(test, bs, qd, false, results.back());
+					if (hr) return hr;
+					Print(results.back());
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+HRESULT SaveBenchJson(LPCWSTR name, LPCWSTR target, const vector<BenchResult> & results)
+{
+	FILE * f;
+	if (_wfopen_s(&f, name, L"w")!=0)
+		return ERROR_OPEN_FAILED;
+	fwprintf(f, L"{\n  \"target\": ");
+	PutJsonString(f, target);
+	fwprintf(f, L",\n  \"tests\": [");
+	for (size_t i=0; i<results.size(); i++)
+	{
+		const auto & r = results[i];
+		const auto & l = r.latency;
+		auto seconds = r.elapsedNs / 1e9;
+		fwprintf(f, L"%s\n    { \"test\": \"%s\", \"blockSize\": %u, \"queueDepth\": %u, \"ios\": %I64u, \"bytes\": %I64u, \"seconds\": %.3f,",
+			i ? L"," : L"", r.test->name, r.blockSize, r.queueDepth, r.ios, r.bytes, seconds);
+		fwprintf(f, L" \"mbPerSecond\": %.1f, \"iops\": %.0f,",
+			seconds>0 ? r.bytes / seconds / 1024 / 1024 : 0.0, seconds>0 ? r.ios / seconds : 0.0);
+		fwprintf(f, L" \"latencyNs\": { \"mean\": %I64u, \"p50\": %I64u, \"p99\": %I64u, \"p999\": %I64u, \"max\": %I64u } }",
+			l.Mean(), l.Percentile(500), l.Percentile(990), l.Percentile(999), l.max);
+	}
+	fwprintf(f, L"\n  ]\n}\n");
+	auto failed = ferror(f)!=0;
+	fclose(f);
+	return failed ? ERROR_WRITE_FAULT : 0;
+}
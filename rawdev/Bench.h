@@ -0,0 +1,90 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <Windows.h>
+#include <vector>
+#include "Histogram.h"
+
+using namespace std;
+
+struct BenchTest
+{
+	LPCWSTR name;
+	bool write;
+	bool random;
+};
+
+struct BenchResult
+{
+	const BenchTest * test;
+	DWORD blockSize;
+	DWORD queueDepth;
+	UINT64 ios;
+	UINT64 bytes;
+	UINT64 elapsedNs;
+	// per I/O, in nanoseconds
+	Histogram latency;
+};
+
+// Sequential and random reads, and with write also writes, over size bytes
+// of h from offset, for every combination of block size and queue depth.
+// h must be opened with FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING.
+struct BenchJob
+{
+	HANDLE h;
+	UINT64 offset;
+	UINT64 size;
+	bool write;
+	DWORD seconds;
+	vector<DWORD> blockSizes;
+	vector<DWORD> queueDepths;
+	BenchJob()
+	{
+		h = INVALID_HANDLE_VALUE;
+		offset = 0;
+		size = 0;
+		write = false;
+		seconds = 5;
+	}
+};
+
+// Fills size bytes from offset once, so a new test file reads back from the device
+HRESULT PrepareBench(const BenchJob & job);
+
+// Prints one line per test as it finishes
+HRESULT RunBench(const BenchJob & job, vector<BenchResult> & results);
+
+// The results as a JSON document, for comparing runs across machines
+HRESULT SaveBenchJson(LPCWSTR name, LPCWSTR target, const vector<BenchResult> & results);
+
+#endif//BENCH_H_
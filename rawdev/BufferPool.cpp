@@ -0,0 +1,137 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "BufferPool.h"
+#include <vector>
+
+using namespace std;
+
+// Released buffers beyond this many bytes go back to the system
+static const SIZE_T poolKeep = 256*1024*1024;
+
+struct PooledBuffer
+{
+	byte * buf;
+	SIZE_T size;
+	bool inUse;
+};
+
+static vector<PooledBuffer> pool;
+static SRWLOCK poolLock = SRWLOCK_INIT;
+static SIZE_T largePageSize = 0;
+
+bool EnableLargePages()
+{
+	// large pages are locked in memory, which takes SeLockMemoryPrivilege
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+		return false;
+	TOKEN_PRIVILEGES tp;
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	auto ok = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(token, FALSE, &tp, 0, nullptr, nullptr)
+		&& GetLastError()!=ERROR_NOT_ALL_ASSIGNED;
+	CloseHandle(token);
+	if (!ok)
+		return false;
+	largePageSize = GetLargePageMinimum();
+	return largePageSize!=0;
+}
+
+static byte * Allocate(SIZE_T & size)
+{
+	if (largePageSize && size>=largePageSize)
+	{
+		auto large = (size + largePageSize - 1) / largePageSize * largePageSize;
+		auto buf = (byte *) VirtualAlloc(nullptr, large, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+		// physical memory gets fragmented, so large pages can run out at any time
+		if (buf)
+		{
+			size = large;
+			return buf;
+		}
+	}
+	return (byte *) VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+byte * AllocIoBuffer(SIZE_T size)
+{
+	AcquireSRWLockExclusive(&poolLock);
+	PooledBuffer * best = nullptr;
+	for (auto &b : pool)
+	{
+		if (!b.inUse && b.size>=size && (!best || b.size<best->size))
+			best = &b;
+	}
+	if (best)
+	{
+		best->inUse = true;
+		auto buf = best->buf;
+		ReleaseSRWLockExclusive(&poolLock);
+		return buf;
+	}
+	ReleaseSRWLockExclusive(&poolLock);
+	auto buf = Allocate(size);
+	if (!buf)
+		return nullptr;
+	PooledBuffer b = { buf, size, true };
+	AcquireSRWLockExclusive(&poolLock);
+	pool.push_back(b);
+	ReleaseSRWLockExclusive(&poolLock);
+	return buf;
+}
+
+void FreeIoBuffer(byte * buf)
+{
+	if (!buf)
+		return;
+	AcquireSRWLockExclusive(&poolLock);
+	SIZE_T kept = 0;
+	for (auto &b : pool)
+	{
+		if (!b.inUse)
+			kept += b.size;
+	}
+	for (size_t i=0; i<pool.size(); i++)
+	{
+		if (pool[i].buf!=buf)
+			continue;
+		if (kept + pool[i].size<=poolKeep)
+			pool[i].inUse = false;
+		else
+		{
+			VirtualFree(buf, 0, MEM_RELEASE);
+			pool.erase(pool.begin() + i);
+		}
+		break;
+	}
+	ReleaseSRWLockExclusive(&poolLock);
+}
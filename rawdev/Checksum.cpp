@@ -0,0 +1,156 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Checksum.h"
+#include <bcrypt.h>
+#include <intrin.h>
+#include <nmmintrin.h>
+
+static const DWORD castagnoli = 0x82F63B78;
+
+static bool HasSse42()
+{
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1<<20))!=0;
+}
+
+static const bool hasSse42 = HasSse42();
+
+struct Crc32cTable
+{
+	DWORD entries[256];
+	Crc32cTable()
+	{
+		for (DWORD i=0; i<256; i++)
+		{
+			auto c = i;
+			for (auto k=0; k<8; k++)
+				c = c & 1 ? (c >> 1) ^ castagnoli : c >> 1;
+			entries[i] = c;
+		}
+	}
+};
+
+static const Crc32cTable table;
+
+DWORD Crc32c(DWORD crc, const void * data, size_t len)
+{
+	auto p = (const byte *) data;
+	auto c = ~crc;
+	if (hasSse42)
+	{
+		UINT64 c64 = c;
+		for (; len>=8; p+=8, len-=8)
+			c64 = _mm_crc32_u64(c64, *(const UINT64 *)p);
+		c = (DWORD)c64;
+		for (; len>0; p++, len--)
+			c = _mm_crc32_u8(c, *p);
+	}
+	else
+	{
+		for (; len>0; p++, len--)
+			c = table.entries[(c ^ *p) & 0xFF] ^ (c >> 8);
+	}
+	return ~c;
+}
+
+// Combining works by advancing crcA over lenB zero bytes with a GF(2) matrix
+// raised to lenB by squaring, as in zlib's crc32_combine.
+static DWORD Gf2Times(const DWORD * mat, DWORD vec)
+{
+	DWORD sum = 0;
+	for (; vec; vec >>= 1, mat++)
+		if (vec & 1) sum ^= *mat;
+	return sum;
+}
+
+static void Gf2Square(DWORD * square, const DWORD * mat)
+{
+	for (auto n=0; n<32; n++)
+		square[n] = Gf2Times(mat, mat[n]);
+}
+
+DWORD Crc32cCombine(DWORD crcA, DWORD crcB, UINT64 lenB)
+{
+	if (lenB==0)
+		return crcA;
+	DWORD even[32];
+	DWORD odd[32];
+	odd[0] = castagnoli;
+	DWORD row = 1;
+	for (auto n=1; n<32; n++, row <<= 1)
+		odd[n] = row;
+	Gf2Square(even, odd);
+	Gf2Square(odd, even);
+	while (true)
+	{
+		Gf2Square(even, odd);
+		if (lenB & 1) crcA = Gf2Times(even, crcA);
+		lenB >>= 1;
+		if (!lenB) break;
+		Gf2Square(odd, even);
+		if (lenB & 1) crcA = Gf2Times(odd, crcA);
+		lenB >>= 1;
+		if (!lenB) break;
+	}
+	return crcA ^ crcB;
+}
+
+struct Sha256Provider
+{
+	BCRYPT_ALG_HANDLE alg;
+	Sha256Provider()
+	{
+		if (BCryptOpenAlgorithmProvider(&alg, BCRYPT_SHA256_ALGORITHM, nullptr, 0)<0)
+			alg = nullptr;
+	}
+	~Sha256Provider()
+	{
+		if (alg) BCryptCloseAlgorithmProvider(alg, 0);
+	}
+};
+
+static const Sha256Provider sha256;
+
+HRESULT Sha256(const void * data, size_t len, byte digest[sha256Size])
+{
+	if (!sha256.alg)
+		return ERROR_NOT_SUPPORTED;
+	BCRYPT_HASH_HANDLE h;
+	auto status = BCryptCreateHash(sha256.alg, &h, nullptr, 0, nullptr, 0, 0);
+	if (status<0)
+		return ERROR_INVALID_FUNCTION;
+	status = BCryptHashData(h, (PUCHAR) data, (ULONG) len, 0);
+	if (status>=0)
+		status = BCryptFinishHash(h, digest, sha256Size, 0);
+	BCryptDestroyHash(h);
+	return status<0 ? ERROR_INVALID_FUNCTION : 0;
+}
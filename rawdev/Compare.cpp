@@ -0,0 +1,324 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Compare.h"
+#include "BufferPool.h"
+#include "Simd.h"
+#include <cstdio>
+
+struct CompareSlot
+{
+	OVERLAPPED ov;
+	byte * buf;
+	DWORD len;
+};
+
+// One input, read ahead into a ring of queueDepth slots. Block k lives in
+// slot k % queueDepth until the comparer is done with it.
+struct CompareSide
+{
+	HANDLE h;
+	UINT64 offset;
+	vector<CompareSlot> ring;
+	byte * mem;
+	// blocks read completely, in order
+	volatile UINT64 filled;
+	HRESULT error;
+
+	CompareSide()
+	{
+		h = INVALID_HANDLE_VALUE;
+		offset = 0;
+		mem = nullptr;
+		filled = 0;
+		error = 0;
+	}
+
+	~CompareSide()
+	{
+		for (auto &s : ring)
+			if (s.ov.hEvent) CloseHandle((HANDLE)((ULONG_PTR)s.ov.hEvent & ~(ULONG_PTR)1));
+		FreeIoBuffer(mem);
+	}
+};
+
+struct Comparer
+{
+	const CompareJob & job;
+	vector<CompareRange> & ranges;
+	CompareSide sides[2];
+	UINT64 blocks;
+	// blocks both sides may reuse the slot of
+	UINT64 consumed;
+	bool stopped;
+	SRWLOCK lock;
+	CONDITION_VARIABLE changed;
+
+	Comparer(const CompareJob & j, vector<CompareRange> & r) : job(j), ranges(r)
+	{
+		blocks = (job.size + job.blockSize - 1) / job.blockSize;
+		consumed = 0;
+		stopped = false;
+		InitializeSRWLock(&lock);
+		InitializeConditionVariable(&changed);
+		sides[0].h = job.a;
+		sides[0].offset = job.offsetA;
+		sides[1].h = job.b;
+		sides[1].offset = job.offsetB;
+	}
+
+	HRESULT Init()
+	{
+		for (auto &side : sides)
+		{
+			side.mem = AllocIoBuffer((SIZE_T)job.blockSize * job.queueDepth);
+			if (!side.mem)
+				return GetLastError();
+			side.ring.resize(job.queueDepth);
+			for (DWORD i=0; i<job.queueDepth; i++)
+			{
+				auto & s = side.ring[i];
+				memset(&s.ov, 0, sizeof(s.ov));
+				s.buf = side.mem + (SIZE_T)i * job.blockSize;
+				auto event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+				if (!event)
+					return GetLastError();
+				// the low bit keeps completions off any port the handle is bound to
+				s.ov.hEvent = (HANDLE)((ULONG_PTR)event | 1);
+			}
+		}
+		return 0;
+	}
+
+	void Fail(CompareSide & side, HRESULT hr)
+	{
+		AcquireSRWLockExclusive(&lock);
+		side.error = hr;
+		stopped = true;
+		ReleaseSRWLockExclusive(&lock);
+		WakeAllConditionVariable(&changed);
+	}
+
+	// Keeps up to queueDepth reads in flight and publishes them in order
+	void Read(CompareSide & side)
+	{
+		UINT64 issued = 0;
+		UINT64 completed = 0;
+		while (completed<blocks)
+		{
+			while (issued<blocks && issued - completed<job.queueDepth)
+			{
+				// the comparer must be done with the block that used this slot before
+				AcquireSRWLockExclusive(&lock);
+				while (!stopped && consumed + job.queueDepth<=issued)
+					SleepConditionVariableSRW(&changed, &lock, INFINITE, 0);
+				auto stop = stopped;
+				ReleaseSRWLockExclusive(&lock);
+				if (stop)
+					return Drain(side, issued, completed);
+				auto & s = side.ring[(size_t)(issued % job.queueDepth)];
+				auto pos = issued * job.blockSize;
+				s.len = job.size - pos < job.blockSize ? (DWORD)(job.size - pos) : job.blockSize;
+				auto at = side.offset + pos;
+				s.ov.Offset = (DWORD)at;
+				s.ov.OffsetHigh = (DWORD)(at >> 32);
+				if (!ReadFile(side.h, s.buf, s.len, nullptr, &s.ov) && GetLastError()!=ERROR_IO_PENDING)
+				{
+					Fail(side, GetLastError());
+					return Drain(side, issued, completed);
+				}
+				issued++;
+			}
+			auto & s = side.ring[(size_t)(completed % job.queueDepth)];
+			DWORD done;
+			HRESULT hr = 0;
+			if (!GetOverlappedResult(side.h, &s.ov, &done, TRUE))
+				hr = GetLastError();
+			else if (done<s.len)
+				hr = ERROR_HANDLE_EOF;
+			completed++;
+			if (hr)
+			{
+				Fail(side, hr);
+				return Drain(side, issued, completed);
+			}
+			AcquireSRWLockExclusive(&lock);
+			side.filled = completed;
+			ReleaseSRWLockExclusive(&lock);
+			WakeAllConditionVariable(&changed);
+		}
+	}
+
+	// Waits out the reads still in flight so their buffers can be released
+	void Drain(CompareSide & side, UINT64 issued, UINT64 completed)
+	{
+		for (; completed<issued; completed++)
+		{
+			DWORD done;
+			GetOverlappedResult(side.h, &side.ring[(size_t)(completed % job.queueDepth)].ov, &done, TRUE);
+		}
+	}
+
+	static DWORD WINAPI ReaderA(LPVOID p)
+	{
+		auto c = (Comparer *) p;
+		c->Read(c->sides[0]);
+		return 0;
+	}
+
+	static DWORD WINAPI ReaderB(LPVOID p)
+	{
+		auto c = (Comparer *) p;
+		c->Read(c->sides[1]);
+		return 0;
+	}
+
+	// Adds [pos, pos + len) to the ranges, merged with the last one when the gap is small
+	bool Add(UINT64 pos, UINT64 len)
+	{
+		if (!ranges.empty())
+		{
+			auto & last = ranges.back();
+			if (pos - (last.pos + last.size)<compareGap)
+			{
+				last.size = pos + len - last.pos;
+				return true;
+			}
+		}
+		if (job.maxRanges && ranges.size()>=job.maxRanges)
+			return false;
+		CompareRange r = { pos, len };
+		ranges.push_back(r);
+		return true;
+	}
+
+	// Finds the differing ranges of one block. Once in a difference, each
+	// step looks at the compareGap bytes after the last differing byte found
+	// so far; the vector search finds whether any differ and a scan back from
+	// the end of the window finds the last one, which is short when the
+	// differences are dense.
+	bool CompareBlock(const byte * a, const byte * b, DWORD len, UINT64 base)
+	{
+		size_t pos = 0;
+		while (pos<len)
+		{
+			pos += FirstDifference(a + pos, b + pos, len - pos);
+			if (pos>=len)
+				break;
+			auto start = pos;
+			auto last = pos;
+			for (;;)
+			{
+				auto next = last + 1;
+				auto n = len - next < compareGap ? len - next : compareGap;
+				if (n==0 || FirstDifference(a + next, b + next, n)==n)
+					break;
+				last = next + n - 1;
+				while (a[last]==b[last])
+					last--;
+			}
+			if (!Add(base + start, last + 1 - start))
+				return false;
+			pos = last + 1;
+		}
+		return true;
+	}
+
+	HRESULT Compare(UINT64 & compared)
+	{
+		HRESULT hr = 0;
+		auto prevGb = 0ULL;
+		for (UINT64 i=0; i<blocks; i++)
+		{
+			AcquireSRWLockExclusive(&lock);
+			while (!sides[0].error && !sides[1].error && (sides[0].filled<=i || sides[1].filled<=i))
+				SleepConditionVariableSRW(&changed, &lock, INFINITE, 0);
+			hr = sides[0].error ? sides[0].error : sides[1].error;
+			ReleaseSRWLockExclusive(&lock);
+			if (hr)
+				break;
+			auto slot = (size_t)(i % job.queueDepth);
+			const auto & sa = sides[0].ring[slot];
+			const auto & sb = sides[1].ring[slot];
+			auto more = CompareBlock(sa.buf, sb.buf, sa.len, i * job.blockSize);
+			compared += sa.len;
+			AcquireSRWLockExclusive(&lock);
+			consumed = i + 1;
+			if (!more)
+				stopped = true;
+			ReleaseSRWLockExclusive(&lock);
+			WakeAllConditionVariable(&changed);
+			if (!more)
+				break;
+			auto gb = compared / 1024 / 1024 / 1024;
+			if (gb>prevGb)
+			{
+				wprintf(L"Compared %I64u GB\n", gb);
+				prevGb = gb;
+			}
+		}
+		// readers waiting for a slot give up, the ones reading finish what is in flight
+		AcquireSRWLockExclusive(&lock);
+		stopped = true;
+		ReleaseSRWLockExclusive(&lock);
+		WakeAllConditionVariable(&changed);
+		return hr;
+	}
+};
+
+HRESULT RunCompare(const CompareJob & job, vector<CompareRange> & ranges, UINT64 & compared)
+{
+	compared = 0;
+	if (job.blockSize==0 || job.queueDepth==0)
+		return ERROR_INVALID_PARAMETER;
+	if (job.size==0)
+		return 0;
+	Comparer c(job, ranges);
+	auto hr = c.Init();
+	if (hr) return hr;
+	HANDLE threads[2];
+	threads[0] = CreateThread(nullptr, 0, Comparer::ReaderA, &c, 0, nullptr);
+	if (!threads[0])
+		return GetLastError();
+	threads[1] = CreateThread(nullptr, 0, Comparer::ReaderB, &c, 0, nullptr);
+	if (!threads[1])
+	{
+		hr = GetLastError();
+		c.Fail(c.sides[1], hr);
+		WaitForSingleObject(threads[0], INFINITE);
+		CloseHandle(threads[0]);
+		return hr;
+	}
+	hr = c.Compare(compared);
+	WaitForMultipleObjects(2, threads, TRUE, INFINITE);
+	CloseHandle(threads[0]);
+	CloseHandle(threads[1]);
+	return hr;
+}
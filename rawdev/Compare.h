@@ -0,0 +1,79 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef COMPARE_H_
+#define COMPARE_H_
+
+#include <Windows.h>
+#include <vector>
+
+using namespace std;
+
+struct CompareRange
+{
+	UINT64 pos;
+	UINT64 size;
+};
+
+// Compares size bytes of a at offsetA with b at offsetB. Both handles must
+// be opened with FILE_FLAG_OVERLAPPED; each side keeps queueDepth reads of
+// blockSize in flight on a thread of its own while the calling thread
+// compares. Differences closer than compareGap bytes are reported as one
+// range, positions relative to the start of the compared data. Stops once
+// maxRanges ranges are found, 0 for no limit.
+struct CompareJob
+{
+	HANDLE a;
+	HANDLE b;
+	UINT64 offsetA;
+	UINT64 offsetB;
+	UINT64 size;
+	DWORD blockSize;
+	DWORD queueDepth;
+	DWORD maxRanges;
+	CompareJob()
+	{
+		a = INVALID_HANDLE_VALUE;
+		b = INVALID_HANDLE_VALUE;
+		offsetA = 0;
+		offsetB = 0;
+		size = 0;
+		blockSize = 1024*1024;
+		queueDepth = 4;
+		maxRanges = 0;
+	}
+};
+
+const DWORD compareGap = 4096;
+
+// ranges is filled as they are found, so it holds what was found before an error too
+HRESULT RunCompare(const CompareJob & job, vector<CompareRange> & ranges, UINT64 & compared);
+
+#endif//COMPARE_H_
@@ -0,0 +1,981 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "CopyEngine.h"
+#include "BufferPool.h"
+#include "Checksum.h"
+#include "Fill.h"
+#include "Histogram.h"
+#include "OsHelpers.h"
+#include "Simd.h"
+
+enum SlotState { SlotIdle, SlotReading, SlotRead, SlotWriting };
+
+// One in-flight buffer. Block k of the copy always lives in slot k % queueDepth.
+struct Slot
+{
+	OVERLAPPED ov;
+	byte * buf;
+	UINT64 pos;
+	DWORD len;
+	DWORD ioLen;
+	SlotState state;
+	bool unused;
+	// already copied by an earlier run
+	bool resumed;
+	// when the current read or write was issued
+	UINT64 start;
+};
+
+static void SetOffset(OVERLAPPED & ov, UINT64 offset)
+{
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+}
+
+static DWORD AlignUp(DWORD len, DWORD alignment)
+{
+	if (alignment==0)
+		return len;
+	return (len + alignment - 1) / alignment * alignment;
+}
+
+void AddToDigest(CopyStats & stats, UINT64 pos, const byte * buf, DWORD len)
+{
+	while (len>0)
+	{
+		auto i = (size_t)(pos / digestRangeSize);
+		auto room = digestRangeSize - pos % digestRangeSize;
+		auto n = len < room ? len : (DWORD)room;
+		stats.crcs[i] = Crc32c(stats.crcs[i], buf, n);
+		pos += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+void AddCrcToDigest(CopyStats & stats, UINT64 pos, DWORD crc, DWORD len)
+{
+	auto & range = stats.crcs[(size_t)(pos / digestRangeSize)];
+	range = Crc32cCombine(range, crc, len);
+}
+
+void ReportProgress(const CopyJob & job, CopyStats & stats, UINT64 done)
+{
+	if (stats.start)
+	{
+		auto seconds = TicksToNs(Now() - stats.start) / 1000000000;
+		while (stats.timeline.size()<seconds)
+			stats.timeline.push_back(done);
+	}
+	auto gb = done / 1024 / 1024 / 1024;
+	if (gb<=stats.prevGb)
+		return;
+	wprintf(L"%s %I64u GB\n", job.hdst==INVALID_HANDLE_VALUE ? L"Read" : job.generator ? L"Filled" : L"Copied", gb);
+	stats.prevGb = gb;
+}
+
+// Whether any of len bytes at pos is marked used
+static bool IsUsed(const CopyJob & job, UINT64 pos, DWORD len)
+{
+	if (!job.usedBlocks)
+		return true;
+	const auto & used = *job.usedBlocks;
+	auto last = (pos + len - 1) / job.usedBlockSize;
+	for (auto b=pos / job.usedBlockSize; b<=last; b++)
+		if (b>=used.size() || used[(size_t)b])
+			return true;
+	return false;
+}
+
+static bool SkipCompletionOnSuccess(HANDLE h)
+{
+	return SetFileCompletionNotificationModes(h, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS | FILE_SKIP_SET_EVENT_ON_HANDLE)==TRUE;
+}
+
+// Transfer sizes and depths autotune may pick from, and the most it may keep in flight
+static const DWORD minTransfer = 64*1024;
+static const DWORD maxTransfer = 16*1024*1024;
+static const DWORD maxTuneDepth = 64;
+static const UINT64 maxInFlight = 64*1024*1024;
+static const UINT64 probeNs = 500000000;
+static const UINT64 steadyNs = 5000000000;
+
+// Hill climbs over transfer size and queue depth, one epoch of the copy per
+// candidate, then watches longer epochs and climbs again when throughput
+// falls well below what tuning found.
+struct Tuner
+{
+	struct Probe
+	{
+		DWORD blockSize;
+		DWORD queueDepth;
+		double rate;
+	};
+	vector<Probe> tried;
+	Probe best;
+	bool probing;
+	DWORD drops;
+
+	Tuner(DWORD blockSize, DWORD queueDepth, bool cached)
+	{
+		best.blockSize = blockSize;
+		best.queueDepth = queueDepth;
+		best.rate = 0;
+		probing = !cached;
+		drops = 0;
+	}
+
+	UINT64 EpochNs() const { return probing ? probeNs : steadyNs; }
+
+	bool Allowed(DWORD bs, DWORD qd) const
+	{
+		if (bs<minTransfer || bs>maxTransfer || qd<1 || qd>maxTuneDepth || (UINT64)bs * qd > maxInFlight)
+			return false;
+		for (auto & p : tried)
+			if (p.blockSize==bs && p.queueDepth==qd)
+				return false;
+		return true;
+	}
+
+	// The next untried neighbour of the best so far, false when there is none
+	bool NextProbe(DWORD & bs, DWORD & qd) const
+	{
+		const int steps[4][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+		for (auto & step : steps)
+		{
+			auto nbs = step[0]>0 ? best.blockSize * 2 : step[0]<0 ? best.blockSize / 2 : best.blockSize;
+			auto nqd = step[1]>0 ? best.queueDepth * 2 : step[1]<0 ? best.queueDepth / 2 : best.queueDepth;
+			if (Allowed(nbs, nqd))
+			{
+				bs = nbs;
+				qd = nqd;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Takes what the epoch just run with bs and qd moved in ns, and sets what the next one uses
+	void Measured(UINT64 bytes, UINT64 ns, DWORD & bs, DWORD & qd)
+	{
+		auto rate = ns ? bytes * 1e9 / ns / 1024 / 1024 : 0.0;
+		if (probing)
+		{
+			Probe p = { bs, qd, rate };
+			tried.push_back(p);
+			wprintf(L"Autotune: %u KB x %u, %.1f MB/s\n", bs / 1024, qd, rate);
+			// a neighbour has to be clearly faster to be worth moving to
+			if (rate>best.rate * 1.05 || (bs==best.blockSize && qd==best.queueDepth))
+				best = p;
+			if (NextProbe(bs, qd))
+				return;
+			probing = false;
+			drops = 0;
+			bs = best.blockSize;
+			qd = best.queueDepth;
+			wprintf(L"Autotune: settled on %u KB x %u, %.1f MB/s\n", bs / 1024, qd, best.rate);
+			return;
+		}
+		// started from cached values, the first epoch sets the reference
+		if (best.rate==0)
+		{
+			best.rate = rate;
+			return;
+		}
+		if (rate>=best.rate * 0.7)
+		{
+			drops = 0;
+			return;
+		}
+		if (++drops<2)
+			return;
+		wprintf(L"Autotune: throughput fell to %.1f MB/s, probing again\n", rate);
+		probing = true;
+		tried.clear();
+		best.rate = 0;
+	}
+};
+
+// A single thread submits all reads and writes against one completion port and
+// reaps completions in batches, so a deep queue costs no extra threads or events.
+// The copy runs in epochs; with autotune each epoch may use another transfer
+// size and depth, and the pipeline empties between them.
+struct Pipeline
+{
+	const CopyJob & job;
+	CopyStats & stats;
+	Tuner * tuner;
+	HANDLE port;
+	Slot * slots;
+	byte * mem;
+	OVERLAPPED_ENTRY * entries;
+	bool skipSrc;
+	bool skipDst;
+	DWORD blockSize;
+	DWORD queueDepth;
+	DWORD maxDepth;
+	UINT64 base;
+	UINT64 blocks;
+	UINT64 nextRead;
+	UINT64 nextWrite;
+	UINT64 blocksDone;
+	DWORD inFlight;
+
+	Pipeline(const CopyJob & j, CopyStats & st, Tuner * t) : job(j), stats(st), tuner(t)
+	{
+		port = nullptr;
+		slots = nullptr;
+		mem = nullptr;
+		entries = nullptr;
+		skipSrc = false;
+		skipDst = false;
+		blockSize = job.blockSize;
+		queueDepth = job.queueDepth;
+		maxDepth = tuner ? maxTuneDepth : job.queueDepth;
+		base = 0;
+		blocks = 0;
+		nextRead = 0;
+		nextWrite = 0;
+		blocksDone = 0;
+		inFlight = 0;
+	}
+
+	~Pipeline()
+	{
+		if (port) CloseHandle(port);
+		if (slots) delete[] slots;
+		if (entries) delete[] entries;
+		FreeIoBuffer(mem);
+	}
+
+	HRESULT Init()
+	{
+		// page aligned, as required by FILE_FLAG_NO_BUFFERING
+		auto memSize = tuner ? maxInFlight : (UINT64)job.queueDepth * job.blockSize;
+		if ((UINT64)queueDepth * blockSize > memSize)
+			memSize = (UINT64)queueDepth * blockSize;
+		mem = AllocIoBuffer((SIZE_T)memSize);
+		if (!mem)
+			return GetLastError();
+		if (queueDepth>maxDepth)
+			maxDepth = queueDepth;
+		slots = new Slot[maxDepth];
+		memset(slots, 0, sizeof(Slot) * maxDepth);
+		entries = new OVERLAPPED_ENTRY[maxDepth];
+		// a generated source has no handle, the port starts out empty
+		port = CreateIoCompletionPort(job.generator ? INVALID_HANDLE_VALUE : job.hsrc, nullptr, 0, 1);
+		if (!port)
+			return GetLastError();
+		skipSrc = !job.generator && SkipCompletionOnSuccess(job.hsrc);
+		if (job.hdst==INVALID_HANDLE_VALUE)
+			return 0;
+		if (!CreateIoCompletionPort(job.hdst, port, 0, 1))
+			return GetLastError();
+		skipDst = SkipCompletionOnSuccess(job.hdst);
+		return 0;
+	}
+
+	// Block k of an epoch always lives in slot k % queueDepth
+	void StartEpoch()
+	{
+		for (DWORD i=0; i<queueDepth; i++)
+			slots[i].buf = mem + (SIZE_T)i * blockSize;
+		blocks = (job.size - base + blockSize - 1) / blockSize;
+		nextRead = 0;
+		nextWrite = 0;
+		blocksDone = 0;
+	}
+
+	HANDLE HandleOf(const Slot & s) const { return s.state==SlotReading ? job.hsrc : job.hdst; }
+
+	HRESULT Complete(Slot & s, DWORD len, UINT64 now)
+	{
+		inFlight--;
+		auto & side = s.state==SlotReading ? stats.reads : stats.writes;
+		side.latency.Add(TicksToNs(now - s.start));
+		if (s.state==SlotReading)
+		{
+			s.state = SlotRead;
+			if (len<s.len)
+				return ERROR_HANDLE_EOF;
+			if (s.ioLen>s.len)
+				memset(s.buf + s.len, 0, s.ioLen - s.len);
+			return 0;
+		}
+		s.state = SlotIdle;
+		if (len!=s.ioLen)
+			return ERROR_WRITE_FAULT;
+		blocksDone++;
+		stats.copied += s.len;
+		ReportProgress(job, stats, stats.copied + stats.skipped);
+		return Journaled(s);
+	}
+
+	HRESULT Journaled(const Slot & s)
+	{
+		return job.journal ? job.journal->Completed(stats, s.pos, s.len) : 0;
+	}
+
+	// Handles both the pending and the skipped-port synchronous success case
+	HRESULT Submitted(Slot & s, BOOL ok, bool skip)
+	{
+		inFlight++;
+		if (!ok)
+		{
+			if (GetLastError()==ERROR_IO_PENDING)
+				return 0;
+			inFlight--;
+			return GetLastError();
+		}
+		if (!skip)
+			return 0;
+		DWORD len;
+		if (!GetOverlappedResult(HandleOf(s), &s.ov, &len, FALSE))
+		{
+			inFlight--;
+			return GetLastError();
+		}
+		return Complete(s, len, Now());
+	}
+
+	HRESULT StartRead(Slot & s, UINT64 block)
+	{
+		s.pos = base + block * blockSize;
+		auto remaining = job.size - s.pos;
+		s.len = remaining < blockSize ? (DWORD)remaining : blockSize;
+		s.ioLen = AlignUp(s.len, job.alignment);
+		s.unused = !IsUsed(job, s.pos, s.len);
+		s.resumed = job.journal && job.journal->IsResumed(s.pos);
+		if (s.unused || s.resumed)
+		{
+			// nothing to read, the block is ready as soon as it gets its turn
+			if (job.checksum && !s.resumed)
+				memset(s.buf, 0, s.len);
+			s.state = SlotRead;
+			return 0;
+		}
+		if (job.throttle)
+			job.throttle->Take(s.ioLen);
+		if (job.generator)
+		{
+			job.generator->Produce(s.buf, s.len, job.dstOffset + s.pos);
+			if (s.ioLen>s.len)
+				memset(s.buf + s.len, 0, s.ioLen - s.len);
+			s.state = SlotRead;
+			return 0;
+		}
+		SetOffset(s.ov, job.srcOffset + s.pos);
+		s.state = SlotReading;
+		s.start = Now();
+		return Submitted(s, ReadFile(job.hsrc, s.buf, s.ioLen, nullptr, &s.ov), skipSrc);
+	}
+
+	HRESULT StartWrite(Slot & s)
+	{
+		SetOffset(s.ov, job.dstOffset + s.pos);
+		s.state = SlotWriting;
+		s.start = Now();
+		return Submitted(s, WriteFile(job.hdst, s.buf, s.ioLen, nullptr, &s.ov), skipDst);
+	}
+
+	HRESULT Submit()
+	{
+		// reads go into free slots in ring order, writes follow in block order
+		while (nextRead<blocks)
+		{
+			auto & s = slots[nextRead % queueDepth];
+			if (s.state!=SlotIdle)
+				break;
+			auto hr = StartRead(s, nextRead++);
+			if (hr) return hr;
+		}
+		while (nextWrite<nextRead)
+		{
+			auto & s = slots[nextWrite % queueDepth];
+			if (s.state!=SlotRead)
+				break;
+			nextWrite++;
+			if (s.resumed)
+			{
+				s.state = SlotIdle;
+				blocksDone++;
+				continue;
+			}
+			if (job.checksum)
+				AddToDigest(stats, job.digestBase + s.pos, s.buf, s.len);
+			auto isZero = s.unused || job.skipZero && IsZero(s.buf, s.len);
+			if (isZero || job.hdst==INVALID_HANDLE_VALUE)
+			{
+				s.state = SlotIdle;
+				blocksDone++;
+				if (isZero)
+					stats.skipped += s.len;
+				else
+					stats.copied += s.len;
+				ReportProgress(job, stats, stats.copied + stats.skipped);
+				auto hr = Journaled(s);
+				if (hr) return hr;
+				continue;
+			}
+			auto hr = StartWrite(s);
+			if (hr) return hr;
+		}
+		return 0;
+	}
+
+	HRESULT Reap()
+	{
+		// whatever is next in block order is what the copy waits for
+		const auto & head = slots[nextWrite % queueDepth];
+		auto & stalled = nextWrite<nextRead && head.state==SlotReading ? stats.reads : stats.writes;
+		auto waitStart = Now();
+		ULONG count;
+		if (!GetQueuedCompletionStatusEx(port, entries, queueDepth, &count, INFINITE, FALSE))
+			return GetLastError();
+		auto now = Now();
+		stalled.stallNs += TicksToNs(now - waitStart);
+		HRESULT hr = 0;
+		for (ULONG i=0; i<count; i++)
+		{
+			auto & s = *(Slot *) entries[i].lpOverlapped;
+			DWORD len;
+			HRESULT ihr = 0;
+			if (!GetOverlappedResult(HandleOf(s), &s.ov, &len, FALSE))
+			{
+				ihr = GetLastError();
+				inFlight--;
+			}
+			else
+				ihr = Complete(s, len, now);
+			if (!hr) hr = ihr;
+		}
+		return hr;
+	}
+
+	// Cancels whatever is still in flight so the buffers can be released
+	void Drain()
+	{
+		if (inFlight==0)
+			return;
+		CancelIoEx(job.hsrc, nullptr);
+		CancelIoEx(job.hdst, nullptr);
+		while (inFlight>0)
+		{
+			ULONG count;
+			if (!GetQueuedCompletionStatusEx(port, entries, maxDepth, &count, INFINITE, FALSE))
+				return;
+			inFlight -= count;
+		}
+	}
+
+	HRESULT Run()
+	{
+		auto hr = Init();
+		if (hr) return hr;
+		while (!hr && base<job.size)
+		{
+			StartEpoch();
+			auto start = Now();
+			auto timed = false;
+			while (blocksDone<blocks)
+			{
+				// once the epoch is long enough no further reads start, the ones in flight finish
+				if (tuner && nextRead>0 && nextRead<blocks && TicksToNs(Now() - start)>=tuner->EpochNs())
+				{
+					blocks = nextRead;
+					timed = true;
+				}
+				hr = Submit();
+				if (hr) break;
+				if (inFlight==0)
+					continue;
+				hr = Reap();
+				if (hr) break;
+			}
+			if (hr) break;
+			auto end = base + blocks * blockSize < job.size ? base + blocks * blockSize : job.size;
+			// the short epoch at the end of the copy says little about the devices
+			if (timed)
+				tuner->Measured(end - base, TicksToNs(Now() - start), blockSize, queueDepth);
+			base = end;
+		}
+		Drain();
+		stats.blockSize = tuner ? tuner->best.blockSize : blockSize;
+		stats.queueDepth = tuner ? tuner->best.queueDepth : queueDepth;
+		return hr;
+	}
+};
+
+// How long at least one of several threads was waiting on a side. Summing
+// each thread's waits would count overlapping waits once per thread, and
+// could come to more than the whole copy took.
+struct StallClock
+{
+	DWORD waiting;
+	UINT64 since;
+	UINT64 ns;
+	SRWLOCK lock;
+
+	StallClock()
+	{
+		waiting = 0;
+		since = 0;
+		ns = 0;
+		InitializeSRWLock(&lock);
+	}
+
+	void Enter()
+	{
+		AcquireSRWLockExclusive(&lock);
+		if (waiting++==0)
+			since = Now();
+		ReleaseSRWLockExclusive(&lock);
+	}
+
+	void Leave()
+	{
+		AcquireSRWLockExclusive(&lock);
+		if (--waiting==0)
+			ns += TicksToNs(Now() - since);
+		ReleaseSRWLockExclusive(&lock);
+	}
+};
+
+// Worker threads claim fixed size stripes of the range from a shared cursor
+// and move each stripe with positioned reads and writes of their own, so
+// the devices see as many outstanding requests as there are workers.
+struct Striper
+{
+	const CopyJob & job;
+	CopyStats & stats;
+	UINT64 stripeSize;
+	volatile LONGLONG nextStripe;
+	volatile LONGLONG copied;
+	volatile LONGLONG skipped;
+	volatile LONG error;
+	SRWLOCK timesLock;
+	StallClock readStall;
+	StallClock writeStall;
+
+	Striper(const CopyJob & j, CopyStats & st) : job(j), stats(st)
+	{
+		InitializeSRWLock(&timesLock);
+		// one worker owns a whole digest range, so its checksum is built in order
+		stripeSize = digestRangeSize;
+		nextStripe = 0;
+		copied = 0;
+		skipped = 0;
+		error = 0;
+	}
+
+	static DWORD WINAPI Worker(LPVOID p)
+	{
+		return ((Striper *) p)->Work();
+	}
+
+	// Each worker times its own I/O, which it waits for in full; the stall is
+	// kept by the StallClock of the side, across workers
+	static void Time(IoSide & side, UINT64 start)
+	{
+		side.latency.Add(TicksToNs(Now() - start));
+	}
+
+	HRESULT CopyStripe(byte * buf, UINT64 start, UINT64 end, IoSide & reads, IoSide & writes)
+	{
+		for (auto pos=start; pos<end && error==0; )
+		{
+			auto remaining = end - pos;
+			auto len = remaining < job.blockSize ? (DWORD)remaining : job.blockSize;
+			auto ioLen = AlignUp(len, job.alignment);
+			if (!IsUsed(job, pos, len))
+			{
+				if (job.checksum)
+				{
+					memset(buf, 0, len);
+					AddToDigest(stats, job.digestBase + pos, buf, len);
+				}
+				InterlockedExchangeAdd64(&skipped, len);
+				pos += len;
+				continue;
+			}
+			if (job.throttle)
+				job.throttle->Take(ioLen);
+			UINT64 t;
+			HRESULT hr;
+			if (job.generator)
+				job.generator->Produce(buf, len, job.dstOffset + pos);
+			else
+			{
+				DWORD done;
+				readStall.Enter();
+				t = Now();
+				hr = ReadAt(job.hsrc, buf, ioLen, job.srcOffset + pos, done);
+				readStall.Leave();
+				if (hr) return hr;
+				Time(reads, t);
+				if (done<len)
+					return ERROR_HANDLE_EOF;
+			}
+			if (ioLen>len)
+				memset(buf + len, 0, ioLen - len);
+			if (job.checksum)
+				AddToDigest(stats, job.digestBase + pos, buf, len);
+			if (job.skipZero && IsZero(buf, len))
+				InterlockedExchangeAdd64(&skipped, len);
+			else if (job.hdst==INVALID_HANDLE_VALUE)
+				InterlockedExchangeAdd64(&copied, len);
+			else
+			{
+				writeStall.Enter();
+				t = Now();
+				hr = WriteAt(job.hdst, buf, ioLen, job.dstOffset + pos);
+				writeStall.Leave();
+				if (hr) return hr;
+				Time(writes, t);
+				InterlockedExchangeAdd64(&copied, len);
+			}
+			pos += len;
+		}
+		return 0;
+	}
+
+	DWORD Work()
+	{
+		HRESULT hr = 0;
+		IoSide reads;
+		IoSide writes;
+		auto buf = AllocIoBuffer(job.blockSize);
+		if (!buf)
+			hr = GetLastError();
+		while (!hr && error==0)
+		{
+			auto start = (UINT64) InterlockedExchangeAdd64(&nextStripe, stripeSize);
+			if (start>=job.size)
+				break;
+			if (job.journal && job.journal->IsResumed(start))
+				continue;
+			auto end = job.size - start < stripeSize ? job.size : start + stripeSize;
+			hr = CopyStripe(buf, start, end, reads, writes);
+			if (!hr && job.journal)
+				hr = job.journal->Completed(stats, start, end - start);
+		}
+		if (hr)
+			InterlockedCompareExchange(&error, hr, 0);
+		AcquireSRWLockExclusive(&timesLock);
+		stats.reads.Merge(reads);
+		stats.writes.Merge(writes);
+		ReleaseSRWLockExclusive(&timesLock);
+		FreeIoBuffer(buf);
+		return 0;
+	}
+
+	HRESULT Run()
+	{
+		HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+		DWORD count = 0;
+		for (; count<job.threads; count++)
+		{
+			threads[count] = CreateThread(nullptr, 0, Worker, this, 0, nullptr);
+			if (!threads[count])
+			{
+				InterlockedCompareExchange(&error, GetLastError(), 0);
+				break;
+			}
+		}
+		while (count>0)
+		{
+			auto wait = WaitForMultipleObjects(count, threads, TRUE, 250);
+			ReportProgress(job, stats, copied + skipped);
+			if (wait!=WAIT_TIMEOUT)
+				break;
+		}
+		for (DWORD i=0; i<count; i++)
+			CloseHandle(threads[i]);
+		stats.copied += copied;
+		stats.skipped += skipped;
+		stats.reads.stallNs += readStall.ns;
+		stats.writes.stallNs += writeStall.ns;
+		stats.blockSize = job.blockSize;
+		stats.queueDepth = job.threads;
+		return error;
+	}
+};
+
+// Copies ranges that need not start or end on a sector boundary by moving
+// whole sectors through bounce buffers. The source sectors holding the range
+// are read; a destination that needs whole sectors has the ones around the
+// range read, patched and written back.
+struct Bouncer
+{
+	const CopyJob & job;
+	CopyStats & stats;
+	DWORD srcUnit;
+	DWORD dstUnit;
+	byte * srcBuf;
+	byte * dstBuf;
+
+	Bouncer(const CopyJob & j, CopyStats & st, DWORD src, DWORD dst) : job(j), stats(st), srcUnit(src), dstUnit(dst)
+	{
+		srcBuf = nullptr;
+		dstBuf = nullptr;
+	}
+
+	~Bouncer()
+	{
+		FreeIoBuffer(srcBuf);
+		FreeIoBuffer(dstBuf);
+	}
+
+	HRESULT Init(DWORD maxLen)
+	{
+		srcBuf = AllocIoBuffer(maxLen + 2*srcUnit);
+		if (!srcBuf)
+			return GetLastError();
+		if (job.hdst==INVALID_HANDLE_VALUE || dstUnit<=1)
+			return 0;
+		dstBuf = AllocIoBuffer(maxLen + 2*dstUnit);
+		return dstBuf ? 0 : GetLastError();
+	}
+
+	static UINT64 Down(UINT64 offset, DWORD unit) { return offset / unit * unit; }
+	static UINT64 Up(UINT64 offset, DWORD unit) { return (offset + unit - 1) / unit * unit; }
+
+	HRESULT Write(const byte * data, DWORD len, UINT64 to)
+	{
+		if (dstUnit<=1)
+			return WriteAt(job.hdst, data, len, to);
+		auto start = Down(to, dstUnit);
+		auto ioLen = (DWORD)(Up(to + len, dstUnit) - start);
+		DWORD done;
+		auto hr = ReadAt(job.hdst, dstBuf, ioLen, start, done);
+		if (hr) return hr;
+		// only an unbuffered file ends short, the caller trims it afterwards
+		if (done<ioLen)
+			memset(dstBuf + done, 0, ioLen - done);
+		memcpy(dstBuf + (to - start), data, len);
+		return WriteAt(job.hdst, dstBuf, ioLen, start);
+	}
+
+	HRESULT Copy(UINT64 pos, DWORD len)
+	{
+		if (job.generator)
+		{
+			job.generator->Produce(srcBuf, len, job.dstOffset + pos);
+			return Put(srcBuf, pos, len);
+		}
+		auto from = job.srcOffset + pos;
+		auto start = Down(from, srcUnit);
+		auto ioLen = (DWORD)(Up(from + len, srcUnit) - start);
+		if (job.throttle)
+			job.throttle->Take(ioLen);
+		DWORD done;
+		auto t = Now();
+		auto hr = ReadAt(job.hsrc, srcBuf, ioLen, start, done);
+		if (hr) return hr;
+		Striper::Time(stats.reads, t);
+		if (done<from + len - start)
+			return ERROR_HANDLE_EOF;
+		return Put(srcBuf + (from - start), pos, len);
+	}
+
+	HRESULT Put(const byte * data, UINT64 pos, DWORD len)
+	{
+		if (job.checksum)
+			AddToDigest(stats, job.digestBase + pos, data, len);
+		if (job.hdst!=INVALID_HANDLE_VALUE)
+		{
+			auto t = Now();
+			auto hr = Write(data, len, job.dstOffset + pos);
+			if (hr) return hr;
+			Striper::Time(stats.writes, t);
+		}
+		stats.copied += len;
+		ReportProgress(job, stats, stats.copied + stats.skipped);
+		return 0;
+	}
+};
+
+static HRESULT RunAligned(const CopyJob & job, CopyStats & stats)
+{
+	if (job.threads>1)
+	{
+		Striper s(job, stats);
+		return s.Run();
+	}
+	if (!job.autotune)
+	{
+		Pipeline p(job, stats, nullptr);
+		return p.Run();
+	}
+	Tuner tuner(job.blockSize, job.queueDepth, job.autotuneCached);
+	Pipeline p(job, stats, &tuner);
+	return p.Run();
+}
+
+// How a range splits into a bounced head, an aligned middle and a bounced
+// tail. Sector sizes are powers of two, so a middle aligned for the larger
+// one is aligned for both. If the two ends are off by different amounts no
+// such middle exists and the whole range is bounced.
+struct UnalignedSplit
+{
+	DWORD srcUnit;
+	DWORD dstUnit;
+	DWORD unit;
+	bool aligned;
+	UINT64 head;
+	UINT64 middle;
+
+	UnalignedSplit(const CopyJob & job)
+	{
+		srcUnit = job.srcSector>1 ? job.srcSector : 1;
+		dstUnit = job.dstSector>job.alignment ? job.dstSector : job.alignment;
+		if (dstUnit==0)
+			dstUnit = 1;
+		unit = srcUnit>dstUnit ? srcUnit : dstUnit;
+		auto first = srcUnit>dstUnit ? job.srcOffset : job.dstOffset;
+		head = (unit - first % unit) % unit;
+		aligned = (job.srcOffset + head) % srcUnit==0 && (job.dstOffset + head) % dstUnit==0;
+		if (!aligned || head>job.size)
+			head = aligned ? job.size : 0;
+		middle = aligned ? (job.size - head) / unit * unit : 0;
+	}
+
+	bool IsBounced(const CopyJob & job) const { return head!=0 || middle!=job.size; }
+};
+
+bool IsBounced(const CopyJob & job)
+{
+	if (job.srcSector<=1 && job.dstSector<=1)
+		return false;
+	return UnalignedSplit(job).IsBounced(job);
+}
+
+static HRESULT RunUnaligned(const CopyJob & job, CopyStats & stats)
+{
+	UnalignedSplit split(job);
+	auto head = split.head;
+	auto middle = split.middle;
+	if (!split.IsBounced(job))
+		return RunAligned(job, stats);
+	// shifted blocks no longer line up with the journal's ranges or the allocation bitmap
+	if (job.journal || job.usedBlocks)
+		return ERROR_INVALID_PARAMETER;
+	Bouncer b(job, stats, split.srcUnit, split.dstUnit);
+	auto hr = b.Init(split.aligned ? split.unit : job.blockSize);
+	if (hr) return hr;
+	if (head)
+	{
+		hr = b.Copy(0, (DWORD)head);
+		if (hr) return hr;
+	}
+	stats.blockSize = job.blockSize;
+	stats.queueDepth = 1;
+	if (middle)
+	{
+		CopyJob inner = job;
+		inner.srcOffset += head;
+		inner.dstOffset += head;
+		inner.size = middle;
+		inner.digestBase = job.digestBase + head;
+		// a striping worker owns whole checksum ranges, which the shift splits
+		if (job.checksum && inner.digestBase % digestRangeSize!=0)
+			inner.threads = 1;
+		hr = RunAligned(inner, stats);
+		if (hr) return hr;
+	}
+	for (auto pos=head + middle; pos<job.size; )
+	{
+		auto n = job.size - pos < job.blockSize ? (DWORD)(job.size - pos) : job.blockSize;
+		hr = b.Copy(pos, n);
+		if (hr) return hr;
+		pos += n;
+	}
+	return 0;
+}
+
+HRESULT RunCopy(const CopyJob & job, CopyStats & stats)
+{
+	if (job.blockSize==0 || job.queueDepth==0)
+		return ERROR_INVALID_PARAMETER;
+	if (job.threads==0 || job.threads>MAXIMUM_WAIT_OBJECTS)
+		return ERROR_INVALID_PARAMETER;
+	if (job.alignment!=0 && job.blockSize%job.alignment!=0)
+		return ERROR_INVALID_PARAMETER;
+	if (job.checksum && digestRangeSize%job.blockSize!=0)
+		return ERROR_INVALID_PARAMETER;
+	if (job.usedBlocks && job.usedBlockSize==0)
+		return ERROR_INVALID_PARAMETER;
+	if (job.autotune && job.threads>1)
+		return ERROR_INVALID_PARAMETER;
+	if (job.journal && !job.checksum)
+		return ERROR_INVALID_PARAMETER;
+	if (job.checksum)
+		stats.InitCrcs(job.size);
+	if (job.journal)
+		job.journal->Apply(stats);
+	if (job.size==0)
+		return 0;
+	if (job.srcSector>1 || job.dstSector>1)
+		return RunUnaligned(job, stats);
+	return RunAligned(job, stats);
+}
+
+void CopyStats::Start()
+{
+	start = Now();
+	timeline.clear();
+}
+
+void CopyStats::Finish()
+{
+	elapsedNs = TicksToNs(Now() - start);
+	// the last, partial second
+	auto done = copied + skipped + unchanged;
+	if (timeline.empty() || timeline.back()!=done)
+		timeline.push_back(done);
+}
+
+void CopyStats::InitCrcs(UINT64 size)
+{
+	crcs.assign((size_t)((size + digestRangeSize - 1) / digestRangeSize), 0);
+}
+
+DWORD CopyStats::StreamCrc(UINT64 size) const
+{
+	DWORD crc = 0;
+	for (size_t i=0; i<crcs.size(); i++)
+	{
+		auto start = i * digestRangeSize;
+		auto len = size - start < digestRangeSize ? size - start : digestRangeSize;
+		crc = Crc32cCombine(crc, crcs[i], len);
+	}
+	return crc;
+}
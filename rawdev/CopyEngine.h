@@ -0,0 +1,175 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef COPYENGINE_H_
+#define COPYENGINE_H_
+
+#include <Windows.h>
+#include <vector>
+#include "Histogram.h"
+#include "Journal.h"
+#include "Throttle.h"
+
+using namespace std;
+
+struct Generator;
+
+// Checksums are kept per range of this many bytes so a verify pass can say where data differs
+const UINT64 digestRangeSize = 64*1024*1024;
+
+// A copy of size bytes from hsrc at srcOffset to hdst at dstOffset.
+// Both handles must be opened with FILE_FLAG_OVERLAPPED and are bound to a
+// completion port for the duration of the copy. Without hdst the source is
+// only read, which together with checksum makes a verify pass.
+// A non-zero alignment rounds every transfer up to that size, for unbuffered
+// file destinations whose end of file the caller trims afterwards.
+// With more than one thread the range is split into stripes that worker
+// threads copy with positioned I/O; queueDepth then does not apply.
+// With skipZero, all-zero blocks are not written; the caller makes sure the
+// destination already reads back zeros there (new sparse file, pre-zeroed device).
+// With usedBlocks, one entry per usedBlockSize bytes, ranges whose entries
+// are all false are neither read nor written and count as skipped; checksums
+// take them as zeros.
+// With autotune, a single threaded copy starts at blockSize and queueDepth
+// and moves to whatever transfer size and depth measure fastest, probing
+// again when throughput falls off. With autotuneCached the starting values
+// are already tuned, so probing only starts if throughput falls off.
+// srcSector and dstSector are the sector sizes unbuffered I/O needs at
+// either end, 0 for an end that takes any offset. When the range does not
+// start or end on those boundaries, the unaligned head and tail go through
+// bounce buffers and only the aligned middle through the engine.
+// With generator there is no hsrc; each block is made in place from its
+// offset on the destination instead of being read.
+struct CopyJob
+{
+	HANDLE hsrc;
+	HANDLE hdst;
+	UINT64 srcOffset;
+	UINT64 dstOffset;
+	UINT64 size;
+	DWORD blockSize;
+	DWORD queueDepth;
+	DWORD threads;
+	DWORD alignment;
+	bool skipZero;
+	bool checksum;
+	const vector<bool> * usedBlocks;
+	DWORD usedBlockSize;
+	bool autotune;
+	bool autotuneCached;
+	// reads wait here, nullptr copies as fast as the devices allow
+	Throttle * throttle;
+	// records written ranges and skips those of an earlier run, needs checksum
+	Journal * journal;
+	DWORD srcSector;
+	DWORD dstSector;
+	// where this range starts within the checksums, for a part of a larger copy
+	UINT64 digestBase;
+	const Generator * generator;
+	CopyJob()
+	{
+		hsrc = INVALID_HANDLE_VALUE;
+		hdst = INVALID_HANDLE_VALUE;
+		srcOffset = 0;
+		dstOffset = 0;
+		size = 0;
+		blockSize = 1024*1024;
+		queueDepth = 4;
+		threads = 1;
+		alignment = 0;
+		skipZero = false;
+		checksum = false;
+		usedBlocks = nullptr;
+		usedBlockSize = 0;
+		autotune = false;
+		autotuneCached = false;
+		throttle = nullptr;
+		journal = nullptr;
+		srcSector = 0;
+		dstSector = 0;
+		digestBase = 0;
+		generator = nullptr;
+	}
+};
+
+struct CopyStats
+{
+	UINT64 copied;
+	UINT64 skipped;
+	UINT64 unchanged;
+	UINT64 retried;
+	// bytes an earlier, interrupted run already copied
+	UINT64 resumed;
+	// bytes a rescue could not read and zero filled
+	UINT64 unreadable;
+	vector<DWORD> crcs;
+	IoSide reads;
+	IoSide writes;
+	// bytes done at the end of every second since Start
+	vector<UINT64> timeline;
+	UINT64 start;
+	UINT64 elapsedNs;
+	UINT64 prevGb;
+	// the transfer size and depth the copy ended with, the tuned ones with autotune
+	DWORD blockSize;
+	DWORD queueDepth;
+	CopyStats()
+	{
+		copied = 0;
+		skipped = 0;
+		unchanged = 0;
+		retried = 0;
+		resumed = 0;
+		unreadable = 0;
+		start = 0;
+		elapsedNs = 0;
+		prevGb = 0;
+		blockSize = 0;
+		queueDepth = 0;
+	}
+	void Start();
+	void Finish();
+	void InitCrcs(UINT64 size);
+	DWORD StreamCrc(UINT64 size) const;
+};
+
+HRESULT RunCopy(const CopyJob & job, CopyStats & stats);
+// Whether RunCopy moves part of the job through bounce buffers, because an
+// offset or the length is off the sector size of an unbuffered side
+bool IsBounced(const CopyJob & job);
+
+// For copy paths outside the engine. The data at pos must lie within one
+// digest range when its CRC is added directly.
+void AddToDigest(CopyStats & stats, UINT64 pos, const byte * buf, DWORD len);
+void AddCrcToDigest(CopyStats & stats, UINT64 pos, DWORD crc, DWORD len);
+// Prints every whole GB and, once Start was called, samples the timeline
+void ReportProgress(const CopyJob & job, CopyStats & stats, UINT64 done);
+
+#endif//COPYENGINE_H_
@@ -83,11 +83,17 @@ void Drive::DetermineMediaType(HANDLE h)
 
 void Drive::DeterminePartitions(HANDLE h)
 {
-	byte buf[1024];
-	auto layout = (DRIVE_LAYOUT_INFORMATION_EX *) buf;
+	// a GPT disk can have 128 entries or more, so grow the buffer until the layout fits
+	vector<byte> buf(sizeof(DRIVE_LAYOUT_INFORMATION_EX) + 128*sizeof(PARTITION_INFORMATION_EX));
 	DWORD notUsed;
-	if (!DeviceIoControl(h, IOCTL_DISK_GET_DRIVE_LAYOUT_EX, nullptr, 0, layout, ARRAYSIZE(buf), &notUsed, nullptr))
-		return;
+	while (!DeviceIoControl(h, IOCTL_DISK_GET_DRIVE_LAYOUT_EX, nullptr, 0, buf.data(), (DWORD) buf.size(), &notUsed, nullptr))
+	{
+		auto error = GetLastError();
+		if (error!=ERROR_INSUFFICIENT_BUFFER && error!=ERROR_MORE_DATA || buf.size() >= 16*1024*1024)
+			return;
+		buf.resize(buf.size()*2);
+	}
+	auto layout = (DRIVE_LAYOUT_INFORMATION_EX *) buf.data();
 	partitionStyle = layout->PartitionStyle;
 	if (layout->PartitionCount==0)
 		return;
@@ -104,8 +110,6 @@ void Drive::DeterminePartitions(HANDLE h)
 		WCHAR name[MAX_PATH];
 		size_t len = wsprintf(name, L"\\\\.\\PhysicalDrive%d\\Partition%d", p->disk, p->number);
 		p->name = CopyString(name, len);
-		shared_ptr<Partition> sp(p);
-		partitions.push_back(sp);
-		g_partitions.push_back(sp);
+		partitions.push_back(shared_ptr<Partition>(p));
 	}
 }
@@ -32,7 +32,7 @@
 #define DRIVE_H_
 
 #include <memory>
-#include <list>
+#include <vector>
 #include "Partition.h"
 
 struct Drive
@@ -62,6 +62,6 @@ struct Drive
 	void DetermineMediaType(HANDLE h);
 	void DeterminePartitions(HANDLE h);
 };
-typedef list<shared_ptr<Drive>> DriveList;
+typedef vector<shared_ptr<Drive>> DriveList;
 
 #endif//DRIVE_H_
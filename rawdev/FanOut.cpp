@@ -0,0 +1,304 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FanOut.h"
+#include "BufferPool.h"
+#include "OsHelpers.h"
+
+struct FanOutBuffer
+{
+	byte * buf;
+	UINT64 pos;
+	DWORD len;
+	// targets that have yet to write this buffer
+	DWORD refs;
+};
+
+// A write of one target in flight, or the buffer it skipped once the target failed
+struct FanOutWrite
+{
+	OVERLAPPED ov;
+	FanOutBuffer * buffer;
+	DWORD len;
+	UINT64 started;
+	bool issued;
+};
+
+struct FanOut
+{
+	const CopyJob & job;
+	CopyStats & stats;
+	vector<FanOutTarget> & targets;
+	DWORD depth;
+	vector<FanOutBuffer> ring;
+	byte * mem;
+	// room for the whole sectors around a block of an unbuffered source
+	DWORD stride;
+	UINT64 blocks;
+	// blocks read so far, each waiting in the ring until all targets wrote it
+	UINT64 filled;
+	HRESULT readError;
+	SRWLOCK lock;
+	CONDITION_VARIABLE changed;
+
+	FanOut(const CopyJob & j, CopyStats & st, vector<FanOutTarget> & t) : job(j), stats(st), targets(t)
+	{
+		depth = job.queueDepth * 2;
+		mem = nullptr;
+		stride = SpanSize(job.blockSize, job.srcSector);
+		blocks = (job.size + job.blockSize - 1) / job.blockSize;
+		filled = 0;
+		readError = 0;
+		InitializeSRWLock(&lock);
+		InitializeConditionVariable(&changed);
+	}
+
+	~FanOut()
+	{
+		FreeIoBuffer(mem);
+	}
+
+	HRESULT Init()
+	{
+		mem = AllocIoBuffer((SIZE_T)stride * depth);
+		if (!mem)
+			return GetLastError();
+		ring.resize(depth);
+		for (DWORD i=0; i<depth; i++)
+		{
+			ring[i].buf = mem + (SIZE_T)i * stride;
+			ring[i].refs = 0;
+		}
+		return 0;
+	}
+
+	DWORD AlignUp(DWORD len) const
+	{
+		return job.alignment ? (len + job.alignment - 1) / job.alignment * job.alignment : len;
+	}
+
+	void Release(FanOutBuffer & b)
+	{
+		AcquireSRWLockExclusive(&lock);
+		auto freed = --b.refs==0;
+		ReleaseSRWLockExclusive(&lock);
+		if (freed)
+			WakeAllConditionVariable(&changed);
+	}
+
+	// Waits until block i is in the ring, or the reader failed. With writes
+	// still in flight it only looks, so their completions are not held up.
+	bool Available(UINT64 i, bool wait, bool & failed)
+	{
+		AcquireSRWLockExclusive(&lock);
+		while (wait && !readError && filled<=i)
+			SleepConditionVariableSRW(&changed, &lock, INFINITE, 0);
+		auto available = filled>i;
+		failed = readError!=0;
+		ReleaseSRWLockExclusive(&lock);
+		return available;
+	}
+
+	void Complete(FanOutTarget & target, FanOutWrite & w)
+	{
+		if (w.issued)
+		{
+			DWORD done;
+			HRESULT hr = 0;
+			if (!GetOverlappedResult(target.h, &w.ov, &done, TRUE))
+				hr = GetLastError();
+			else if (done!=w.len)
+				hr = ERROR_WRITE_FAULT;
+			if (hr && !target.status)
+				target.status = hr;
+			if (!hr)
+			{
+				target.writes.latency.Add(TicksToNs(Now() - w.started));
+				target.written += w.buffer->len;
+			}
+		}
+		Release(*w.buffer);
+	}
+
+	// Keeps up to job.queueDepth writes in flight and releases the buffers in order
+	void Writer(FanOutTarget & target)
+	{
+		auto start = Now();
+		vector<FanOutWrite> slots(job.queueDepth);
+		for (auto &w : slots)
+		{
+			memset(&w.ov, 0, sizeof(w.ov));
+			auto event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+			// without its events the target fails, but still releases its buffers
+			if (!event && !target.status)
+				target.status = GetLastError();
+			// the low bit keeps completions off any port the handle is bound to
+			if (event)
+				w.ov.hEvent = (HANDLE)((ULONG_PTR)event | 1);
+		}
+		UINT64 issued = 0;
+		UINT64 completed = 0;
+		auto failed = false;
+		while (completed<blocks && !failed)
+		{
+			while (issued<blocks && issued - completed<job.queueDepth && Available(issued, issued==completed, failed))
+			{
+				auto & w = slots[(size_t)(issued % job.queueDepth)];
+				w.buffer = &ring[(size_t)(issued % depth)];
+				// a failed target keeps releasing its buffers so the others carry on
+				w.issued = !target.status;
+				if (w.issued)
+				{
+					auto at = target.offset + w.buffer->pos;
+					w.ov.Offset = (DWORD)at;
+					w.ov.OffsetHigh = (DWORD)(at >> 32);
+					w.len = AlignUp(w.buffer->len);
+					w.started = Now();
+					if (!WriteFile(target.h, w.buffer->buf, w.len, nullptr, &w.ov) && GetLastError()!=ERROR_IO_PENDING)
+					{
+						target.status = GetLastError();
+						w.issued = false;
+					}
+				}
+				issued++;
+			}
+			if (completed<issued)
+				Complete(target, slots[(size_t)(completed++ % job.queueDepth)]);
+		}
+		// a failed read leaves writes in flight, their buffers must not be freed under them
+		for (; completed<issued; completed++)
+			Complete(target, slots[(size_t)(completed % job.queueDepth)]);
+		for (auto &w : slots)
+			if (w.ov.hEvent) CloseHandle((HANDLE)((ULONG_PTR)w.ov.hEvent & ~(ULONG_PTR)1));
+		target.elapsedNs = TicksToNs(Now() - start);
+	}
+
+	HRESULT Reader()
+	{
+		for (UINT64 i=0; i<blocks; i++)
+		{
+			auto & b = ring[(size_t)(i % depth)];
+			auto t = Now();
+			AcquireSRWLockExclusive(&lock);
+			while (b.refs>0)
+				SleepConditionVariableSRW(&changed, &lock, INFINITE, 0);
+			ReleaseSRWLockExclusive(&lock);
+			auto now = Now();
+			stats.writes.stallNs += TicksToNs(now - t);
+			b.pos = i * job.blockSize;
+			b.len = job.size - b.pos < job.blockSize ? (DWORD)(job.size - b.pos) : job.blockSize;
+			auto ioLen = AlignUp(b.len);
+			if (job.throttle)
+				job.throttle->Take(ioLen);
+			DWORD done;
+			auto hr = ReadSpan(job.hsrc, b.buf, b.len, job.srcOffset + b.pos, job.srcSector, done);
+			if (!hr && done<b.len)
+				hr = ERROR_HANDLE_EOF;
+			if (hr)
+			{
+				AcquireSRWLockExclusive(&lock);
+				readError = hr;
+				ReleaseSRWLockExclusive(&lock);
+				WakeAllConditionVariable(&changed);
+				return hr;
+			}
+			stats.reads.latency.Add(TicksToNs(Now() - now));
+			if (ioLen>b.len)
+				memset(b.buf + b.len, 0, ioLen - b.len);
+			if (job.checksum)
+				AddToDigest(stats, b.pos, b.buf, b.len);
+			AcquireSRWLockExclusive(&lock);
+			b.refs = (DWORD)targets.size();
+			filled = i + 1;
+			ReleaseSRWLockExclusive(&lock);
+			WakeAllConditionVariable(&changed);
+			stats.copied += b.len;
+			ReportProgress(job, stats, stats.copied);
+		}
+		return 0;
+	}
+};
+
+struct WriterStart
+{
+	FanOut * fanOut;
+	FanOutTarget * target;
+};
+
+static DWORD WINAPI WriterThread(LPVOID p)
+{
+	auto start = (WriterStart *) p;
+	start->fanOut->Writer(*start->target);
+	return 0;
+}
+
+HRESULT RunFanOut(const CopyJob & job, CopyStats & stats, vector<FanOutTarget> & targets)
+{
+	if (job.blockSize==0 || job.queueDepth==0 || targets.empty() || targets.size()>MAXIMUM_WAIT_OBJECTS)
+		return ERROR_INVALID_PARAMETER;
+	if (job.alignment!=0 && job.blockSize%job.alignment!=0)
+		return ERROR_INVALID_PARAMETER;
+	if (job.checksum && digestRangeSize%job.blockSize!=0)
+		return ERROR_INVALID_PARAMETER;
+	if (job.checksum)
+		stats.InitCrcs(job.size);
+	FanOut f(job, stats, targets);
+	auto hr = f.Init();
+	if (hr) return hr;
+	HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+	WriterStart starts[MAXIMUM_WAIT_OBJECTS];
+	DWORD started = 0;
+	for (; started<targets.size(); started++)
+	{
+		starts[started].fanOut = &f;
+		starts[started].target = &targets[started];
+		threads[started] = CreateThread(nullptr, 0, WriterThread, &starts[started], 0, nullptr);
+		if (!threads[started])
+			break;
+	}
+	// the ring waits for every target, so all writers must be running
+	if (started<targets.size())
+	{
+		hr = GetLastError();
+		AcquireSRWLockExclusive(&f.lock);
+		f.readError = hr;
+		ReleaseSRWLockExclusive(&f.lock);
+		WakeAllConditionVariable(&f.changed);
+	}
+	else
+		hr = f.Reader();
+	if (started)
+		WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+	for (DWORD i=0; i<started; i++)
+		CloseHandle(threads[i]);
+	for (size_t i=0; i<targets.size(); i++)
+		stats.writes.Merge(targets[i].writes);
+	return hr;
+}
@@ -0,0 +1,70 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FANOUT_H_
+#define FANOUT_H_
+
+#include <Windows.h>
+#include <vector>
+#include "CopyEngine.h"
+
+using namespace std;
+
+// One destination of a fan-out copy and how its writes went
+struct FanOutTarget
+{
+	LPWSTR name;
+	HANDLE h;
+	UINT64 offset;
+	HRESULT status;
+	UINT64 written;
+	UINT64 elapsedNs;
+	IoSide writes;
+	FanOutTarget()
+	{
+		name = nullptr;
+		h = INVALID_HANDLE_VALUE;
+		offset = 0;
+		status = 0;
+		written = 0;
+		elapsedNs = 0;
+	}
+};
+
+// Reads the job's source once into a ring of job.queueDepth * 2 shared
+// buffers and writes every buffer to all targets, each from its own
+// thread with up to job.queueDepth writes in flight. An unbuffered source
+// is read in the whole job.srcSector units around each block. A buffer is
+// reused once the last target has written it, so a slow target only holds
+// back the ring, and a failed one drops out without stopping the others.
+// job.hdst and job.dstOffset are not used.
+HRESULT RunFanOut(const CopyJob & job, CopyStats & stats, vector<FanOutTarget> & targets);
+
+#endif//FANOUT_H_
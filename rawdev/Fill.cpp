@@ -0,0 +1,215 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Fill.h"
+#include "OsHelpers.h"
+#include <cstddef>
+
+const size_t maxPattern = 4096;
+
+static int HexDigit(WCHAR c)
+{
+	if (c>=L'0' && c<=L'9') return c - L'0';
+	if (c>=L'a' && c<=L'f') return c - L'a' + 10;
+	if (c>=L'A' && c<=L'F') return c - L'A' + 10;
+	return -1;
+}
+
+bool Generator::SetPattern(LPCWSTR hex)
+{
+	if (hex[0]==L'0' && (hex[1]==L'x' || hex[1]==L'X'))
+		hex += 2;
+	auto len = wcslen(hex);
+	if (len==0 || len%2!=0 || len/2>maxPattern)
+		return false;
+	pattern.resize(len/2);
+	for (size_t i=0; i<pattern.size(); i++)
+	{
+		auto high = HexDigit(hex[2*i]);
+		auto low = HexDigit(hex[2*i + 1]);
+		if (high<0 || low<0)
+			return false;
+		pattern[i] = (byte)(high << 4 | low);
+	}
+	kind = FillPattern;
+	return true;
+}
+
+// SplitMix64 over a counter: each 8 byte word of the destination gets the
+// mix of its own index, a few multiplies and shifts and no state to carry
+static UINT64 Mix(UINT64 seed, UINT64 word)
+{
+	auto z = seed + (word + 1) * 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+void Generator::Produce(byte * buf, DWORD len, UINT64 offset) const
+{
+	if (kind==FillZero)
+	{
+		memset(buf, 0, len);
+		return;
+	}
+	if (kind==FillPattern)
+	{
+		// one period from where offset falls in the pattern, then doubling copies of whole periods
+		auto period = pattern.size();
+		auto start = (size_t)(offset % period);
+		DWORD done = 0;
+		for (; done<len && done<period; done++)
+			buf[done] = pattern[(start + done) % period];
+		while (done<len)
+		{
+			auto n = len - done < done ? len - done : done;
+			memcpy(buf + done, buf, n);
+			done += n;
+		}
+		return;
+	}
+	auto word = offset / 8;
+	auto skip = (DWORD)(offset % 8);
+	UINT64 value;
+	if (skip)
+	{
+		value = Mix(seed, word++);
+		auto n = 8 - skip < len ? 8 - skip : len;
+		memcpy(buf, (byte *)&value + skip, n);
+		buf += n;
+		len -= n;
+	}
+	for (; len>=8; len -= 8, buf += 8)
+	{
+		value = Mix(seed, word++);
+		memcpy(buf, &value, 8);
+	}
+	if (len)
+	{
+		value = Mix(seed, word);
+		memcpy(buf, &value, len);
+	}
+}
+
+// A TRIM request at a time covers this many ranges of at most trimRangeSize,
+// small enough that progress keeps moving on a large disk
+const DWORD trimRanges = 16;
+const UINT64 trimRangeSize = 1024*1024*1024;
+
+struct TrimRequest
+{
+	DEVICE_MANAGE_DATA_SET_ATTRIBUTES attributes;
+	DEVICE_DATA_SET_RANGE ranges[trimRanges];
+};
+
+static void Time(IoSide & side, UINT64 start)
+{
+	auto ns = TicksToNs(Now() - start);
+	side.latency.Add(ns);
+	side.stallNs += ns;
+}
+
+static HRESULT TrimDevice(const CopyJob & job, CopyStats & stats)
+{
+	auto sector = GetSectorSize(job.hdst);
+	if (sector==0)
+		sector = 512;
+	if (job.dstOffset%sector!=0 || job.size%sector!=0)
+		return ERROR_INVALID_PARAMETER;
+	TrimRequest request;
+	for (UINT64 pos=0; pos<job.size; )
+	{
+		memset(&request, 0, sizeof(request));
+		request.attributes.Size = sizeof(request.attributes);
+		request.attributes.Action = DeviceDsmAction_Trim;
+		request.attributes.DataSetRangesOffset = offsetof(TrimRequest, ranges);
+		DWORD count = 0;
+		UINT64 len = 0;
+		for (; count<trimRanges && pos<job.size; count++)
+		{
+			auto n = job.size - pos < trimRangeSize ? job.size - pos : trimRangeSize;
+			request.ranges[count].StartingOffset = job.dstOffset + pos;
+			request.ranges[count].LengthInBytes = n;
+			pos += n;
+			len += n;
+		}
+		request.attributes.DataSetRangesLength = count * sizeof(DEVICE_DATA_SET_RANGE);
+		auto t = Now();
+		if (!Control(job.hdst, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &request, request.attributes.DataSetRangesOffset + request.attributes.DataSetRangesLength, nullptr, 0))
+		{
+			auto error = GetLastError();
+			return error==ERROR_INVALID_FUNCTION ? ERROR_NOT_SUPPORTED : error;
+		}
+		Time(stats.writes, t);
+		stats.copied += len;
+		ReportProgress(job, stats, stats.copied);
+	}
+	return 0;
+}
+
+static HRESULT PunchFile(const CopyJob & job, CopyStats & stats)
+{
+	// zeroing a range of a sparse file deallocates it
+	if (!Control(job.hdst, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0))
+	{
+		auto error = GetLastError();
+		return error==ERROR_INVALID_FUNCTION ? ERROR_NOT_SUPPORTED : error;
+	}
+	auto end = job.dstOffset + job.size;
+	LARGE_INTEGER large;
+	if (!GetFileSizeEx(job.hdst, &large))
+		return GetLastError();
+	if ((UINT64)large.QuadPart<end && !SetFileSize(job.hdst, end))
+		return GetLastError();
+	for (UINT64 pos=0; pos<job.size; )
+	{
+		auto n = job.size - pos < trimRangeSize ? job.size - pos : trimRangeSize;
+		FILE_ZERO_DATA_INFORMATION zero;
+		zero.FileOffset.QuadPart = job.dstOffset + pos;
+		zero.BeyondFinalZero.QuadPart = job.dstOffset + pos + n;
+		auto t = Now();
+		if (!Control(job.hdst, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), nullptr, 0))
+			return GetLastError();
+		Time(stats.writes, t);
+		pos += n;
+		stats.copied += n;
+		ReportProgress(job, stats, stats.copied);
+	}
+	return 0;
+}
+
+HRESULT Discard(const CopyJob & job, CopyStats & stats, bool isFile)
+{
+	stats.blockSize = (DWORD)trimRangeSize;
+	stats.queueDepth = 1;
+	if (job.size==0)
+		return 0;
+	return isFile ? PunchFile(job, stats) : TrimDevice(job, stats);
+}
@@ -0,0 +1,69 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FILL_H_
+#define FILL_H_
+
+#include <Windows.h>
+#include <vector>
+#include "CopyEngine.h"
+
+using namespace std;
+
+enum FillKind { FillZero, FillPattern, FillRandom };
+
+// Makes the data a fill writes, in place of a source. Every byte depends
+// only on its offset on the destination, so blocks can be made in any
+// order, by any thread, and a range can be filled again to check it.
+struct Generator
+{
+	FillKind kind;
+	vector<byte> pattern;
+	UINT64 seed;
+
+	Generator()
+	{
+		kind = FillZero;
+		seed = 0;
+	}
+
+	// Takes a pattern of hex digits, for example DEADBEEF, at most 4096 bytes
+	bool SetPattern(LPCWSTR hex);
+	void Produce(byte * buf, DWORD len, UINT64 offset) const;
+};
+
+// Releases the range instead of writing it: a TRIM to a disk, volume or
+// partition, a hole punched into a file, which is made sparse first.
+// Devices need the range on whole sectors. Fails with ERROR_NOT_SUPPORTED
+// where the device or file system has no such request. What a discarded
+// range reads back as is up to the device; a file reads back zeros.
+HRESULT Discard(const CopyJob & job, CopyStats & stats, bool isFile);
+
+#endif//FILL_H_
@@ -30,54 +30,119 @@
 
 #include "Finders.h"
 #include "Globals.h"
+#include <algorithm>
 
-Volume * FindVolume(LPWSTR s)
+struct DiskOffset
 {
-	for (auto &v : g_volumes)
+	DWORD disk;
+	UINT64 offset;
+	bool operator<(const DiskOffset & other) const { return disk<other.disk || (disk==other.disk && offset<other.offset); }
+	bool operator==(const DiskOffset & other) const { return disk==other.disk && offset==other.offset; }
+};
+
+// Names point into the devices that own them and are compared with
+// lstrcmp, so a name matches exactly what the list search matched
+struct NameKey
+{
+	LPCWSTR name;
+	bool operator<(const NameKey & other) const { return lstrcmp(name, other.name)<0; }
+	bool operator==(const NameKey & other) const { return lstrcmp(name, other.name)==0; }
+};
+
+// A sorted array of keys searched by bisection. The entries sit in one
+// block, so a lookup touches a few cache lines rather than a hash node and
+// a separately allocated string per probe.
+template<typename K, typename T> struct FlatIndex
+{
+	vector<pair<K, T *>> entries;
+
+	void Clear() { entries.clear(); }
+	void Add(const K & key, T * device) { entries.push_back(make_pair(key, device)); }
+	// The first device to claim a key keeps it, as when the lists were searched in order
+	void Build()
 	{
-		if (lstrcmp(s, v->dosName)==0) return v.get();
-		else if (lstrcmp(s, v->deviceName)==0) return v.get();
-		else if (lstrcmp(s, v->name)==0) return v.get();
+		stable_sort(entries.begin(), entries.end(), [](const pair<K, T *> & a, const pair<K, T *> & b) { return a.first < b.first; });
+		entries.erase(unique(entries.begin(), entries.end(), [](const pair<K, T *> & a, const pair<K, T *> & b) { return a.first==b.first; }), entries.end());
+		entries.shrink_to_fit();
 	}
-	return nullptr;
-}
+	T * Find(const K & key) const
+	{
+		auto it = lower_bound(entries.begin(), entries.end(), key, [](const pair<K, T *> & e, const K & k) { return e.first < k; });
+		return it!=entries.end() && it->first==key ? it->second : nullptr;
+	}
+};
 
-Drive * FindDrive(LPWSTR s)
+static FlatIndex<NameKey, Volume> volumesByName;
+static FlatIndex<NameKey, Drive> drivesByName;
+static FlatIndex<DWORD, Drive> drivesByNumber;
+static FlatIndex<NameKey, Partition> partitionsByName;
+static FlatIndex<DiskOffset, Partition> partitionsByOffset;
+
+template<typename T> static void AddName(FlatIndex<NameKey, T> & index, LPCWSTR name, T * device)
 {
-	for (auto &d : g_drives)
+	if (name)
 	{
-		if (lstrcmp(s, d->name)==0)
-			return d.get();
+		NameKey key = { name };
+		index.Add(key, device);
 	}
-	return nullptr;
 }
 
-Drive * FindDrive(DWORD number)
+void IndexDevices()
 {
+	volumesByName.Clear();
+	drivesByName.Clear();
+	drivesByNumber.Clear();
+	partitionsByName.Clear();
+	partitionsByOffset.Clear();
+	for (auto &v : g_volumes)
+	{
+		AddName(volumesByName, v->dosName, v.get());
+		AddName(volumesByName, v->deviceName, v.get());
+		AddName(volumesByName, v->name, v.get());
+	}
 	for (auto &d : g_drives)
 	{
-		if (d->number==number)
-			return d.get();
+		AddName(drivesByName, d->name, d.get());
+		drivesByNumber.Add(d->number, d.get());
+	}
+	for (auto &p : g_partitions)
+	{
+		AddName(partitionsByName, p->name, p.get());
+		DiskOffset key = { p->disk, p->offset };
+		partitionsByOffset.Add(key, p.get());
 	}
-	return nullptr;
+	volumesByName.Build();
+	drivesByName.Build();
+	drivesByNumber.Build();
+	partitionsByName.Build();
+	partitionsByOffset.Build();
+}
+
+Volume * FindVolume(LPWSTR s)
+{
+	NameKey key = { s };
+	return volumesByName.Find(key);
+}
+
+Drive * FindDrive(LPWSTR s)
+{
+	NameKey key = { s };
+	return drivesByName.Find(key);
+}
+
+Drive * FindDrive(DWORD number)
+{
+	return drivesByNumber.Find(number);
 }
 
 Partition * FindPartition(DWORD disk, UINT64 offset)
 {
-	for (auto &p : g_partitions)
-	{
-		if (p->disk==disk && p->offset==offset)
-			return p.get();
-	}
-	return nullptr;
+	DiskOffset key = { disk, offset };
+	return partitionsByOffset.Find(key);
 }
 
 Partition * FindPartition(LPWSTR s)
 {
-	for (auto &p : g_partitions)
-	{
-		if (lstrcmp(s, p->name)==0)
-			return p.get();
-	}
-	return nullptr;
+	NameKey key = { s };
+	return partitionsByName.Find(key);
 }
@@ -34,6 +34,10 @@
 #include "Drive.h"
 #include "Volume.h"
 
+// Sorts the devices into the arrays the finders search by bisection, once
+// they are enumerated
+void IndexDevices();
+
 Drive * FindDrive(DWORD number);
 Drive * FindDrive(LPWSTR s);
 Partition * FindPartition(DWORD disk, UINT64 offset);
@@ -0,0 +1,268 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FramePipeline.h"
+#include "BufferPool.h"
+
+enum FrameState { FrameFree, FrameFilled, FrameTransforming, FrameDone };
+
+struct FrameRing
+{
+	FrameWork & work;
+	UINT64 count;
+	DWORD depth;
+	DWORD workers;
+	Frame * frames;
+	FrameState * states;
+	byte * mem;
+	SRWLOCK lock;
+	CONDITION_VARIABLE changed;
+	UINT64 nextTransform;
+	HRESULT error;
+	IoSide * reads;
+	IoSide * writes;
+	Throttle * throttle;
+
+	FrameRing(FrameWork & w, UINT64 c, DWORD n) : work(w)
+	{
+		count = c;
+		workers = n;
+		depth = 2 * n + 2;
+		frames = nullptr;
+		states = nullptr;
+		mem = nullptr;
+		InitializeSRWLock(&lock);
+		InitializeConditionVariable(&changed);
+		nextTransform = 0;
+		error = 0;
+		reads = nullptr;
+		writes = nullptr;
+		throttle = nullptr;
+	}
+
+	~FrameRing()
+	{
+		if (frames) delete[] frames;
+		if (states) delete[] states;
+		FreeIoBuffer(mem);
+	}
+
+	HRESULT Init(DWORD inSize, DWORD outSize)
+	{
+		// every frame starts on a page so its in buffer suits unbuffered I/O
+		auto frameMem = ((SIZE_T)inSize + outSize + 4095) / 4096 * 4096;
+		mem = AllocIoBuffer(frameMem * depth);
+		if (!mem)
+			return GetLastError();
+		frames = new Frame[depth];
+		states = new FrameState[depth];
+		for (DWORD i=0; i<depth; i++)
+		{
+			memset(&frames[i], 0, sizeof(Frame));
+			frames[i].in = mem + i * frameMem;
+			frames[i].out = frames[i].in + inSize;
+			states[i] = FrameFree;
+		}
+		return 0;
+	}
+
+	// Waits with the lock held until frame i reaches state, false on error
+	bool WaitFor(UINT64 i, FrameState state)
+	{
+		while (!error && states[i % depth]!=state)
+			SleepConditionVariableSRW(&changed, &lock, INFINITE, 0);
+		return !error;
+	}
+
+	void Set(UINT64 i, FrameState state, HRESULT hr)
+	{
+		AcquireSRWLockExclusive(&lock);
+		if (!hr)
+			states[i % depth] = state;
+		else if (!error)
+			error = hr;
+		ReleaseSRWLockExclusive(&lock);
+		WakeAllConditionVariable(&changed);
+	}
+
+	// Adds the time since start to side's stall and returns now
+	static UINT64 Stalled(IoSide * side, UINT64 start)
+	{
+		auto now = Now();
+		if (side)
+			side->stallNs += TicksToNs(now - start);
+		return now;
+	}
+
+	static void Timed(IoSide * side, UINT64 start)
+	{
+		if (side)
+			side->latency.Add(TicksToNs(Now() - start));
+	}
+
+	void Reader()
+	{
+		for (UINT64 i=0; i<count; i++)
+		{
+			auto t = Now();
+			AcquireSRWLockExclusive(&lock);
+			auto ok = WaitFor(i, FrameFree);
+			ReleaseSRWLockExclusive(&lock);
+			if (!ok)
+				return;
+			t = Stalled(writes, t);
+			auto & f = frames[i % depth];
+			f.index = i;
+			auto hr = work.Read(f);
+			Timed(reads, t);
+			if (throttle && !hr)
+				throttle->Take(f.inLen);
+			Set(i, FrameFilled, hr);
+		}
+	}
+
+	void Worker(DWORD worker)
+	{
+		while (true)
+		{
+			AcquireSRWLockExclusive(&lock);
+			while (!error && nextTransform<count && states[nextTransform % depth]!=FrameFilled)
+				SleepConditionVariableSRW(&changed, &lock, INFINITE, 0);
+			auto ok = !error && nextTransform<count;
+			auto i = nextTransform;
+			if (ok)
+			{
+				nextTransform++;
+				states[i % depth] = FrameTransforming;
+			}
+			ReleaseSRWLockExclusive(&lock);
+			if (!ok)
+				return;
+			Set(i, FrameDone, work.Transform(frames[i % depth], worker));
+		}
+	}
+
+	HRESULT Writer()
+	{
+		for (UINT64 i=0; i<count; i++)
+		{
+			auto t = Now();
+			AcquireSRWLockExclusive(&lock);
+			auto ok = WaitFor(i, FrameDone);
+			ReleaseSRWLockExclusive(&lock);
+			if (!ok)
+				break;
+			t = Stalled(reads, t);
+			auto hr = work.Write(frames[i % depth]);
+			Timed(writes, t);
+			Set(i, FrameFree, hr);
+		}
+		AcquireSRWLockExclusive(&lock);
+		auto hr = error;
+		ReleaseSRWLockExclusive(&lock);
+		return hr;
+	}
+
+	void Fail(HRESULT hr)
+	{
+		AcquireSRWLockExclusive(&lock);
+		if (!error)
+			error = hr;
+		ReleaseSRWLockExclusive(&lock);
+		WakeAllConditionVariable(&changed);
+	}
+};
+
+struct WorkerStart
+{
+	FrameRing * ring;
+	DWORD worker;
+};
+
+static DWORD WINAPI ReaderThread(LPVOID p)
+{
+	((FrameRing *) p)->Reader();
+	return 0;
+}
+
+static DWORD WINAPI WorkerThread(LPVOID p)
+{
+	auto start = (WorkerStart *) p;
+	start->ring->Worker(start->worker);
+	return 0;
+}
+
+HRESULT RunFrames(FrameWork & work, UINT64 count, DWORD inSize, DWORD outSize, DWORD workers,
+	IoSide * reads, IoSide * writes, Throttle * throttle)
+{
+	if (workers==0 || workers>=MAXIMUM_WAIT_OBJECTS)
+		return ERROR_INVALID_PARAMETER;
+	if (count==0)
+		return 0;
+	FrameRing ring(work, count, workers);
+	ring.reads = reads;
+	ring.writes = writes;
+	ring.throttle = throttle;
+	auto hr = ring.Init(inSize, outSize);
+	if (hr) return hr;
+	HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+	WorkerStart starts[MAXIMUM_WAIT_OBJECTS];
+	DWORD started = 0;
+	threads[started] = CreateThread(nullptr, 0, ReaderThread, &ring, 0, nullptr);
+	if (threads[started])
+		started++;
+	for (DWORD i=0; started==i+1 && i<workers; i++)
+	{
+		starts[i].ring = &ring;
+		starts[i].worker = i;
+		threads[started] = CreateThread(nullptr, 0, WorkerThread, &starts[i], 0, nullptr);
+		if (threads[started])
+			started++;
+	}
+	if (started!=workers+1)
+		ring.Fail(GetLastError());
+	hr = ring.Writer();
+	// the reader or the workers may still be waiting for a frame the writer never freed
+	ring.Fail(hr ? hr : ERROR_OPERATION_ABORTED);
+	WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+	for (DWORD i=0; i<started; i++)
+		CloseHandle(threads[i]);
+	return hr;
+}
+
+DWORD DefaultWorkers()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	auto n = info.dwNumberOfProcessors;
+	if (n==0) n = 1;
+	if (n>=MAXIMUM_WAIT_OBJECTS) n = MAXIMUM_WAIT_OBJECTS - 1;
+	return n;
+}
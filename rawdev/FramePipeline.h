@@ -0,0 +1,74 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FRAMEPIPELINE_H_
+#define FRAMEPIPELINE_H_
+
+#include <Windows.h>
+#include "Histogram.h"
+#include "Throttle.h"
+
+// One unit of work moving through RunFrames. in and out are page aligned
+// buffers of the sizes given to RunFrames; the rest is up to the FrameWork.
+struct Frame
+{
+	UINT64 index;
+	byte * in;
+	DWORD inLen;
+	byte * out;
+	DWORD outLen;
+	DWORD flags;
+	DWORD crc;
+};
+
+struct FrameWork
+{
+	virtual ~FrameWork() {}
+	// Called in frame order on a dedicated reader thread
+	virtual HRESULT Read(Frame & f) = 0;
+	// Called out of order on any of the worker threads, worker is 0..workers-1
+	virtual HRESULT Transform(Frame & f, DWORD worker) = 0;
+	// Called in frame order on the thread that called RunFrames
+	virtual HRESULT Write(Frame & f) = 0;
+};
+
+// Runs count frames through read, a pool of transform workers and an ordered
+// write, with a ring of frames in flight so every stage keeps busy.
+// When given, reads and writes collect the latency of each Read and Write
+// call; the writer waiting on a frame counts as a read stall and the reader
+// waiting for a free frame as a write stall. A throttle is paid for every
+// frame read.
+HRESULT RunFrames(FrameWork & work, UINT64 count, DWORD inSize, DWORD outSize, DWORD workers,
+	IoSide * reads = nullptr, IoSide * writes = nullptr, Throttle * throttle = nullptr);
+
+// Number of transform workers to use when the user did not ask for a number
+DWORD DefaultWorkers();
+
+#endif//FRAMEPIPELINE_H_
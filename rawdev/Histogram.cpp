@@ -0,0 +1,119 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Histogram.h"
+#include <intrin.h>
+
+static DWORD BucketOf(UINT64 value)
+{
+	if (value<(1ull << Histogram::subBits))
+		return (DWORD)value;
+	unsigned long top;
+	_BitScanReverse64(&top, value);
+	auto shift = top - Histogram::subBits;
+	return ((shift + 1) << Histogram::subBits) + (DWORD)((value >> shift) & ((1 << Histogram::subBits) - 1));
+}
+
+// The largest value that falls into bucket
+static UINT64 BucketTop(DWORD bucket)
+{
+	if (bucket<(1u << Histogram::subBits))
+		return bucket;
+	auto shift = (bucket >> Histogram::subBits) - 1;
+	auto mantissa = (1ull << Histogram::subBits) + (bucket & ((1 << Histogram::subBits) - 1));
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void Histogram::Clear()
+{
+	memset(counts, 0, sizeof(counts));
+	total = 0;
+	sum = 0;
+	max = 0;
+}
+
+void Histogram::Add(UINT64 value)
+{
+	counts[BucketOf(value)]++;
+	total++;
+	sum += value;
+	if (value>max)
+		max = value;
+}
+
+void Histogram::Merge(const Histogram & other)
+{
+	for (DWORD i=0; i<bucketCount; i++)
+		counts[i] += other.counts[i];
+	total += other.total;
+	sum += other.sum;
+	if (other.max>max)
+		max = other.max;
+}
+
+UINT64 Histogram::Percentile(DWORD perMille) const
+{
+	if (total==0)
+		return 0;
+	// the rank of the value asked for, counted from 1
+	auto rank = (total * perMille + 999) / 1000;
+	if (rank==0)
+		rank = 1;
+	UINT64 seen = 0;
+	for (DWORD i=0; i<bucketCount; i++)
+	{
+		seen += counts[i];
+		if (seen>=rank)
+			return BucketTop(i) < max ? BucketTop(i) : max;
+	}
+	return max;
+}
+
+static UINT64 QueryFrequency()
+{
+	LARGE_INTEGER f;
+	QueryPerformanceFrequency(&f);
+	return f.QuadPart;
+}
+
+static const UINT64 frequency = QueryFrequency();
+
+UINT64 Now()
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return t.QuadPart;
+}
+
+UINT64 TicksToNs(UINT64 ticks)
+{
+	// split so the multiplication cannot overflow for long intervals
+	return ticks / frequency * 1000000000 + ticks % frequency * 1000000000 / frequency;
+}
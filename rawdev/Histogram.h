@@ -0,0 +1,75 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <Windows.h>
+
+// A log-linear histogram: every power of two is split into 16 equal buckets,
+// so any value is kept to within 1/16 of itself in a fixed 8 KB of counters.
+// Adding a value is a bit scan and an increment.
+struct Histogram
+{
+	static const DWORD subBits = 4;
+	static const DWORD bucketCount = (64 - subBits + 1) << subBits;
+	UINT64 counts[bucketCount];
+	UINT64 total;
+	UINT64 sum;
+	UINT64 max;
+
+	Histogram() { Clear(); }
+	void Clear();
+	void Add(UINT64 value);
+	void Merge(const Histogram & other);
+	// The value below which perMille of all values fall, at bucket resolution
+	UINT64 Percentile(DWORD perMille) const;
+	UINT64 Mean() const { return total ? sum / total : 0; }
+};
+
+// The timing of one side of a transfer: how long each I/O took, and how long
+// the transfer as a whole waited for this side
+struct IoSide
+{
+	Histogram latency;
+	UINT64 stallNs;
+	IoSide() { stallNs = 0; }
+	void Merge(const IoSide & other)
+	{
+		latency.Merge(other.latency);
+		stallNs += other.stallNs;
+	}
+};
+
+// High resolution timestamps for latency measurements
+UINT64 Now();
+UINT64 TicksToNs(UINT64 ticks);
+
+#endif//HISTOGRAM_H_
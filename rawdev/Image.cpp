@@ -0,0 +1,323 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Image.h"
+#include <compressapi.h>
+#include "Checksum.h"
+#include "FramePipeline.h"
+#include "OsHelpers.h"
+#include "Simd.h"
+
+static const DWORD imageVersion = 1;
+static const DWORD imageAlgorithm = COMPRESS_ALGORITHM_XPRESS | COMPRESS_RAW;
+
+HRESULT ReadImageHeader(HANDLE h, ImageHeader & header)
+{
+	DWORD done;
+	auto hr = ReadHeader(h, &header, sizeof(header), done);
+	if (hr) return hr;
+	if (done<sizeof(header) || memcmp(header.magic, imageMagic, sizeof(imageMagic))!=0)
+		return ERROR_BAD_FORMAT;
+	if (header.version!=imageVersion || header.algorithm!=imageAlgorithm || header.frameSize==0)
+		return ERROR_BAD_FORMAT;
+	return 0;
+}
+
+struct Compressor : FrameWork
+{
+	const CopyJob & job;
+	CopyStats & stats;
+	vector<COMPRESSOR_HANDLE> compressors;
+	vector<ImageFrameEntry> table;
+	UINT64 writePos;
+
+	Compressor(const CopyJob & j, CopyStats & st) : job(j), stats(st)
+	{
+		writePos = imageHeaderSize;
+	}
+
+	~Compressor()
+	{
+		for (auto c : compressors)
+			CloseCompressor(c);
+	}
+
+	HRESULT Init(DWORD workers)
+	{
+		for (DWORD i=0; i<workers; i++)
+		{
+			COMPRESSOR_HANDLE c;
+			if (!CreateCompressor(imageAlgorithm, nullptr, &c))
+				return GetLastError();
+			compressors.push_back(c);
+		}
+		table.reserve((size_t)((job.size + job.blockSize - 1) / job.blockSize));
+		return 0;
+	}
+
+	HRESULT Read(Frame & f)
+	{
+		auto pos = f.index * job.blockSize;
+		f.inLen = job.size - pos < job.blockSize ? (DWORD)(job.size - pos) : job.blockSize;
+		// unbuffered sources can only be read in whole sectors
+		DWORD done;
+		auto hr = ReadSpan(job.hsrc, f.in, f.inLen, job.srcOffset + pos, job.srcSector, done);
+		if (hr) return hr;
+		if (done<f.inLen)
+			return ERROR_HANDLE_EOF;
+		return 0;
+	}
+
+	HRESULT Transform(Frame & f, DWORD worker)
+	{
+		f.crc = Crc32c(0, f.in, f.inLen);
+		f.outLen = 0;
+		if (IsZero(f.in, f.inLen))
+		{
+			f.flags = FrameZero;
+			return 0;
+		}
+		SIZE_T outLen;
+		// anything that does not shrink is stored as is
+		if (Compress(compressors[worker], f.in, f.inLen, f.out, f.inLen - 1, &outLen))
+		{
+			f.flags = FrameCompressed;
+			f.outLen = (DWORD)outLen;
+			return 0;
+		}
+		if (GetLastError()!=ERROR_INSUFFICIENT_BUFFER)
+			return GetLastError();
+		f.flags = FrameStored;
+		f.outLen = f.inLen;
+		return 0;
+	}
+
+	HRESULT Write(Frame & f)
+	{
+		ImageFrameEntry e;
+		memset(&e, 0, sizeof(e));
+		e.offset = writePos;
+		e.length = f.outLen;
+		e.kind = f.flags;
+		e.crc = f.crc;
+		if (e.length>0)
+		{
+			auto hr = WriteAt(job.hdst, f.flags==FrameStored ? f.in : f.out, e.length, writePos);
+			if (hr) return hr;
+		}
+		writePos += e.length;
+		table.push_back(e);
+		if (job.checksum)
+			AddCrcToDigest(stats, f.index * job.blockSize, f.crc, f.inLen);
+		if (f.flags==FrameZero)
+			stats.skipped += f.inLen;
+		else
+			stats.copied += f.inLen;
+		ReportProgress(job, stats, stats.copied + stats.skipped);
+		return 0;
+	}
+
+	HRESULT Finish()
+	{
+		auto tableBytes = (DWORD)(table.size() * sizeof(ImageFrameEntry));
+		auto hr = WriteAt(job.hdst, table.data(), tableBytes, writePos);
+		if (hr) return hr;
+		byte headerBuf[imageHeaderSize];
+		memset(headerBuf, 0, sizeof(headerBuf));
+		auto & header = *(ImageHeader *) headerBuf;
+		memcpy(header.magic, imageMagic, sizeof(imageMagic));
+		header.version = imageVersion;
+		header.algorithm = imageAlgorithm;
+		header.size = job.size;
+		header.frameSize = job.blockSize;
+		header.tableCrc = Crc32c(0, table.data(), tableBytes);
+		header.frameCount = table.size();
+		header.tableOffset = writePos;
+		hr = WriteAt(job.hdst, headerBuf, sizeof(headerBuf), 0);
+		if (hr) return hr;
+		if (!SetFileSize(job.hdst, writePos + tableBytes))
+			return GetLastError();
+		wprintf(L"Image is %I64u bytes, %I64u%% of the source\n", writePos + tableBytes, job.size ? (writePos + tableBytes) * 100 / job.size : 0);
+		return 0;
+	}
+};
+
+HRESULT CompressImage(const CopyJob & job, CopyStats & stats, DWORD workers)
+{
+	if (job.dstOffset!=0)
+		return ERROR_INVALID_PARAMETER;
+	if (job.checksum)
+		stats.InitCrcs(job.size);
+	Compressor c(job, stats);
+	auto hr = c.Init(workers);
+	if (hr) return hr;
+	auto frames = (job.size + job.blockSize - 1) / job.blockSize;
+	hr = RunFrames(c, frames, SpanSize(job.blockSize, job.srcSector), job.blockSize, workers, &stats.reads, &stats.writes, job.throttle);
+	if (hr) return hr;
+	return c.Finish();
+}
+
+struct Expander : FrameWork
+{
+	const CopyJob & job;
+	CopyStats & stats;
+	const ImageHeader & header;
+	vector<DECOMPRESSOR_HANDLE> decompressors;
+	vector<ImageFrameEntry> table;
+	UINT64 first;
+
+	Expander(const CopyJob & j, CopyStats & st, const ImageHeader & h) : job(j), stats(st), header(h)
+	{
+		first = job.srcOffset / header.frameSize;
+	}
+
+	~Expander()
+	{
+		for (auto d : decompressors)
+			CloseDecompressor(d);
+	}
+
+	HRESULT Init(DWORD workers)
+	{
+		for (DWORD i=0; i<workers; i++)
+		{
+			DECOMPRESSOR_HANDLE d;
+			if (!CreateDecompressor(imageAlgorithm, nullptr, &d))
+				return GetLastError();
+			decompressors.push_back(d);
+		}
+		if (header.frameCount!=(header.size + header.frameSize - 1) / header.frameSize)
+			return ERROR_BAD_FORMAT;
+		table.resize((size_t)header.frameCount);
+		auto tableBytes = (DWORD)(table.size() * sizeof(ImageFrameEntry));
+		DWORD done;
+		auto hr = ReadAt(job.hsrc, table.data(), tableBytes, header.tableOffset, done);
+		if (hr) return hr;
+		if (done!=tableBytes || Crc32c(0, table.data(), tableBytes)!=header.tableCrc)
+			return ERROR_BAD_FORMAT;
+		return 0;
+	}
+
+	UINT64 FrameStart(const Frame & f) const { return (first + f.index) * header.frameSize; }
+
+	DWORD FrameLength(const Frame & f) const
+	{
+		auto start = FrameStart(f);
+		return header.size - start < header.frameSize ? (DWORD)(header.size - start) : header.frameSize;
+	}
+
+	HRESULT Read(Frame & f)
+	{
+		const auto & e = table[(size_t)(first + f.index)];
+		f.flags = e.kind;
+		f.inLen = e.length;
+		if (e.kind==FrameZero)
+			return 0;
+		if (e.length>header.frameSize)
+			return ERROR_BAD_FORMAT;
+		DWORD done;
+		auto hr = ReadAt(job.hsrc, f.in, e.length, e.offset, done);
+		if (hr) return hr;
+		if (done!=e.length)
+			return ERROR_HANDLE_EOF;
+		return 0;
+	}
+
+	HRESULT Transform(Frame & f, DWORD worker)
+	{
+		const auto & e = table[(size_t)(first + f.index)];
+		f.outLen = FrameLength(f);
+		if (e.kind==FrameZero)
+		{
+			memset(f.out, 0, f.outLen);
+			return 0;
+		}
+		if (e.kind==FrameStored)
+		{
+			if (e.length!=f.outLen)
+				return ERROR_BAD_FORMAT;
+			memcpy(f.out, f.in, f.outLen);
+		}
+		else
+		{
+			SIZE_T outLen;
+			if (!Decompress(decompressors[worker], f.in, e.length, f.out, f.outLen, &outLen))
+				return GetLastError();
+			if (outLen!=f.outLen)
+				return ERROR_INVALID_DATA;
+		}
+		if (Crc32c(0, f.out, f.outLen)!=e.crc)
+			return ERROR_CRC;
+		return 0;
+	}
+
+	HRESULT Write(Frame & f)
+	{
+		// only the part of the frame inside the requested range is written
+		auto frameStart = FrameStart(f);
+		auto start = frameStart > job.srcOffset ? frameStart : job.srcOffset;
+		auto end = frameStart + f.outLen;
+		if (end>job.srcOffset + job.size)
+			end = job.srcOffset + job.size;
+		auto data = f.out + (start - frameStart);
+		auto len = (DWORD)(end - start);
+		auto pos = start - job.srcOffset;
+		if (job.checksum)
+			AddToDigest(stats, pos, data, len);
+		if (f.flags==FrameZero && job.skipZero)
+			stats.skipped += len;
+		else
+		{
+			if (job.hdst!=INVALID_HANDLE_VALUE)
+			{
+				auto hr = WriteAt(job.hdst, data, len, job.dstOffset + pos);
+				if (hr) return hr;
+			}
+			stats.copied += len;
+		}
+		ReportProgress(job, stats, stats.copied + stats.skipped);
+		return 0;
+	}
+};
+
+HRESULT ExpandImage(const CopyJob & job, CopyStats & stats, const ImageHeader & header, DWORD workers)
+{
+	if (job.srcOffset + job.size > header.size)
+		return ERROR_HANDLE_EOF;
+	if (job.checksum)
+		stats.InitCrcs(job.size);
+	if (job.size==0)
+		return 0;
+	Expander e(job, stats, header);
+	auto hr = e.Init(workers);
+	if (hr) return hr;
+	auto last = (job.srcOffset + job.size - 1) / header.frameSize;
+	return RunFrames(e, last - e.first + 1, header.frameSize, header.frameSize, workers, &stats.reads, &stats.writes, job.throttle);
+}
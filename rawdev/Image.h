@@ -0,0 +1,76 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <Windows.h>
+#include "CopyEngine.h"
+
+// A compressed image file: the header, then one frame per blockSize bytes of
+// the source, then a seek table with one ImageFrameEntry per frame.
+// Frames compress independently, so any range can be read back on its own.
+const DWORD imageHeaderSize = 4096;
+const char imageMagic[8] = { 'R', 'A', 'W', 'D', 'E', 'V', 'Z', '1' };
+
+enum ImageFrameKind { FrameCompressed, FrameStored, FrameZero };
+
+struct ImageHeader
+{
+	char magic[8];
+	DWORD version;
+	DWORD algorithm;
+	UINT64 size;
+	DWORD frameSize;
+	DWORD tableCrc;
+	UINT64 frameCount;
+	UINT64 tableOffset;
+};
+
+struct ImageFrameEntry
+{
+	UINT64 offset;
+	DWORD length;
+	DWORD kind;
+	DWORD crc;
+	DWORD reserved;
+};
+
+// ERROR_BAD_FORMAT when h is not a compressed image
+HRESULT ReadImageHeader(HANDLE h, ImageHeader & header);
+
+// Writes job.size bytes of job.hsrc from job.srcOffset as a compressed image to job.hdst
+HRESULT CompressImage(const CopyJob & job, CopyStats & stats, DWORD workers);
+
+// Writes job.size bytes of the image in job.hsrc, starting at image offset
+// job.srcOffset, to job.hdst at job.dstOffset, decompressing only the frames involved
+HRESULT ExpandImage(const CopyJob & job, CopyStats & stats, const ImageHeader & header, DWORD workers);
+
+#endif//IMAGE_H_
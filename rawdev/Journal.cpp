@@ -0,0 +1,251 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Journal.h"
+#include "BufferPool.h"
+#include "Checksum.h"
+#include "CopyEngine.h"
+#include "OsHelpers.h"
+#include <cstdio>
+
+static const char journalMagic[8] = { 'R', 'A', 'W', 'D', 'E', 'V', 'J', '1' };
+static const DWORD journalVersion = 1;
+// how much work a crash may cost at most
+static const UINT64 saveIntervalNs = 10ULL*1000*1000*1000;
+static const DWORD checkBufferSize = 1024*1024;
+
+struct JournalHeader
+{
+	char magic[8];
+	DWORD version;
+	DWORD checkpoint;
+	UINT64 rangeSize;
+	UINT64 rangeCount;
+	JournalIdentity identity;
+	DWORD rangesCrc;
+	DWORD headerCrc;
+};
+
+Journal::Journal()
+{
+	name = nullptr;
+	hdst = INVALID_HANDLE_VALUE;
+	memset(&identity, 0, sizeof(identity));
+	checkpoint = 0;
+	dirty = false;
+	lastSave = 0;
+	InitializeSRWLock(&lock);
+}
+
+static UINT64 RangeLength(const JournalIdentity & id, size_t i)
+{
+	auto pos = i * digestRangeSize;
+	return id.size - pos < digestRangeSize ? id.size - pos : digestRangeSize;
+}
+
+static HRESULT LoadJournal(LPCWSTR name, JournalHeader & header, vector<JournalRange> & ranges)
+{
+	auto h = CreateFile(name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (h==INVALID_HANDLE_VALUE)
+		return GetLastError();
+	auto hr = ReadAll(h, &header, sizeof(header), 0);
+	if (!hr && (memcmp(header.magic, journalMagic, sizeof(journalMagic))!=0 || header.version!=journalVersion))
+		hr = ERROR_BAD_FORMAT;
+	if (!hr && Crc32c(0, &header, offsetof(JournalHeader, headerCrc))!=header.headerCrc)
+		hr = ERROR_CRC;
+	if (!hr && (header.rangeSize!=digestRangeSize || header.rangeCount!=ranges.size()))
+		hr = ERROR_BAD_FORMAT;
+	if (!hr)
+		hr = ReadAll(h, ranges.data(), ranges.size() * sizeof(JournalRange), sizeof(header));
+	if (!hr && Crc32c(0, ranges.data(), ranges.size() * sizeof(JournalRange))!=header.rangesCrc)
+		hr = ERROR_CRC;
+	CloseHandle(h);
+	return hr;
+}
+
+HRESULT Journal::Open(LPCWSTR n, const JournalIdentity & id, HANDLE h, bool resume)
+{
+	name = n;
+	hdst = h;
+	identity = id;
+	auto count = (size_t)((id.size + digestRangeSize - 1) / digestRangeSize);
+	JournalRange none = { 0, 0 };
+	ranges.assign(count, none);
+	written.assign(count, 0);
+	resumed.assign(count, false);
+	if (!resume)
+	{
+		// record the identity before the first byte is copied
+		dirty = true;
+		return Save();
+	}
+	JournalHeader header;
+	auto hr = LoadJournal(name, header, ranges);
+	if (hr) return hr;
+	if (memcmp(&header.identity, &identity, sizeof(identity))!=0)
+	{
+		wprintf(L"Journal %s is for a different copy\n", name);
+		return ERROR_INVALID_DATA;
+	}
+	checkpoint = header.checkpoint;
+	for (size_t i=0; i<count; i++)
+		resumed[i] = ranges[i].checkpoint!=0;
+	return 0;
+}
+
+HRESULT Journal::CheckLast(DWORD sectorSize)
+{
+	auto buf = AllocIoBuffer(SpanSize(checkBufferSize, sectorSize));
+	if (!buf)
+		return GetLastError();
+	for (size_t i=0; i<ranges.size(); i++)
+	{
+		if (checkpoint==0 || ranges[i].checkpoint!=checkpoint)
+			continue;
+		auto pos = i * digestRangeSize;
+		auto end = pos + RangeLength(identity, i);
+		DWORD crc = 0;
+		auto ok = true;
+		while (ok && pos<end)
+		{
+			auto len = end - pos < checkBufferSize ? (DWORD)(end - pos) : checkBufferSize;
+			// whole sectors, as an unbuffered destination needs
+			DWORD done;
+			ok = !ReadSpan(hdst, buf, len, identity.dstOffset + pos, sectorSize, done) && done>=len;
+			if (ok)
+				crc = Crc32c(crc, buf, len);
+			pos += len;
+		}
+		if (ok && crc==ranges[i].crc)
+			continue;
+		wprintf(L"Range at offset %I64u did not read back as journaled, copying it again\n", identity.dstOffset + i * digestRangeSize);
+		ranges[i].checkpoint = 0;
+		resumed[i] = false;
+		dirty = true;
+	}
+	FreeIoBuffer(buf);
+	return 0;
+}
+
+bool Journal::IsResumed(UINT64 pos) const
+{
+	return resumed[(size_t)(pos / digestRangeSize)];
+}
+
+UINT64 Journal::ResumedBytes() const
+{
+	UINT64 bytes = 0;
+	for (size_t i=0; i<resumed.size(); i++)
+		if (resumed[i])
+			bytes += RangeLength(identity, i);
+	return bytes;
+}
+
+void Journal::Apply(CopyStats & stats) const
+{
+	for (size_t i=0; i<resumed.size(); i++)
+		if (resumed[i])
+			stats.crcs[i] = ranges[i].crc;
+	stats.resumed = ResumedBytes();
+}
+
+HRESULT Journal::Completed(const CopyStats & stats, UINT64 pos, UINT64 len)
+{
+	AcquireSRWLockExclusive(&lock);
+	while (len>0)
+	{
+		auto i = (size_t)(pos / digestRangeSize);
+		auto room = digestRangeSize - pos % digestRangeSize;
+		auto n = len < room ? len : room;
+		written[i] += n;
+		// the range's checksum is complete once its last block is
+		if (written[i]==RangeLength(identity, i))
+		{
+			ranges[i].checkpoint = checkpoint + 1;
+			ranges[i].crc = stats.crcs[i];
+			dirty = true;
+		}
+		pos += n;
+		len -= n;
+	}
+	HRESULT hr = 0;
+	if (dirty && TicksToNs(Now() - lastSave)>=saveIntervalNs)
+		hr = Save();
+	ReleaseSRWLockExclusive(&lock);
+	return hr;
+}
+
+HRESULT Journal::Save()
+{
+	if (!dirty)
+		return 0;
+	WCHAR temp[MAX_PATH+8];
+	if (lstrlen(name)>=MAX_PATH)
+		return ERROR_FILENAME_EXCED_RANGE;
+	lstrcpyn(temp, name, MAX_PATH);
+	lstrcat(temp, L".tmp");
+	// everything the journal is about to claim must be on the destination first
+	if (!FlushFileBuffers(hdst))
+		return GetLastError();
+	JournalHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, journalMagic, sizeof(journalMagic));
+	header.version = journalVersion;
+	header.checkpoint = checkpoint + 1;
+	header.rangeSize = digestRangeSize;
+	header.rangeCount = ranges.size();
+	header.identity = identity;
+	header.rangesCrc = Crc32c(0, ranges.data(), ranges.size() * sizeof(JournalRange));
+	header.headerCrc = Crc32c(0, &header, offsetof(JournalHeader, headerCrc));
+	auto h = CreateFile(temp, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_WRITE_THROUGH, nullptr);
+	if (h==INVALID_HANDLE_VALUE)
+		return GetLastError();
+	auto hr = WriteAll(h, &header, sizeof(header), 0);
+	if (!hr)
+		hr = WriteAll(h, ranges.data(), ranges.size() * sizeof(JournalRange), sizeof(header));
+	if (!hr && !FlushFileBuffers(h))
+		hr = GetLastError();
+	CloseHandle(h);
+	// the rename is atomic, so a crash leaves either the old journal or the new one
+	if (!hr && !MoveFileEx(temp, name, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		hr = GetLastError();
+	if (hr) return hr;
+	checkpoint++;
+	dirty = false;
+	lastSave = Now();
+	return 0;
+}
+
+HRESULT Journal::Remove()
+{
+	if (!DeleteFile(name) && GetLastError()!=ERROR_FILE_NOT_FOUND)
+		return GetLastError();
+	return 0;
+}
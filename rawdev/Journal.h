@@ -0,0 +1,97 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <Windows.h>
+#include <vector>
+
+using namespace std;
+
+struct CopyStats;
+
+// What a journal belongs to; a journal only resumes the copy it was made for
+struct JournalIdentity
+{
+	WCHAR source[MAX_PATH];
+	WCHAR dest[MAX_PATH];
+	UINT64 sourceSize;
+	FILETIME sourceTime;
+	UINT64 srcOffset;
+	UINT64 dstOffset;
+	UINT64 size;
+};
+
+// One digest range of the copy. checkpoint is the number of the save that
+// first recorded it as written, 0 while it is not.
+struct JournalRange
+{
+	DWORD checkpoint;
+	DWORD crc;
+};
+
+// The digest ranges of a copy known to be on the destination, saved every
+// few seconds so an interrupted copy can continue where it stopped. Ranges
+// are recorded when their last byte is written, in whatever order that
+// happens, and a save flushes the destination before it replaces the
+// journal file, so the journal never claims more than the destination holds.
+struct Journal
+{
+	LPCWSTR name;
+	HANDLE hdst;
+	JournalIdentity identity;
+	vector<JournalRange> ranges;
+	// ranges written by an earlier run, fixed while copying
+	vector<bool> resumed;
+	// bytes of each range written by this run
+	vector<UINT64> written;
+	DWORD checkpoint;
+	bool dirty;
+	UINT64 lastSave;
+	SRWLOCK lock;
+
+	Journal();
+	// Starts a new journal, or with resume continues the one in name
+	HRESULT Open(LPCWSTR name, const JournalIdentity & id, HANDLE hdst, bool resume);
+	// Reads back the ranges of the last save and forgets those that differ.
+	// sectorSize is what an unbuffered destination is read in, 0 if buffered.
+	HRESULT CheckLast(DWORD sectorSize);
+	bool IsResumed(UINT64 pos) const;
+	UINT64 ResumedBytes() const;
+	// Puts the checksums and size of resumed ranges into stats, after stats.InitCrcs
+	void Apply(CopyStats & stats) const;
+	// Called once for every written or skipped block, from any thread
+	HRESULT Completed(const CopyStats & stats, UINT64 pos, UINT64 len);
+	HRESULT Save();
+	HRESULT Remove();
+};
+
+#endif//JOURNAL_H_
@@ -0,0 +1,432 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Manifest.h"
+#include "FramePipeline.h"
+#include "BufferPool.h"
+#include "OsHelpers.h"
+#include "Simd.h"
+
+static const char manifestMagic[8] = { 'R', 'A', 'W', 'D', 'E', 'V', 'M', '1' };
+static const char deltaMagic[8] = { 'R', 'A', 'W', 'D', 'E', 'V', 'D', '1' };
+static const DWORD manifestVersion = 1;
+// 2 added the identities of the parent and result images
+static const DWORD deltaVersion = 2;
+
+struct ManifestHeader
+{
+	char magic[8];
+	DWORD version;
+	DWORD blockSize;
+	UINT64 size;
+	UINT64 blockCount;
+	DWORD hashCrc;
+	DWORD generation;
+};
+
+struct DeltaHeader
+{
+	char magic[8];
+	DWORD version;
+	DWORD blockSize;
+	UINT64 size;
+	UINT64 blockCount;
+	UINT64 tableOffset;
+	DWORD tableCrc;
+	// the generation of the image this delta makes, one more than its parent's
+	DWORD generation;
+	UINT64 parentSize;
+	DWORD parentIdentity;
+	DWORD identity;
+};
+
+static UINT64 BlockCount(UINT64 size, DWORD blockSize)
+{
+	return (size + blockSize - 1) / blockSize;
+}
+
+static DWORD BlockLength(UINT64 size, DWORD blockSize, UINT64 block)
+{
+	auto pos = block * blockSize;
+	return size - pos < blockSize ? (DWORD)(size - pos) : blockSize;
+}
+
+HRESULT Manifest::Load(LPCWSTR name)
+{
+	auto h = CreateFile(name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (h==INVALID_HANDLE_VALUE)
+		return GetLastError();
+	ManifestHeader header;
+	auto hr = ReadAll(h, &header, sizeof(header), 0);
+	if (!hr && (memcmp(header.magic, manifestMagic, sizeof(manifestMagic))!=0 || header.version!=manifestVersion))
+		hr = ERROR_BAD_FORMAT;
+	if (!hr && (header.blockSize==0 || header.blockCount!=BlockCount(header.size, header.blockSize)))
+		hr = ERROR_BAD_FORMAT;
+	if (!hr)
+	{
+		blockSize = header.blockSize;
+		size = header.size;
+		generation = header.generation;
+		hashes.resize((size_t)header.blockCount);
+		hr = ReadAll(h, hashes.data(), hashes.size() * sizeof(BlockHash), sizeof(header));
+	}
+	if (!hr && Crc32c(0, hashes.data(), hashes.size() * sizeof(BlockHash))!=header.hashCrc)
+		hr = ERROR_CRC;
+	CloseHandle(h);
+	return hr;
+}
+
+HRESULT Manifest::Save(LPCWSTR name) const
+{
+	auto h = CreateFile(name, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (h==INVALID_HANDLE_VALUE)
+		return GetLastError();
+	ManifestHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, manifestMagic, sizeof(manifestMagic));
+	header.version = manifestVersion;
+	header.blockSize = blockSize;
+	header.size = size;
+	header.blockCount = hashes.size();
+	header.hashCrc = Crc32c(0, hashes.data(), hashes.size() * sizeof(BlockHash));
+	header.generation = generation;
+	auto hr = WriteAll(h, &header, sizeof(header), 0);
+	if (!hr)
+		hr = WriteAll(h, hashes.data(), hashes.size() * sizeof(BlockHash), sizeof(header));
+	CloseHandle(h);
+	return hr;
+}
+
+DWORD Manifest::Identity() const
+{
+	auto crc = Crc32c(0, &size, sizeof(size));
+	crc = Crc32c(crc, &blockSize, sizeof(blockSize));
+	return Crc32c(crc, hashes.data(), hashes.size() * sizeof(BlockHash));
+}
+
+static DWORD AlignUp(DWORD len, DWORD alignment)
+{
+	return alignment ? (len + alignment - 1) / alignment * alignment : len;
+}
+
+// Reads block f.index of the job's source. Unbuffered sources are read in
+// whole sectors; the block is zero padded to 4096 bytes for padded writes.
+static HRESULT ReadSourceBlock(const CopyJob & job, Frame & f)
+{
+	f.inLen = BlockLength(job.size, job.blockSize, f.index);
+	DWORD done;
+	auto hr = ReadSpan(job.hsrc, f.in, f.inLen, job.srcOffset + f.index * job.blockSize, job.srcSector, done);
+	if (hr) return hr;
+	if (done<f.inLen)
+		return ERROR_HANDLE_EOF;
+	memset(f.in + f.inLen, 0, AlignUp(f.inLen, 4096) - f.inLen);
+	return 0;
+}
+
+// Writes block f.index to the job's destination, padded to job.alignment
+static HRESULT WriteDestBlock(const CopyJob & job, CopyStats & stats, Frame & f)
+{
+	if (f.flags)
+	{
+		stats.skipped += f.inLen;
+		return 0;
+	}
+	auto hr = WriteAt(job.hdst, f.in, AlignUp(f.inLen, job.alignment), job.dstOffset + f.index * job.blockSize);
+	if (hr) return hr;
+	stats.copied += f.inLen;
+	return 0;
+}
+
+// Checksum and zero detection shared by both transforms
+static void Inspect(const CopyJob & job, Frame & f)
+{
+	f.crc = job.checksum ? Crc32c(0, f.in, f.inLen) : 0;
+	f.flags = job.skipZero && IsZero(f.in, f.inLen) ? 1 : 0;
+}
+
+struct BlockHasher : FrameWork
+{
+	const CopyJob & job;
+	CopyStats & stats;
+	Manifest & manifest;
+	const Manifest * base;
+	vector<UINT64> changed;
+
+	BlockHasher(const CopyJob & j, CopyStats & st, Manifest & m, const Manifest * b) : job(j), stats(st), manifest(m), base(b)
+	{
+	}
+
+	HRESULT Read(Frame & f)
+	{
+		return ReadSourceBlock(job, f);
+	}
+
+	HRESULT Transform(Frame & f, DWORD)
+	{
+		Inspect(job, f);
+		return Sha256(f.in, f.inLen, f.out);
+	}
+
+	bool IsUnchanged(const Frame & f) const
+	{
+		return f.index<base->hashes.size() && memcmp(base->hashes[(size_t)f.index].bytes, f.out, sha256Size)==0;
+	}
+
+	HRESULT Write(Frame & f)
+	{
+		memcpy(manifest.hashes[(size_t)f.index].bytes, f.out, sha256Size);
+		if (job.checksum)
+			AddCrcToDigest(stats, f.index * job.blockSize, f.crc, f.inLen);
+		HRESULT hr = 0;
+		if (!base)
+			hr = WriteDestBlock(job, stats, f);
+		else if (IsUnchanged(f))
+			stats.unchanged += f.inLen;
+		else
+		{
+			// the padding of a short last block is zeroed by ReadSourceBlock and cut off by FinishDelta
+			hr = WriteAt(job.hdst, f.in, AlignUp(f.inLen, job.alignment), deltaHeaderSize + changed.size() * job.blockSize);
+			changed.push_back(f.index);
+			stats.copied += f.inLen;
+		}
+		ReportProgress(job, stats, stats.copied + stats.skipped + stats.unchanged);
+		return hr;
+	}
+
+	// An unbuffered destination takes only whole sectors from aligned memory,
+	// so the table and header go through an I/O buffer and the file is cut to
+	// its real size afterwards
+	HRESULT FinishDelta()
+	{
+		auto tableOffset = deltaHeaderSize + changed.size() * job.blockSize;
+		auto tableBytes = (DWORD)(changed.size() * sizeof(UINT64));
+		auto tableIoLen = AlignUp(tableBytes, job.alignment);
+		auto buf = AllocIoBuffer(tableIoLen>deltaHeaderSize ? tableIoLen : deltaHeaderSize);
+		if (!buf)
+			return GetLastError();
+		memset(buf, 0, tableIoLen);
+		memcpy(buf, changed.data(), tableBytes);
+		auto hr = tableIoLen ? WriteAll(job.hdst, buf, tableIoLen, tableOffset) : 0;
+		if (!hr)
+		{
+			memset(buf, 0, deltaHeaderSize);
+			auto & header = *(DeltaHeader *) buf;
+			memcpy(header.magic, deltaMagic, sizeof(deltaMagic));
+			header.version = deltaVersion;
+			header.blockSize = job.blockSize;
+			header.size = job.size;
+			header.blockCount = changed.size();
+			header.tableOffset = tableOffset;
+			header.tableCrc = Crc32c(0, changed.data(), tableBytes);
+			header.generation = manifest.generation;
+			header.parentSize = base->size;
+			header.parentIdentity = base->Identity();
+			header.identity = manifest.Identity();
+			hr = WriteAt(job.hdst, buf, deltaHeaderSize, 0);
+		}
+		FreeIoBuffer(buf);
+		if (hr) return hr;
+		if (!SetFileSize(job.hdst, tableOffset + tableBytes))
+			return GetLastError();
+		wprintf(L"Delta holds %I64u changed blocks of %I64u, generation %u\n", (UINT64)changed.size(), (UINT64)manifest.hashes.size(), manifest.generation);
+		return 0;
+	}
+};
+
+HRESULT HashedCopy(const CopyJob & job, CopyStats & stats, DWORD workers, Manifest & manifest, const Manifest * base)
+{
+	if (digestRangeSize%job.blockSize!=0)
+		return ERROR_INVALID_PARAMETER;
+	if (base && (base->blockSize!=job.blockSize || job.dstOffset!=0))
+		return ERROR_INVALID_PARAMETER;
+	if (job.checksum)
+		stats.InitCrcs(job.size);
+	manifest.blockSize = job.blockSize;
+	manifest.size = job.size;
+	manifest.generation = base ? base->generation + 1 : 0;
+	manifest.hashes.resize((size_t)BlockCount(job.size, job.blockSize));
+	BlockHasher hasher(job, stats, manifest, base);
+	auto hr = RunFrames(hasher, manifest.hashes.size(), SpanSize(job.blockSize, job.srcSector), sha256Size, workers, &stats.reads, &stats.writes, job.throttle);
+	if (hr) return hr;
+	return base ? hasher.FinishDelta() : 0;
+}
+
+struct DeltaFile
+{
+	HANDLE h;
+	DeltaHeader header;
+	vector<UINT64> blocks;
+	DeltaFile()
+	{
+		h = INVALID_HANDLE_VALUE;
+	}
+	~DeltaFile()
+	{
+		if (h!=INVALID_HANDLE_VALUE) CloseHandle(h);
+	}
+	HRESULT Open(LPCWSTR name)
+	{
+		h = CreateFile(name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (h==INVALID_HANDLE_VALUE)
+			return GetLastError();
+		auto hr = ReadAll(h, &header, sizeof(header), 0);
+		if (hr) return hr;
+		if (memcmp(header.magic, deltaMagic, sizeof(deltaMagic))!=0 || header.version!=deltaVersion || header.blockSize==0)
+			return ERROR_BAD_FORMAT;
+		blocks.resize((size_t)header.blockCount);
+		hr = ReadAll(h, blocks.data(), blocks.size() * sizeof(UINT64), header.tableOffset);
+		if (hr) return hr;
+		if (Crc32c(0, blocks.data(), blocks.size() * sizeof(UINT64))!=header.tableCrc)
+			return ERROR_CRC;
+		return 0;
+	}
+};
+
+// Where the newest copy of a block lives: 0 for the source, otherwise delta-1 at slot
+struct BlockRef
+{
+	DWORD delta;
+	UINT64 slot;
+};
+
+struct DeltaApplier : FrameWork
+{
+	const CopyJob & job;
+	CopyStats & stats;
+	vector<DeltaFile> & deltas;
+	const Manifest * base;
+	vector<BlockRef> refs;
+
+	DeltaApplier(const CopyJob & j, CopyStats & st, vector<DeltaFile> & d, const Manifest * b) : job(j), stats(st), deltas(d), base(b)
+	{
+	}
+
+	HRESULT Init()
+	{
+		BlockRef none = { 0, 0 };
+		refs.assign((size_t)BlockCount(job.size, job.blockSize), none);
+		for (size_t d=0; d<deltas.size(); d++)
+		{
+			const auto & blocks = deltas[d].blocks;
+			for (size_t slot=0; slot<blocks.size(); slot++)
+			{
+				if (blocks[slot]>=refs.size())
+					return ERROR_BAD_FORMAT;
+				refs[(size_t)blocks[slot]].delta = (DWORD)d + 1;
+				refs[(size_t)blocks[slot]].slot = slot;
+			}
+		}
+		return 0;
+	}
+
+	HRESULT Read(Frame & f)
+	{
+		const auto & ref = refs[(size_t)f.index];
+		if (ref.delta==0)
+			return ReadSourceBlock(job, f);
+		f.inLen = BlockLength(job.size, job.blockSize, f.index);
+		const auto & delta = deltas[ref.delta - 1];
+		DWORD done;
+		auto hr = ReadAt(delta.h, f.in, f.inLen, deltaHeaderSize + ref.slot * job.blockSize, done);
+		if (hr) return hr;
+		if (done!=f.inLen)
+			return ERROR_HANDLE_EOF;
+		// padded to whole sectors for an unbuffered destination
+		memset(f.in + f.inLen, 0, AlignUp(f.inLen, 4096) - f.inLen);
+		return 0;
+	}
+
+	HRESULT Transform(Frame & f, DWORD)
+	{
+		Inspect(job, f);
+		if (base && refs[(size_t)f.index].delta==0)
+			return Sha256(f.in, f.inLen, f.out);
+		return 0;
+	}
+
+	HRESULT Write(Frame & f)
+	{
+		// a source block no delta replaces must be the one the chain was made against
+		if (base && refs[(size_t)f.index].delta==0 && memcmp(base->hashes[(size_t)f.index].bytes, f.out, sha256Size)!=0)
+		{
+			wprintf(L"Source block at offset %I64u does not match the base manifest\n", f.index * job.blockSize);
+			return ERROR_CRC;
+		}
+		if (job.checksum)
+			AddCrcToDigest(stats, f.index * job.blockSize, f.crc, f.inLen);
+		auto hr = WriteDestBlock(job, stats, f);
+		ReportProgress(job, stats, stats.copied + stats.skipped);
+		return hr;
+	}
+};
+
+HRESULT ApplyDeltas(CopyJob & job, CopyStats & stats, DWORD workers, LPWSTR names[], DWORD count, const Manifest * base)
+{
+	vector<DeltaFile> deltas(count);
+	for (DWORD i=0; i<count; i++)
+	{
+		auto hr = deltas[i].Open(names[i]);
+		if (hr) return hr;
+		if (deltas[i].header.blockSize!=deltas[0].header.blockSize)
+			return ERROR_INVALID_PARAMETER;
+		if (i==0)
+			continue;
+		// each delta must have been made against the image the one before it makes
+		const auto & prev = deltas[i-1].header;
+		const auto & header = deltas[i].header;
+		if (header.generation!=prev.generation + 1 || header.parentIdentity!=prev.identity || header.parentSize!=prev.size)
+		{
+			wprintf(L"%s does not follow %s, give the deltas oldest first without gaps\n", names[i], names[i-1]);
+			return ERROR_INVALID_PARAMETER;
+		}
+	}
+	const auto & first = deltas[0].header;
+	// job.size is still the size of the source
+	if (first.parentSize!=job.size)
+	{
+		wprintf(L"%s was made against a %I64u byte image, the source has %I64u bytes\n", names[0], first.parentSize, job.size);
+		return ERROR_INVALID_PARAMETER;
+	}
+	if (base && (base->Identity()!=first.parentIdentity || base->generation + 1!=first.generation || base->blockSize!=first.blockSize))
+	{
+		wprintf(L"%s was not made against the base manifest\n", names[0]);
+		return ERROR_INVALID_PARAMETER;
+	}
+	job.blockSize = first.blockSize;
+	job.size = deltas[count-1].header.size;
+	if (digestRangeSize%job.blockSize!=0)
+		return ERROR_INVALID_PARAMETER;
+	if (job.checksum)
+		stats.InitCrcs(job.size);
+	DeltaApplier applier(job, stats, deltas, base);
+	auto hr = applier.Init();
+	if (hr) return hr;
+	return RunFrames(applier, applier.refs.size(), SpanSize(job.blockSize, job.srcSector), base ? sha256Size : 0, workers, &stats.reads, &stats.writes, job.throttle);
+}
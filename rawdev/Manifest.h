@@ -0,0 +1,80 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MANIFEST_H_
+#define MANIFEST_H_
+
+#include <Windows.h>
+#include <vector>
+#include "Checksum.h"
+#include "CopyEngine.h"
+
+using namespace std;
+
+// The SHA-256 of every blockSize bytes of a copied range, stored next to an
+// image so the next backup can tell which blocks changed.
+// generation counts the deltas since the full copy the chain starts from.
+struct Manifest
+{
+	DWORD blockSize;
+	UINT64 size;
+	DWORD generation;
+	vector<BlockHash> hashes;
+	Manifest()
+	{
+		blockSize = 0;
+		size = 0;
+		generation = 0;
+	}
+	HRESULT Load(LPCWSTR name);
+	HRESULT Save(LPCWSTR name) const;
+	// Names the image this manifest describes, for chaining deltas
+	DWORD Identity() const;
+};
+
+// A delta file: the header, then every changed block in block order, then a
+// table with the block number of each. The header records the identity of
+// the image the delta applies to and of the one it makes, so a chain of
+// deltas can be checked for order and for the image it starts from.
+const DWORD deltaHeaderSize = 4096;
+
+// Copies like RunCopy while hashing every block on worker threads into
+// manifest. With a base manifest the destination becomes a delta file that
+// holds only the blocks whose hash differs from the base.
+HRESULT HashedCopy(const CopyJob & job, CopyStats & stats, DWORD workers, Manifest & manifest, const Manifest * base);
+
+// Copies the source with the blocks of each delta, oldest first, laid over
+// it in a single pass. job.size is set to the size recorded in the deltas.
+// Each delta must follow the one before it. With base, the manifest of the
+// source, the first delta must have been made against it, and every source
+// block that is copied is checked against its hash.
+HRESULT ApplyDeltas(CopyJob & job, CopyStats & stats, DWORD workers, LPWSTR deltas[], DWORD deltaCount, const Manifest * base);
+
+#endif//MANIFEST_H_
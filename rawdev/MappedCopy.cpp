@@ -0,0 +1,254 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "MappedCopy.h"
+#include <algorithm>
+#include "OsHelpers.h"
+
+// FSCTL_DUPLICATE_EXTENTS_TO_FILE takes less than 4 GB at a time
+static const UINT64 cloneChunk = 1024*1024*1024;
+
+// One view of a file mapping, covering at least [pos, pos + len)
+struct MappedWindow
+{
+	HANDLE mapping;
+	DWORD access;
+	byte * base;
+	UINT64 viewStart;
+	UINT64 pos;
+	DWORD len;
+	MappedWindow(HANDLE m, DWORD a) : mapping(m), access(a), base(nullptr), viewStart(0), pos(0), len(0) {}
+	~MappedWindow()
+	{
+		Unmap();
+	}
+	void Unmap()
+	{
+		if (base) UnmapViewOfFile(base);
+		base = nullptr;
+		len = 0;
+	}
+	HRESULT Map(UINT64 p, DWORD l, DWORD granularity)
+	{
+		Unmap();
+		pos = p;
+		viewStart = p / granularity * granularity;
+		auto viewLen = (SIZE_T) (p + l - viewStart);
+		base = (byte *) MapViewOfFile(mapping, access, (DWORD) (viewStart >> 32), (DWORD) viewStart, viewLen);
+		if (!base)
+			return GetLastError();
+		len = l;
+		return 0;
+	}
+	byte * Data() const
+	{
+		return base + (pos - viewStart);
+	}
+	// asks the memory manager to read the whole window in ahead of use
+	void Prefetch() const
+	{
+		WIN32_MEMORY_RANGE_ENTRY range;
+		range.VirtualAddress = base;
+		range.NumberOfBytes = (SIZE_T) (pos + len - viewStart);
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+	}
+	void Swap(MappedWindow & other)
+	{
+		swap(base, other.base);
+		swap(viewStart, other.viewStart);
+		swap(pos, other.pos);
+		swap(len, other.len);
+	}
+};
+
+static DWORD AllocationGranularity()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwAllocationGranularity;
+}
+
+// Clones the source extents into the destination. ERROR_NOT_SUPPORTED, with
+// nothing done, when the volume cannot clone these ranges.
+static HRESULT CloneExtents(const CopyJob & job, CopyStats & stats)
+{
+	if (!SetFileSize(job.hdst, job.dstOffset + job.size))
+		return GetLastError();
+	for (UINT64 done=0; done<job.size; )
+	{
+		auto n = job.size - done < cloneChunk ? job.size - done : cloneChunk;
+		DUPLICATE_EXTENTS_DATA data;
+		data.FileHandle = job.hsrc;
+		data.SourceFileOffset.QuadPart = job.srcOffset + done;
+		data.TargetFileOffset.QuadPart = job.dstOffset + done;
+		data.ByteCount.QuadPart = n;
+		if (!Control(job.hdst, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &data, sizeof(data), nullptr, 0))
+			return done==0 ? ERROR_NOT_SUPPORTED : GetLastError();
+		done += n;
+		stats.copied += n;
+		ReportProgress(job, stats, done);
+	}
+	return 0;
+}
+
+// The other end of the copy moves straight in and out of the views, so an
+// unbuffered device needs them sector aligned
+static bool Aligned(HANDLE other, bool otherIsFile, UINT64 mappedOffset)
+{
+	if (otherIsFile)
+		return true;
+	auto sectorSize = GetSectorSize(other);
+	return mappedOffset % (sectorSize ? sectorSize : 4096)==0;
+}
+
+// Only one end is mapped, the other is read or written straight from the view
+static HRESULT Transfer(const CopyJob & job, CopyStats & stats, HANDLE srcMapping, HANDLE dstMapping)
+{
+	auto granularity = AllocationGranularity();
+	MappedWindow src(srcMapping, FILE_MAP_READ);
+	MappedWindow next(srcMapping, FILE_MAP_READ);
+	MappedWindow dst(dstMapping, FILE_MAP_WRITE);
+	HRESULT hr;
+	for (UINT64 done=0; done<job.size; )
+	{
+		auto window = job.size - done < mapWindowSize ? (DWORD) (job.size - done) : mapWindowSize;
+		if (srcMapping)
+		{
+			if (next.base && next.pos==job.srcOffset + done)
+				src.Swap(next);
+			else
+			{
+				hr = src.Map(job.srcOffset + done, window, granularity);
+				if (hr) return hr;
+				src.Prefetch();
+			}
+			auto after = done + window;
+			next.Unmap();
+			if (after<job.size)
+			{
+				hr = next.Map(job.srcOffset + after, job.size - after < mapWindowSize ? (DWORD) (job.size - after) : mapWindowSize, granularity);
+				if (hr) return hr;
+				next.Prefetch();
+			}
+		}
+		if (dstMapping)
+		{
+			hr = dst.Map(job.dstOffset + done, window, granularity);
+			if (hr) return hr;
+		}
+		for (DWORD off=0; off<window; )
+		{
+			auto n = window - off < job.blockSize ? window - off : job.blockSize;
+			auto pos = done + off;
+			if (job.throttle)
+				job.throttle->Take(n);
+			auto t = Now();
+			if (!dstMapping)
+			{
+				hr = WriteAt(job.hdst, src.Data() + off, n, job.dstOffset + pos);
+				if (hr) return hr;
+				auto ns = TicksToNs(Now() - t);
+				stats.writes.latency.Add(ns);
+				stats.writes.stallNs += ns;
+			}
+			else
+			{
+				DWORD read;
+				hr = ReadAt(job.hsrc, dst.Data() + off, n, job.srcOffset + pos, read);
+				if (hr) return hr;
+				if (read!=n)
+					return ERROR_HANDLE_EOF;
+				auto ns = TicksToNs(Now() - t);
+				stats.reads.latency.Add(ns);
+				stats.reads.stallNs += ns;
+			}
+			if (job.checksum)
+				AddToDigest(stats, pos, dstMapping ? dst.Data() + off : src.Data() + off, n);
+			off += n;
+			stats.copied += n;
+			ReportProgress(job, stats, pos + n);
+		}
+		if (dstMapping && !FlushViewOfFile(dst.base, 0))
+			return GetLastError();
+		done += window;
+	}
+	return 0;
+}
+
+HRESULT MappedCopy(const CopyJob & job, CopyStats & stats, bool srcIsFile, bool dstIsFile)
+{
+	if (job.blockSize==0 || (!srcIsFile && !dstIsFile))
+		return ERROR_INVALID_PARAMETER;
+	if (job.checksum)
+		stats.InitCrcs(job.size);
+	if (job.size==0)
+		return 0;
+	if (srcIsFile && dstIsFile && !job.checksum && !job.throttle)
+	{
+		auto hr = CloneExtents(job, stats);
+		if (hr!=ERROR_NOT_SUPPORTED)
+			return hr;
+		wprintf(L"Destination volume cannot clone these ranges, copying through the mapping\n");
+	}
+	// a file to file copy maps only the source and writes through the cache
+	auto mapDest = dstIsFile && !srcIsFile;
+	if (srcIsFile && !Aligned(job.hdst, dstIsFile, job.srcOffset) || mapDest && !Aligned(job.hsrc, srcIsFile, job.dstOffset))
+		return ERROR_INVALID_PARAMETER;
+	HANDLE srcMapping = nullptr;
+	HANDLE dstMapping = nullptr;
+	if (srcIsFile)
+	{
+		srcMapping = CreateFileMapping(job.hsrc, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!srcMapping)
+			return GetLastError();
+	}
+	HRESULT hr = 0;
+	if (mapDest)
+	{
+		// a view can only cover what the file already holds
+		UINT64 end = job.dstOffset + job.size;
+		if (!SetFileSize(job.hdst, end))
+			hr = GetLastError();
+		else
+		{
+			dstMapping = CreateFileMapping(job.hdst, nullptr, PAGE_READWRITE, (DWORD) (end >> 32), (DWORD) end, nullptr);
+			if (!dstMapping)
+				hr = GetLastError();
+		}
+	}
+	if (!hr)
+		hr = Transfer(job, stats, srcMapping, dstMapping);
+	if (srcMapping) CloseHandle(srcMapping);
+	if (dstMapping) CloseHandle(dstMapping);
+	// flushed views are only in the file cache, make them durable like the other paths do
+	if (!hr && dstIsFile && !FlushFileBuffers(job.hdst))
+		hr = GetLastError();
+	return hr;
+}
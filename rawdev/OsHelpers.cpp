@@ -36,22 +36,147 @@ LPWSTR CopyString(LPWSTR s, size_t len) {
 	return d;
 }
 
-bool DismountVolume(HANDLE h)
+// Issues a device control with an OVERLAPPED so it also works on handles opened with FILE_FLAG_OVERLAPPED.
+// The low bit of the event keeps the completion off any completion port the handle is bound to.
+bool Control(HANDLE h, DWORD code, LPVOID in, DWORD inLen, LPVOID out, DWORD outLen)
 {
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	auto event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	if (!event)
+		return false;
+	ov.hEvent = (HANDLE)((ULONG_PTR)event | 1);
 	DWORD notUsed;
-	return DeviceIoControl(h, FSCTL_DISMOUNT_VOLUME, nullptr, 0, nullptr, 0, &notUsed, nullptr)==TRUE;
+	auto ok = DeviceIoControl(h, code, in, inLen, out, outLen, &notUsed, &ov);
+	if (!ok && GetLastError()==ERROR_IO_PENDING)
+		ok = GetOverlappedResult(h, &ov, &notUsed, TRUE);
+	auto error = GetLastError();
+	CloseHandle(event);
+	SetLastError(error);
+	return ok==TRUE;
+}
+
+static HRESULT Transfer(HANDLE h, bool isRead, void * buf, DWORD len, UINT64 offset, DWORD & done)
+{
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	auto event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+	if (!event)
+		return GetLastError();
+	ov.hEvent = (HANDLE)((ULONG_PTR)event | 1);
+	auto ok = isRead
+		? ReadFile(h, buf, len, nullptr, &ov)
+		: WriteFile(h, buf, len, nullptr, &ov);
+	if (ok || GetLastError()==ERROR_IO_PENDING)
+		ok = GetOverlappedResult(h, &ov, &done, TRUE);
+	HRESULT hr = ok ? 0 : GetLastError();
+	CloseHandle(event);
+	// reading at or past the end of a file is not an error, just nothing read
+	if (hr==ERROR_HANDLE_EOF)
+	{
+		done = 0;
+		hr = 0;
+	}
+	return hr;
+}
+
+HRESULT ReadAt(HANDLE h, void * buf, DWORD len, UINT64 offset, DWORD & done)
+{
+	return Transfer(h, true, buf, len, offset, done);
+}
+
+HRESULT ReadSpan(HANDLE h, byte * buf, DWORD len, UINT64 offset, DWORD unit, DWORD & done)
+{
+	if (unit<=1)
+		return ReadAt(h, buf, len, offset, done);
+	auto start = offset / unit * unit;
+	auto head = (DWORD)(offset - start);
+	auto ioLen = (head + len + unit - 1) / unit * unit;
+	auto hr = ReadAt(h, buf, ioLen, start, done);
+	if (hr) return hr;
+	done = done<=head ? 0 : done - head<len ? done - head : len;
+	if (head)
+		memmove(buf, buf + head, done);
+	return 0;
+}
+
+DWORD SpanSize(DWORD len, DWORD unit)
+{
+	return unit<=1 ? len : len + 2*unit;
+}
+
+HRESULT WriteAt(HANDLE h, const void * buf, DWORD len, UINT64 offset)
+{
+	DWORD done;
+	auto hr = Transfer(h, false, (void *) buf, len, offset, done);
+	if (!hr && done!=len)
+		hr = ERROR_WRITE_FAULT;
+	return hr;
+}
+
+// Whole buffers of any size, in chunks a single ReadFile or WriteFile can take
+static const DWORD ioChunk = 64*1024*1024;
+
+HRESULT WriteAll(HANDLE h, const void * data, UINT64 len, UINT64 offset)
+{
+	auto p = (const byte *) data;
+	while (len>0)
+	{
+		auto n = len < ioChunk ? (DWORD)len : ioChunk;
+		auto hr = WriteAt(h, p, n, offset);
+		if (hr) return hr;
+		p += n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+HRESULT ReadAll(HANDLE h, void * data, UINT64 len, UINT64 offset)
+{
+	auto p = (byte *) data;
+	while (len>0)
+	{
+		auto n = len < ioChunk ? (DWORD)len : ioChunk;
+		DWORD done;
+		auto hr = ReadAt(h, p, n, offset, done);
+		if (hr) return hr;
+		if (done!=n)
+			return ERROR_HANDLE_EOF;
+		p += n;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+HRESULT ReadHeader(HANDLE h, void * header, DWORD len, DWORD & done)
+{
+	// a whole aligned sector, so this also works on unbuffered handles
+	auto buf = VirtualAlloc(nullptr, 4096, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (!buf)
+		return GetLastError();
+	auto hr = ReadAt(h, buf, 4096, 0, done);
+	memcpy(header, buf, len);
+	VirtualFree(buf, 0, MEM_RELEASE);
+	return hr;
+}
+
+bool DismountVolume(HANDLE h)
+{
+	return Control(h, FSCTL_DISMOUNT_VOLUME, nullptr, 0, nullptr, 0);
 }
 
 bool LockVolume(HANDLE h)
 {
-	DWORD notUsed;
-	return DeviceIoControl(h, FSCTL_LOCK_VOLUME, nullptr, 0, nullptr, 0, &notUsed, nullptr)==TRUE;
+	return Control(h, FSCTL_LOCK_VOLUME, nullptr, 0, nullptr, 0);
 }
 
 bool AllowExtendedIo(HANDLE h)
 {
-	DWORD notUsed;
-	return DeviceIoControl(h, FSCTL_ALLOW_EXTENDED_DASD_IO, nullptr, 0, nullptr, 0, &notUsed, nullptr)==TRUE;
+	return Control(h, FSCTL_ALLOW_EXTENDED_DASD_IO, nullptr, 0, nullptr, 0);
 }
 
 bool SetPosition(HANDLE h, UINT64 pos)
@@ -61,11 +186,20 @@ bool SetPosition(HANDLE h, UINT64 pos)
 	return SetFilePointerEx(h, toMove, nullptr, FILE_BEGIN)==TRUE;
 }
 
+bool GetPosition(HANDLE h, UINT64 & pos)
+{
+	LARGE_INTEGER zero, current;
+	zero.QuadPart = 0;
+	if (!SetFilePointerEx(h, zero, &current, FILE_CURRENT))
+		return false;
+	pos = current.QuadPart;
+	return true;
+}
+
 UINT64 GetDriveSize(HANDLE h)
 {
 	GET_LENGTH_INFORMATION info;
-	DWORD notUsed;
-	if (!DeviceIoControl(h, IOCTL_DISK_GET_LENGTH_INFO, nullptr, 0, &info, sizeof(info), &notUsed, nullptr))
+	if (!Control(h, IOCTL_DISK_GET_LENGTH_INFO, nullptr, 0, &info, sizeof(info)))
 		return 0;
 	return info.Length.QuadPart;
 }
@@ -73,8 +207,64 @@ UINT64 GetDriveSize(HANDLE h)
 MEDIA_TYPE GetMediaType(HANDLE h)
 {
 	DISK_GEOMETRY dg;
-	DWORD notUsed;
-	if (!DeviceIoControl(h, IOCTL_DISK_GET_DRIVE_GEOMETRY, nullptr, 0, &dg, sizeof(dg), &notUsed, nullptr))
+	if (!Control(h, IOCTL_DISK_GET_DRIVE_GEOMETRY, nullptr, 0, &dg, sizeof(dg)))
 		return Unknown;
 	return dg.MediaType;
 }
+
+DWORD GetSectorSize(HANDLE h)
+{
+	DISK_GEOMETRY dg;
+	if (!Control(h, IOCTL_DISK_GET_DRIVE_GEOMETRY, nullptr, 0, &dg, sizeof(dg)))
+		return 0;
+	return dg.BytesPerSector;
+}
+
+bool SetFileSize(HANDLE h, UINT64 size)
+{
+	FILE_END_OF_FILE_INFO info;
+	info.EndOfFile.QuadPart = size;
+	return SetFileInformationByHandle(h, FileEndOfFileInfo, &info, sizeof(info))==TRUE;
+}
+
+static const DWORD maxParallel = 16;
+
+struct ParallelWork
+{
+	DWORD count;
+	void (*fn)(DWORD, void *);
+	void * context;
+	volatile LONG next;
+};
+
+static DWORD WINAPI ParallelWorker(LPVOID p)
+{
+	auto w = (ParallelWork *) p;
+	while (true)
+	{
+		auto i = (DWORD)InterlockedIncrement(&w->next) - 1;
+		if (i>=w->count)
+			break;
+		w->fn(i, w->context);
+	}
+	return 0;
+}
+
+void ParallelFor(DWORD count, void (*fn)(DWORD i, void * context), void * context)
+{
+	ParallelWork w = { count, fn, context, 0 };
+	HANDLE threads[maxParallel];
+	DWORD started = 0;
+	// the calling thread works too, so one item needs no thread at all
+	for (; started<maxParallel && started + 1<count; started++)
+	{
+		threads[started] = CreateThread(nullptr, 0, ParallelWorker, &w, 0, nullptr);
+		if (!threads[started])
+			break;
+	}
+	ParallelWorker(&w);
+	if (started)
+		WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+	for (DWORD i=0; i<started; i++)
+		CloseHandle(threads[i]);
+}
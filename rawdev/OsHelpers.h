@@ -36,10 +36,29 @@
 LPWSTR CopyString(LPWSTR s, size_t len);
 
 bool AllowExtendedIo(HANDLE h);
+bool Control(HANDLE h, DWORD code, LPVOID in, DWORD inLen, LPVOID out, DWORD outLen);
 bool DismountVolume(HANDLE h);
 UINT64 GetDriveSize(HANDLE h);
+bool GetPosition(HANDLE h, UINT64 & pos);
 MEDIA_TYPE GetMediaType(HANDLE h);
+// Logical sector size of a disk, volume or partition, 0 for anything else
+DWORD GetSectorSize(HANDLE h);
 bool LockVolume(HANDLE h);
+// Positioned I/O on any handle, overlapped or not. ReadAt reports how much was read, WriteAt fails on a short write.
+HRESULT ReadAt(HANDLE h, void * buf, DWORD len, UINT64 offset, DWORD & done);
+HRESULT WriteAt(HANDLE h, const void * buf, DWORD len, UINT64 offset);
+HRESULT ReadAll(HANDLE h, void * data, UINT64 len, UINT64 offset);
+// Reads len bytes at any offset through the whole units of size unit around
+// them, as an unbuffered handle needs; 0 or 1 reads them directly. buf must
+// hold SpanSize(len, unit) bytes and gets the data at its start.
+HRESULT ReadSpan(HANDLE h, byte * buf, DWORD len, UINT64 offset, DWORD unit, DWORD & done);
+DWORD SpanSize(DWORD len, DWORD unit);
+HRESULT WriteAll(HANDLE h, const void * data, UINT64 len, UINT64 offset);
+// Reads the first len (at most 4096) bytes of a file or device, buffered or not
+HRESULT ReadHeader(HANDLE h, void * header, DWORD len, DWORD & done);
+bool SetFileSize(HANDLE h, UINT64 size);
+// Calls fn(i, context) for every i below count, from up to 16 threads at once
+void ParallelFor(DWORD count, void (*fn)(DWORD i, void * context), void * context);
 bool SetPosition(HANDLE h, UINT64 pos);
 
 #endif//HELPERS_H_
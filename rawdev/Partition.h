@@ -32,7 +32,7 @@
 #define PARTITION_H_
 
 #include <Windows.h>
-#include <list>
+#include <vector>
 #include <memory>
 
 using namespace std;
@@ -58,6 +58,6 @@ struct Partition
 	}
 	HRESULT Open(bool isRead, DWORD desiredAccess, DWORD devFlags, HANDLE & h) const;
 };
-typedef list<shared_ptr<Partition>> PartitionList;
+typedef vector<shared_ptr<Partition>> PartitionList;
 
 #endif//PARTITION_H_
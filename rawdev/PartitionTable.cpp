@@ -0,0 +1,290 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PartitionTable.h"
+#include "OsHelpers.h"
+
+// Image files have no geometry to ask for; a GPT says which of these it uses
+// by where its header is found
+static const DWORD sectorSizes[] = { 512, 4096 };
+
+static const DWORD maxLogicalPartitions = 128;
+// far more than any GPT in use, but bounds what a corrupt header can make us read
+static const UINT64 maxGptEntryBytes = 16*1024*1024;
+
+#pragma pack(push, 1)
+struct MbrEntry
+{
+	byte status;
+	byte firstChs[3];
+	byte type;
+	byte lastChs[3];
+	DWORD firstLba;
+	DWORD sectors;
+};
+
+struct GptHeader
+{
+	char signature[8];
+	DWORD revision;
+	DWORD headerSize;
+	DWORD headerCrc;
+	DWORD reserved;
+	UINT64 myLba;
+	UINT64 alternateLba;
+	UINT64 firstUsableLba;
+	UINT64 lastUsableLba;
+	byte diskGuid[16];
+	UINT64 entriesLba;
+	DWORD entryCount;
+	DWORD entrySize;
+	DWORD entriesCrc;
+};
+
+struct GptEntry
+{
+	byte typeGuid[16];
+	byte uniqueGuid[16];
+	UINT64 firstLba;
+	UINT64 lastLba;
+	UINT64 attributes;
+};
+#pragma pack(pop)
+
+const DWORD mbrEntryOffset = 446;
+const byte mbrTypeProtective = 0xEE;
+
+// The CRC-32 GPT uses, which is the zlib one and not CRC32C
+static DWORD Crc32(const void * data, size_t len)
+{
+	DWORD crc = 0xFFFFFFFF;
+	auto p = (const byte *) data;
+	for (size_t i=0; i<len; i++)
+	{
+		crc ^= p[i];
+		for (int k=0; k<8; k++)
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+	}
+	return ~crc;
+}
+
+// Sector reads into an aligned buffer, so unbuffered handles work too
+struct SectorReader
+{
+	HANDLE h;
+	UINT64 size;
+	byte * buf;
+	DWORD bufSize;
+	SectorReader(HANDLE handle, UINT64 s) : h(handle), size(s), buf(nullptr), bufSize(0) {}
+	~SectorReader()
+	{
+		if (buf) VirtualFree(buf, 0, MEM_RELEASE);
+	}
+	HRESULT Read(UINT64 offset, DWORD len)
+	{
+		if (offset > size || len > size - offset)
+			return ERROR_BAD_FORMAT;
+		if (len > bufSize)
+		{
+			if (buf) VirtualFree(buf, 0, MEM_RELEASE);
+			buf = (byte *) VirtualAlloc(nullptr, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+			bufSize = buf ? len : 0;
+			if (!buf) return GetLastError();
+		}
+		return ReadAll(h, buf, len, offset);
+	}
+};
+
+static bool IsExtended(byte type)
+{
+	return type==0x05 || type==0x0F || type==0x85;
+}
+
+// Whether the sector-sized range [lba, lba+count) lies within the disk
+static bool Fits(UINT64 lba, UINT64 count, DWORD sectorSize, UINT64 size)
+{
+	auto sectors = size / sectorSize;
+	return count!=0 && lba < sectors && count <= sectors - lba;
+}
+
+static HRESULT ReadGptHeader(SectorReader & r, UINT64 lba, DWORD sectorSize, GptHeader & header)
+{
+	auto hr = r.Read(lba * sectorSize, sectorSize);
+	if (hr) return hr;
+	memcpy(&header, r.buf, sizeof(header));
+	if (memcmp(header.signature, "EFI PART", 8)!=0 || header.headerSize < sizeof(header) || header.headerSize > sectorSize)
+		return ERROR_BAD_FORMAT;
+	auto crc = header.headerCrc;
+	((GptHeader *) r.buf)->headerCrc = 0;
+	if (Crc32(r.buf, header.headerSize)!=crc || header.myLba!=lba)
+		return ERROR_BAD_FORMAT;
+	if (header.entrySize < sizeof(GptEntry) || header.entrySize % 8!=0 || header.entryCount==0
+		|| (UINT64) header.entryCount * header.entrySize > maxGptEntryBytes)
+		return ERROR_BAD_FORMAT;
+	return 0;
+}
+
+static HRESULT ReadGptEntries(SectorReader & r, const GptHeader & header, DWORD sectorSize, UINT64 size, PartitionEntries & entries)
+{
+	UINT64 bytes = (UINT64) header.entryCount * header.entrySize;
+	auto sectors = (bytes + sectorSize - 1) / sectorSize;
+	if (!Fits(header.entriesLba, sectors, sectorSize, size))
+		return ERROR_BAD_FORMAT;
+	auto hr = r.Read(header.entriesLba * sectorSize, (DWORD) (sectors * sectorSize));
+	if (hr) return hr;
+	if (Crc32(r.buf, (size_t) bytes)!=header.entriesCrc)
+		return ERROR_BAD_FORMAT;
+	static const byte unused[16] = {};
+	DWORD number = 0;
+	for (DWORD i=0; i<header.entryCount; i++)
+	{
+		auto e = (const GptEntry *) (r.buf + (size_t) i * header.entrySize);
+		if (memcmp(e->typeGuid, unused, sizeof(unused))==0)
+			continue;
+		if (e->lastLba < e->firstLba || !Fits(e->firstLba, e->lastLba - e->firstLba + 1, sectorSize, size))
+			return ERROR_BAD_FORMAT;
+		entries.push_back(PartitionEntry(++number, e->firstLba * sectorSize, (e->lastLba - e->firstLba + 1) * sectorSize));
+	}
+	return 0;
+}
+
+static HRESULT ReadGpt(SectorReader & r, UINT64 size, PartitionEntries & entries)
+{
+	for (auto sectorSize : sectorSizes)
+	{
+		GptHeader header;
+		auto hr = ReadGptHeader(r, 1, sectorSize, header);
+		if (hr==ERROR_BAD_FORMAT && size / sectorSize > 2)
+			hr = ReadGptHeader(r, size / sectorSize - 1, sectorSize, header);
+		if (hr==ERROR_BAD_FORMAT)
+			continue;
+		if (hr) return hr;
+		return ReadGptEntries(r, header, sectorSize, size, entries);
+	}
+	return ERROR_BAD_FORMAT;
+}
+
+// Follows the EBR chain of the extended partition at firstLba. Each EBR
+// holds one logical partition, relative to itself, and a link to the next
+// EBR, relative to the extended partition.
+static HRESULT ReadEbrChain(SectorReader & r, UINT64 firstLba, UINT64 size, DWORD & number, PartitionEntries & entries)
+{
+	const DWORD sectorSize = sectorSizes[0];
+	UINT64 ebr = firstLba;
+	for (DWORD n=0; n<maxLogicalPartitions; n++)
+	{
+		auto hr = r.Read(ebr * sectorSize, sectorSize);
+		if (hr) return hr;
+		if (r.buf[510]!=0x55 || r.buf[511]!=0xAA)
+			return ERROR_BAD_FORMAT;
+		MbrEntry table[2];
+		memcpy(table, r.buf + mbrEntryOffset, sizeof(table));
+		if (table[0].type!=0 && table[0].sectors!=0)
+		{
+			if (!Fits(ebr + table[0].firstLba, table[0].sectors, sectorSize, size))
+				return ERROR_BAD_FORMAT;
+			entries.push_back(PartitionEntry(++number, (ebr + table[0].firstLba) * sectorSize, (UINT64) table[0].sectors * sectorSize));
+		}
+		if (!IsExtended(table[1].type) || table[1].firstLba==0)
+			return 0;
+		ebr = firstLba + table[1].firstLba;
+	}
+	// a chain this long loops back on itself
+	return ERROR_BAD_FORMAT;
+}
+
+static HRESULT ReadMbr(SectorReader & r, UINT64 size, bool & protective, PartitionEntries & entries)
+{
+	const DWORD sectorSize = sectorSizes[0];
+	protective = false;
+	auto hr = r.Read(0, sectorSize);
+	if (hr) return hr;
+	if (r.buf[510]!=0x55 || r.buf[511]!=0xAA)
+		return ERROR_BAD_FORMAT;
+	MbrEntry table[4];
+	memcpy(table, r.buf + mbrEntryOffset, sizeof(table));
+	DWORD number = 0;
+	for (auto &e : table)
+	{
+		if (e.type==mbrTypeProtective)
+			protective = true;
+		if (e.type==0 || e.sectors==0 || IsExtended(e.type) || e.type==mbrTypeProtective)
+			continue;
+		if (!Fits(e.firstLba, e.sectors, sectorSize, size))
+			return ERROR_BAD_FORMAT;
+		entries.push_back(PartitionEntry(++number, (UINT64) e.firstLba * sectorSize, (UINT64) e.sectors * sectorSize));
+	}
+	if (protective)
+		return 0;
+	for (auto &e : table)
+	{
+		if (!IsExtended(e.type))
+			continue;
+		hr = ReadEbrChain(r, e.firstLba, size, number, entries);
+		if (hr) return hr;
+	}
+	return 0;
+}
+
+HRESULT ReadPartitionTable(HANDLE h, UINT64 size, DWORD & style, PartitionEntries & entries)
+{
+	SectorReader r(h, size);
+	entries.clear();
+	bool protective;
+	auto hr = ReadMbr(r, size, protective, entries);
+	if (hr) return hr;
+	if (!protective)
+	{
+		style = PARTITION_STYLE_MBR;
+		return 0;
+	}
+	entries.clear();
+	style = PARTITION_STYLE_GPT;
+	return ReadGpt(r, size, entries);
+}
+
+bool SplitPartitionName(LPCWSTR name, LPWSTR file, DWORD len, DWORD & number)
+{
+	auto colon = wcsrchr(name, L':');
+	// a drive letter is not a partition suffix
+	if (!colon || colon - name < 2 || (colon[1]!=L'p' && colon[1]!=L'P') || colon[2]==0)
+		return false;
+	number = 0;
+	for (auto p=colon+2; *p; p++)
+	{
+		if (*p < L'0' || *p > L'9' || number > 100000)
+			return false;
+		number = number*10 + (*p - L'0');
+	}
+	if (number==0 || (DWORD) (colon - name) >= len)
+		return false;
+	lstrcpyn(file, name, (int) (colon - name) + 1);
+	return true;
+}
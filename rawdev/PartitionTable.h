@@ -0,0 +1,60 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PARTITIONTABLE_H_
+#define PARTITIONTABLE_H_
+
+#include <Windows.h>
+#include <vector>
+
+using namespace std;
+
+// One partition found in the tables on a disk or disk image, numbered the
+// way Windows numbers them: GPT entries and MBR primaries in table order,
+// then logical partitions, skipping empty slots and extended containers.
+struct PartitionEntry
+{
+	DWORD number;
+	UINT64 offset;
+	UINT64 size;
+	PartitionEntry(DWORD n, UINT64 o, UINT64 s) : number(n), offset(o), size(s) {}
+};
+typedef vector<PartitionEntry> PartitionEntries;
+
+// Reads the MBR, the chain of EBRs and any GPT straight from the sectors of
+// h, which holds size bytes. A GPT whose primary header is damaged is read
+// from the backup. style is a PARTITION_STYLE. ERROR_BAD_FORMAT when there
+// is no partition table.
+HRESULT ReadPartitionTable(HANDLE h, UINT64 size, DWORD & style, PartitionEntries & entries);
+
+// Splits "disk.img:p3" into "disk.img" and 3. False for any other name.
+bool SplitPartitionName(LPCWSTR name, LPWSTR file, DWORD len, DWORD & number);
+
+#endif//PARTITIONTABLE_H_
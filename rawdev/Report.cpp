@@ -0,0 +1,83 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Report.h"
+
+void PutJsonString(FILE * f, LPCWSTR s)
+{
+	fputwc(L'"', f);
+	for (; *s; s++)
+	{
+		if (*s==L'"' || *s==L'\\')
+			fputwc(L'\\', f);
+		fputwc(*s, f);
+	}
+	fputwc(L'"', f);
+}
+
+static void PutSide(FILE * f, LPCWSTR name, const IoSide & side)
+{
+	const auto & l = side.latency;
+	fwprintf(f, L",\n  \"%s\": { \"ios\": %I64u, \"stallSeconds\": %.3f,", name, l.total, side.stallNs / 1e9);
+	fwprintf(f, L" \"latencyNs\": { \"mean\": %I64u, \"p50\": %I64u, \"p90\": %I64u, \"p99\": %I64u, \"p999\": %I64u, \"max\": %I64u } }",
+		l.Mean(), l.Percentile(500), l.Percentile(900), l.Percentile(990), l.Percentile(999), l.max);
+}
+
+HRESULT SaveCopyJson(LPCWSTR name, LPCWSTR source, LPCWSTR dest, const CopyJob & job, const CopyStats & stats)
+{
+	FILE * f;
+	if (_wfopen_s(&f, name, L"w")!=0)
+		return ERROR_OPEN_FAILED;
+	auto seconds = stats.elapsedNs / 1e9;
+	auto done = stats.copied + stats.skipped + stats.unchanged;
+	fwprintf(f, L"{\n  \"source\": ");
+	PutJsonString(f, source);
+	fwprintf(f, L",\n  \"destination\": ");
+	PutJsonString(f, dest);
+	fwprintf(f, L",\n  \"bytes\": %I64u, \"copied\": %I64u, \"skipped\": %I64u, \"unchanged\": %I64u, \"resumed\": %I64u, \"retried\": %I64u, \"unreadable\": %I64u,",
+		job.size, stats.copied, stats.skipped, stats.unchanged, stats.resumed, stats.retried, stats.unreadable);
+	fwprintf(f, L"\n  \"seconds\": %.3f, \"mbPerSecond\": %.1f, \"blockSize\": %u, \"queueDepth\": %u,",
+		seconds, seconds>0 ? done / seconds / 1024 / 1024 : 0.0, stats.blockSize, stats.queueDepth);
+	// the timeline holds running totals, the report the bytes of each second
+	fwprintf(f, L"\n  \"bytesPerSecond\": [");
+	UINT64 prev = 0;
+	for (size_t i=0; i<stats.timeline.size(); i++)
+	{
+		fwprintf(f, L"%s%I64u", i ? L", " : L"", stats.timeline[i] - prev);
+		prev = stats.timeline[i];
+	}
+	fwprintf(f, L"]");
+	PutSide(f, L"read", stats.reads);
+	PutSide(f, L"write", stats.writes);
+	fwprintf(f, L"\n}\n");
+	auto failed = ferror(f)!=0;
+	fclose(f);
+	return failed ? ERROR_WRITE_FAULT : 0;
+}
@@ -0,0 +1,403 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Rescue.h"
+#include "BufferPool.h"
+#include "OsHelpers.h"
+#include <cstdio>
+
+// how much work a crash may cost at most
+static const UINT64 saveIntervalNs = 10ULL*1000*1000*1000;
+// the furthest a run of failed reads makes the first pass jump ahead
+static const UINT64 maxSkip = 64*1024*1024;
+
+// Errors that say the medium could not give up these sectors. Anything
+// else, such as a read the device refuses outright, would fail the same way
+// everywhere, so it stops the rescue instead of marking the disk bad.
+static bool IsMediaError(HRESULT hr)
+{
+	switch (hr)
+	{
+	case ERROR_CRC:
+	case ERROR_SECTOR_NOT_FOUND:
+	case ERROR_READ_FAULT:
+	case ERROR_SEEK:
+	case ERROR_IO_DEVICE:
+	case ERROR_DEVICE_HARDWARE_ERROR:
+		return true;
+	}
+	return false;
+}
+
+HRESULT HandleSource::Read(void * buf, DWORD len, UINT64 offset, DWORD & done)
+{
+	return ReadAt(h, buf, len, offset, done);
+}
+
+HRESULT FaultySource::Load(LPCWSTR name)
+{
+	FILE * f;
+	if (_wfopen_s(&f, name, L"r")!=0)
+		return ERROR_OPEN_FAILED;
+	UINT64 offset;
+	UINT64 length;
+	while (fwscanf(f, L"%I64u %I64u", &offset, &length)==2)
+	{
+		starts.push_back(offset);
+		ends.push_back(offset + length);
+	}
+	fclose(f);
+	return 0;
+}
+
+HRESULT FaultySource::Read(void * buf, DWORD len, UINT64 offset, DWORD & done)
+{
+	for (size_t i=0; i<starts.size(); i++)
+		if (offset<ends[i] && starts[i]<offset + len)
+			return ERROR_CRC;
+	return inner.Read(buf, len, offset, done);
+}
+
+HRESULT RescueMap::Open(LPCWSTR n, UINT64 s)
+{
+	name = n;
+	size = s;
+	ranges.clear();
+	if (GetFileAttributes(name)==INVALID_FILE_ATTRIBUTES)
+	{
+		if (GetLastError()!=ERROR_FILE_NOT_FOUND)
+			return GetLastError();
+		RescueRange all = { 0, size, RescueUntried };
+		if (size)
+			ranges.push_back(all);
+		return 0;
+	}
+	FILE * f;
+	if (_wfopen_s(&f, name, L"r")!=0)
+		return ERROR_OPEN_FAILED;
+	HRESULT hr = 0;
+	UINT64 mapSize = ~0ULL;
+	UINT64 end = 0;
+	WCHAR line[128];
+	while (!hr && fgetws(line, ARRAYSIZE(line), f))
+	{
+		RescueRange r;
+		WCHAR state;
+		if (line[0]==L'#' || line[0]==L'\n')
+			continue;
+		if (swscanf(line, L"size %I64u", &mapSize)==1)
+			continue;
+		// the ranges must follow each other and cover everything exactly once
+		if (swscanf(line, L"%I64u %I64u %c", &r.pos, &r.size, &state)!=3 || r.pos!=end || r.size==0)
+			hr = ERROR_BAD_FORMAT;
+		else if (state!=RescueUntried && state!=RescueFailed && state!=RescueBad && state!=RescueGood)
+			hr = ERROR_BAD_FORMAT;
+		else
+		{
+			r.state = (RescueState)state;
+			ranges.push_back(r);
+			end += r.size;
+		}
+	}
+	fclose(f);
+	if (!hr && (mapSize!=size || end!=size))
+	{
+		wprintf(L"Rescue map %s is for a different size\n", name);
+		hr = ERROR_INVALID_DATA;
+	}
+	return hr;
+}
+
+HRESULT RescueMap::Save() const
+{
+	WCHAR temp[MAX_PATH+8];
+	if (lstrlen(name)>=MAX_PATH)
+		return ERROR_FILENAME_EXCED_RANGE;
+	lstrcpyn(temp, name, MAX_PATH);
+	lstrcat(temp, L".tmp");
+	FILE * f;
+	// c makes fflush commit the file to disk
+	if (_wfopen_s(&f, temp, L"wc")!=0)
+		return ERROR_OPEN_FAILED;
+	fwprintf(f, L"# rawdev rescue map: offset length state (? untried, * failed, - bad, + good)\n");
+	fwprintf(f, L"size %I64u\n", size);
+	for (size_t i=0; i<ranges.size(); i++)
+		fwprintf(f, L"%I64u %I64u %c\n", ranges[i].pos, ranges[i].size, (WCHAR)ranges[i].state);
+	auto failed = fflush(f)!=0 || ferror(f)!=0;
+	fclose(f);
+	if (failed)
+		return ERROR_WRITE_FAULT;
+	// the rename is atomic, so a crash leaves either the old map or the new one
+	if (!MoveFileEx(temp, name, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		return GetLastError();
+	return 0;
+}
+
+// Adds r after the ranges in v, merging it into the last one when they match
+static void Append(vector<RescueRange> & v, UINT64 pos, UINT64 size, RescueState state)
+{
+	if (size==0)
+		return;
+	if (!v.empty() && v.back().state==state && v.back().pos + v.back().size==pos)
+	{
+		v.back().size += size;
+		return;
+	}
+	RescueRange r = { pos, size, state };
+	v.push_back(r);
+}
+
+void RescueMap::Set(UINT64 pos, UINT64 len, RescueState state)
+{
+	auto end = pos + len;
+	vector<RescueRange> result;
+	result.reserve(ranges.size() + 2);
+	for (size_t i=0; i<ranges.size() && ranges[i].pos<pos; i++)
+	{
+		const auto & r = ranges[i];
+		auto rEnd = r.pos + r.size;
+		Append(result, r.pos, (rEnd < pos ? rEnd : pos) - r.pos, r.state);
+	}
+	Append(result, pos, len, state);
+	for (size_t i=0; i<ranges.size(); i++)
+	{
+		const auto & r = ranges[i];
+		auto rEnd = r.pos + r.size;
+		if (rEnd<=end)
+			continue;
+		auto start = r.pos > end ? r.pos : end;
+		Append(result, start, rEnd - start, r.state);
+	}
+	ranges.swap(result);
+}
+
+UINT64 RescueMap::Bytes(RescueState state) const
+{
+	UINT64 bytes = 0;
+	for (size_t i=0; i<ranges.size(); i++)
+		if (ranges[i].state==state)
+			bytes += ranges[i].size;
+	return bytes;
+}
+
+struct Rescuer
+{
+	const CopyJob & job;
+	CopyStats & stats;
+	RescueSource & source;
+	RescueMap & map;
+	DWORD sectorSize;
+	byte * buf;
+	UINT64 lastSave;
+
+	Rescuer(const CopyJob & j, CopyStats & st, RescueSource & s, RescueMap & m, DWORD sector) : job(j), stats(st), source(s), map(m)
+	{
+		sectorSize = sector;
+		buf = nullptr;
+		lastSave = Now();
+	}
+
+	~Rescuer()
+	{
+		FreeIoBuffer(buf);
+	}
+
+	vector<RescueRange> Ranges(RescueState state) const
+	{
+		vector<RescueRange> v;
+		for (size_t i=0; i<map.ranges.size(); i++)
+			if (map.ranges[i].state==state)
+				v.push_back(map.ranges[i]);
+		return v;
+	}
+
+	DWORD AlignUp(DWORD len, DWORD alignment) const
+	{
+		return alignment ? (len + alignment - 1) / alignment * alignment : len;
+	}
+
+	// ok tells whether the read worked; only errors that are not media errors are returned
+	HRESULT TryRead(UINT64 pos, DWORD len, bool & ok)
+	{
+		auto ioLen = AlignUp(len, sectorSize);
+		// retries are paid for too, a failing disk is no reason to exceed -rate or -iops
+		if (job.throttle)
+			job.throttle->Take(ioLen);
+		DWORD done;
+		auto hr = source.Read(buf, ioLen, job.srcOffset + pos, done);
+		ok = !hr;
+		if (hr)
+			return IsMediaError(hr) ? 0 : hr;
+		return done<len ? ERROR_HANDLE_EOF : 0;
+	}
+
+	HRESULT Write(UINT64 pos, DWORD len, RescueState state)
+	{
+		auto hr = WriteAt(job.hdst, buf, AlignUp(len, job.alignment), job.dstOffset + pos);
+		if (hr) return hr;
+		map.Set(pos, len, state);
+		if (state==RescueGood)
+			stats.copied += len;
+		else
+			stats.unreadable += len;
+		return Progress();
+	}
+
+	HRESULT Progress()
+	{
+		ReportProgress(job, stats, stats.copied + stats.unreadable);
+		if (TicksToNs(Now() - lastSave)<saveIntervalNs)
+			return 0;
+		return Save();
+	}
+
+	HRESULT Save()
+	{
+		lastSave = Now();
+		// what the map calls good must be on the destination first
+		if (!FlushFileBuffers(job.hdst))
+			return GetLastError();
+		return map.Save();
+	}
+
+	// Large reads over everything untried, jumping further ahead after each
+	// failure in a row to get past a damaged area quickly
+	HRESULT Sweep()
+	{
+		auto todo = Ranges(RescueUntried);
+		UINT64 skip = 0;
+		for (size_t i=0; i<todo.size(); i++)
+		{
+			auto end = todo[i].pos + todo[i].size;
+			for (auto pos=todo[i].pos; pos<end; )
+			{
+				auto len = end - pos < job.blockSize ? (DWORD)(end - pos) : job.blockSize;
+				bool ok;
+				auto hr = TryRead(pos, len, ok);
+				if (hr) return hr;
+				if (ok)
+				{
+					hr = Write(pos, len, RescueGood);
+					if (hr) return hr;
+					pos += len;
+					skip = 0;
+					continue;
+				}
+				auto failed = end - pos < len + skip ? end - pos : len + skip;
+				map.Set(pos, failed, RescueFailed);
+				pos += failed;
+				skip = skip==0 ? job.blockSize : skip * 2 < maxSkip ? skip * 2 : maxSkip;
+			}
+		}
+		return 0;
+	}
+
+	// Reads len bytes at pos whole or, failing that, each half on its own,
+	// down to single sectors; a sector that cannot be read is zero filled
+	HRESULT Bisect(UINT64 pos, DWORD len)
+	{
+		stats.retried += len;
+		bool ok;
+		auto hr = TryRead(pos, len, ok);
+		if (hr) return hr;
+		if (ok)
+			return Write(pos, len, RescueGood);
+		if (len<=sectorSize)
+		{
+			memset(buf, 0, AlignUp(len, job.alignment));
+			return Write(pos, len, RescueBad);
+		}
+		auto half = (len / 2 + sectorSize - 1) / sectorSize * sectorSize;
+		hr = Bisect(pos, half);
+		if (hr) return hr;
+		return Bisect(pos + half, len - half);
+	}
+
+	HRESULT Narrow()
+	{
+		auto todo = Ranges(RescueFailed);
+		for (size_t i=0; i<todo.size(); i++)
+		{
+			auto end = todo[i].pos + todo[i].size;
+			for (auto pos=todo[i].pos; pos<end; pos+=job.blockSize)
+			{
+				auto hr = Bisect(pos, end - pos < job.blockSize ? (DWORD)(end - pos) : job.blockSize);
+				if (hr) return hr;
+			}
+		}
+		return 0;
+	}
+
+	// One more read of each sector an earlier run found bad
+	HRESULT Retry(const vector<RescueRange> & bad)
+	{
+		for (size_t i=0; i<bad.size(); i++)
+		{
+			auto end = bad[i].pos + bad[i].size;
+			for (auto pos=bad[i].pos; pos<end; pos+=sectorSize)
+			{
+				auto len = end - pos < sectorSize ? (DWORD)(end - pos) : sectorSize;
+				stats.retried += len;
+				bool ok;
+				auto hr = TryRead(pos, len, ok);
+				if (hr) return hr;
+				if (!ok)
+					continue;
+				hr = Write(pos, len, RescueGood);
+				if (hr) return hr;
+			}
+		}
+		return 0;
+	}
+
+	HRESULT Run()
+	{
+		buf = AllocIoBuffer(job.blockSize);
+		if (!buf)
+			return GetLastError();
+		// sectors found bad before this run, the ones found now were just tried
+		auto bad = Ranges(RescueBad);
+		auto hr = Sweep();
+		if (!hr)
+			hr = Narrow();
+		if (!hr)
+			hr = Retry(bad);
+		auto shr = Save();
+		return hr ? hr : shr;
+	}
+};
+
+HRESULT RunRescue(const CopyJob & job, CopyStats & stats, RescueSource & source, RescueMap & map, DWORD sectorSize)
+{
+	if (sectorSize==0 || job.blockSize%sectorSize!=0 || job.alignment>sectorSize)
+		return ERROR_INVALID_PARAMETER;
+	Rescuer r(job, stats, source, map, sectorSize);
+	return r.Run();
+}
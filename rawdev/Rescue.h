@@ -0,0 +1,111 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RESCUE_H_
+#define RESCUE_H_
+
+#include <Windows.h>
+#include <vector>
+#include "CopyEngine.h"
+
+using namespace std;
+
+// Where rescue reads come from, so failures can be injected for testing
+struct RescueSource
+{
+	virtual ~RescueSource() {}
+	virtual HRESULT Read(void * buf, DWORD len, UINT64 offset, DWORD & done) = 0;
+};
+
+struct HandleSource : RescueSource
+{
+	HANDLE h;
+	HandleSource(HANDLE handle) : h(handle) {}
+	HRESULT Read(void * buf, DWORD len, UINT64 offset, DWORD & done);
+};
+
+// Fails every read that touches one of the ranges listed in a text file as
+// "offset length" lines, byte offsets of the underlying source
+struct FaultySource : RescueSource
+{
+	RescueSource & inner;
+	vector<UINT64> starts;
+	vector<UINT64> ends;
+	FaultySource(RescueSource & s) : inner(s) {}
+	HRESULT Load(LPCWSTR name);
+	HRESULT Read(void * buf, DWORD len, UINT64 offset, DWORD & done);
+};
+
+enum RescueState : char
+{
+	RescueUntried = '?',
+	// failed as part of a large read, not yet narrowed down
+	RescueFailed = '*',
+	// a sector that could not be read, zero on the destination
+	RescueBad = '-',
+	RescueGood = '+',
+};
+
+struct RescueRange
+{
+	UINT64 pos;
+	UINT64 size;
+	RescueState state;
+};
+
+// What is known about every byte of the rescued range, kept in a text file
+// so a later run only goes back to what is still missing. Adjacent ranges
+// of the same state are always merged.
+struct RescueMap
+{
+	LPCWSTR name;
+	UINT64 size;
+	vector<RescueRange> ranges;
+	RescueMap()
+	{
+		name = nullptr;
+		size = 0;
+	}
+	// Loads name if it exists, otherwise everything is untried
+	HRESULT Open(LPCWSTR name, UINT64 size);
+	HRESULT Save() const;
+	void Set(UINT64 pos, UINT64 len, RescueState state);
+	UINT64 Bytes(RescueState state) const;
+};
+
+// Copies what can be read of the source in three passes: large reads that
+// step over failures, then bisecting the failed areas down to single
+// sectors and zero filling those that stay unreadable, then one more try
+// at the sectors earlier runs found bad. Media errors on reads never stop
+// the copy; other read errors and write errors do. The map is saved every
+// few seconds and at the end.
+HRESULT RunRescue(const CopyJob & job, CopyStats & stats, RescueSource & source, RescueMap & map, DWORD sectorSize);
+
+#endif//RESCUE_H_
@@ -0,0 +1,145 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Simd.h"
+#include <intrin.h>
+#include <immintrin.h>
+
+static bool HasAvx2()
+{
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0]<7)
+		return false;
+	__cpuid(info, 1);
+	auto osxsave = (info[2] & (1<<27))!=0;
+	auto avx = (info[2] & (1<<28))!=0;
+	if (!osxsave || !avx)
+		return false;
+	// the OS must save the ymm registers on context switch
+	if ((_xgetbv(0) & 6)!=6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1<<5))!=0;
+}
+
+static const bool hasAvx2 = HasAvx2();
+
+static bool IsZeroScalar(const byte * p, size_t len)
+{
+	for (; len>=8; p+=8, len-=8)
+		if (*(const UINT64 *)p) return false;
+	for (; len>0; p++, len--)
+		if (*p) return false;
+	return true;
+}
+
+static bool IsZeroSse2(const byte * p, size_t len)
+{
+	auto zero = _mm_setzero_si128();
+	for (; len>=64; p+=64, len-=64)
+	{
+		auto a = _mm_or_si128(_mm_loadu_si128((const __m128i *)p), _mm_loadu_si128((const __m128i *)(p+16)));
+		auto b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(p+32)), _mm_loadu_si128((const __m128i *)(p+48)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(a, b), zero))!=0xFFFF)
+			return false;
+	}
+	return IsZeroScalar(p, len);
+}
+
+static bool IsZeroAvx2(const byte * p, size_t len)
+{
+	for (; len>=128; p+=128, len-=128)
+	{
+		auto a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)p), _mm256_loadu_si256((const __m256i *)(p+32)));
+		auto b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p+64)), _mm256_loadu_si256((const __m256i *)(p+96)));
+		auto v = _mm256_or_si256(a, b);
+		if (!_mm256_testz_si256(v, v))
+		{
+			_mm256_zeroupper();
+			return false;
+		}
+	}
+	_mm256_zeroupper();
+	return IsZeroSse2(p, len);
+}
+
+bool IsZero(const byte * p, size_t len)
+{
+	return hasAvx2 ? IsZeroAvx2(p, len) : IsZeroSse2(p, len);
+}
+
+static size_t FirstDifferenceScalar(const byte * a, const byte * b, size_t len)
+{
+	size_t i = 0;
+	for (; i+8<=len; i+=8)
+		if (*(const UINT64 *)(a+i)!=*(const UINT64 *)(b+i)) break;
+	for (; i<len; i++)
+		if (a[i]!=b[i]) return i;
+	return len;
+}
+
+static size_t FirstDifferenceSse2(const byte * a, const byte * b, size_t len)
+{
+	size_t i = 0;
+	for (; i+64<=len; i+=64)
+	{
+		auto e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a+i)), _mm_loadu_si128((const __m128i *)(b+i)));
+		auto e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a+i+16)), _mm_loadu_si128((const __m128i *)(b+i+16)));
+		auto e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a+i+32)), _mm_loadu_si128((const __m128i *)(b+i+32)));
+		auto e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a+i+48)), _mm_loadu_si128((const __m128i *)(b+i+48)));
+		if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3)))!=0xFFFF)
+			break;
+	}
+	return i + FirstDifferenceScalar(a+i, b+i, len-i);
+}
+
+static size_t FirstDifferenceAvx2(const byte * a, const byte * b, size_t len)
+{
+	size_t i = 0;
+	for (; i+128<=len; i+=128)
+	{
+		auto x0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a+i)), _mm256_loadu_si256((const __m256i *)(b+i)));
+		auto x1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a+i+32)), _mm256_loadu_si256((const __m256i *)(b+i+32)));
+		auto x2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a+i+64)), _mm256_loadu_si256((const __m256i *)(b+i+64)));
+		auto x3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a+i+96)), _mm256_loadu_si256((const __m256i *)(b+i+96)));
+		auto v = _mm256_or_si256(_mm256_or_si256(x0, x1), _mm256_or_si256(x2, x3));
+		if (!_mm256_testz_si256(v, v))
+			break;
+	}
+	_mm256_zeroupper();
+	// the scalar tail pins down the byte within the 128 that differ
+	return i + FirstDifferenceSse2(a+i, b+i, len-i);
+}
+
+size_t FirstDifference(const byte * a, const byte * b, size_t len)
+{
+	return hasAvx2 ? FirstDifferenceAvx2(a, b, len) : FirstDifferenceSse2(a, b, len);
+}
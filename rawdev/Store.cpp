@@ -0,0 +1,451 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Store.h"
+#include "FramePipeline.h"
+#include "OsHelpers.h"
+#include "Simd.h"
+
+static const char chunksMagic[8] = { 'R', 'A', 'W', 'D', 'E', 'V', 'C', '1' };
+static const DWORD storeVersion = 1;
+// packs are closed and a new one started before they grow past this
+static const UINT64 packLimit = 4ull*1024*1024*1024;
+
+struct ChunksHeader
+{
+	char magic[8];
+	DWORD version;
+	DWORD recordSize;
+};
+
+// SHA-256 output is uniform, so its leading bytes serve as hash and tag directly
+static UINT64 Home(const BlockHash & hash)
+{
+	return *(const UINT64 *) hash.bytes;
+}
+
+static DWORD Tag(const BlockHash & hash)
+{
+	return *(const DWORD *) (hash.bytes + 8);
+}
+
+ChunkStore::ChunkStore()
+{
+	dir[0] = 0;
+	committed = 0;
+	storedBytes = 0;
+	hindex = INVALID_HANDLE_VALUE;
+	hpack = INVALID_HANDLE_VALUE;
+	pack = 0;
+	packSize = 0;
+}
+
+ChunkStore::~ChunkStore()
+{
+	if (hindex!=INVALID_HANDLE_VALUE) CloseHandle(hindex);
+	if (hpack!=INVALID_HANDLE_VALUE) CloseHandle(hpack);
+	for (auto h : readers)
+		if (h!=INVALID_HANDLE_VALUE) CloseHandle(h);
+}
+
+HRESULT ChunkStore::OpenPack(DWORD n, bool write, HANDLE & h)
+{
+	WCHAR name[MAX_PATH+1];
+	wsprintf(name, L"%s\\packs\\%08u.pack", dir, n);
+	h = write
+		? CreateFile(name, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr)
+		: CreateFile(name, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (h==INVALID_HANDLE_VALUE)
+		return GetLastError();
+	return 0;
+}
+
+HRESULT ChunkStore::Open(LPCWSTR path, bool write)
+{
+	if (wcslen(path)>MAX_PATH-32)
+		return ERROR_FILENAME_EXCED_RANGE;
+	lstrcpy(dir, path);
+	WCHAR name[MAX_PATH+1];
+	if (write)
+	{
+		wsprintf(name, L"%s\\packs", dir);
+		if (!CreateDirectory(dir, nullptr) && GetLastError()!=ERROR_ALREADY_EXISTS)
+			return GetLastError();
+		if (!CreateDirectory(name, nullptr) && GetLastError()!=ERROR_ALREADY_EXISTS)
+			return GetLastError();
+	}
+	wsprintf(name, L"%s\\chunks.idx", dir);
+	// a writer keeps the index to itself, readers only keep writers out
+	hindex = write
+		? CreateFile(name, GENERIC_READ|GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr)
+		: CreateFile(name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (hindex==INVALID_HANDLE_VALUE)
+		return GetLastError();
+	LARGE_INTEGER large;
+	if (!GetFileSizeEx(hindex, &large))
+		return GetLastError();
+	ChunksHeader header;
+	if (large.QuadPart==0 && write)
+	{
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, chunksMagic, sizeof(chunksMagic));
+		header.version = storeVersion;
+		header.recordSize = sizeof(ChunkRecord);
+		auto hr = WriteAll(hindex, &header, sizeof(header), 0);
+		if (hr) return hr;
+	}
+	else
+	{
+		auto hr = ReadAll(hindex, &header, sizeof(header), 0);
+		if (hr) return hr;
+		if (memcmp(header.magic, chunksMagic, sizeof(chunksMagic))!=0 || header.version!=storeVersion || header.recordSize!=sizeof(ChunkRecord))
+			return ERROR_BAD_FORMAT;
+		// a record torn by a crash is dropped, its pack data was never referenced
+		records.resize((size_t)((large.QuadPart - sizeof(header)) / sizeof(ChunkRecord)));
+		hr = ReadAll(hindex, records.data(), records.size() * sizeof(ChunkRecord), sizeof(header));
+		if (hr) return hr;
+	}
+	committed = records.size();
+	Resize();
+	for (size_t i=0; i<records.size(); i++)
+	{
+		storedBytes += records[i].length;
+		if (records[i].pack>pack)
+			pack = records[i].pack;
+	}
+	if (!write)
+		return 0;
+	// appending after whatever the last pack holds, including data a crash left unreferenced
+	auto hr = OpenPack(pack, true, hpack);
+	if (hr) return hr;
+	if (!GetFileSizeEx(hpack, &large))
+		return GetLastError();
+	packSize = large.QuadPart;
+	return 0;
+}
+
+bool ChunkStore::Resize()
+{
+	size_t size = 1<<16;
+	while (size * 3 < records.size() * 4)
+		size *= 2;
+	if (size<=slots.size())
+		return false;
+	slots.assign(size, 0);
+	for (DWORD i=0; i<records.size(); i++)
+		Insert(i);
+	return true;
+}
+
+void ChunkStore::Insert(DWORD record)
+{
+	const auto & hash = records[record].hash;
+	auto mask = slots.size() - 1;
+	auto i = (size_t)Home(hash) & mask;
+	while (slots[i]!=0)
+		i = (i + 1) & mask;
+	slots[i] = (UINT64)Tag(hash)<<32 | (record + 1);
+}
+
+const ChunkRecord * ChunkStore::Find(const BlockHash & hash) const
+{
+	auto mask = slots.size() - 1;
+	auto tag = Tag(hash);
+	for (auto i = (size_t)Home(hash) & mask; slots[i]!=0; i = (i + 1) & mask)
+	{
+		if ((DWORD)(slots[i]>>32)!=tag)
+			continue;
+		const auto & r = records[(DWORD)slots[i] - 1];
+		if (memcmp(r.hash.bytes, hash.bytes, sha256Size)==0)
+			return &r;
+	}
+	return nullptr;
+}
+
+HRESULT ChunkStore::Add(const BlockHash & hash, const byte * data, DWORD len)
+{
+	if (packSize + len > packLimit)
+	{
+		if (!FlushFileBuffers(hpack))
+			return GetLastError();
+		CloseHandle(hpack);
+		hpack = INVALID_HANDLE_VALUE;
+		auto hr = OpenPack(++pack, true, hpack);
+		if (hr) return hr;
+		packSize = 0;
+	}
+	auto hr = WriteAt(hpack, data, len, packSize);
+	if (hr) return hr;
+	ChunkRecord r;
+	r.hash = hash;
+	r.offset = packSize;
+	r.pack = pack;
+	r.length = len;
+	packSize += len;
+	storedBytes += len;
+	records.push_back(r);
+	if (!Resize())
+		Insert((DWORD)records.size() - 1);
+	return 0;
+}
+
+HRESULT ChunkStore::Read(const ChunkRecord & r, byte * buf)
+{
+	if (r.pack>=readers.size())
+		readers.resize(r.pack + 1, INVALID_HANDLE_VALUE);
+	if (readers[r.pack]==INVALID_HANDLE_VALUE)
+	{
+		auto hr = OpenPack(r.pack, false, readers[r.pack]);
+		if (hr) return hr;
+	}
+	DWORD done;
+	auto hr = ReadAt(readers[r.pack], buf, r.length, r.offset, done);
+	if (hr) return hr;
+	if (done!=r.length)
+		return ERROR_HANDLE_EOF;
+	return 0;
+}
+
+HRESULT ChunkStore::Commit()
+{
+	if (committed==records.size())
+		return 0;
+	if (!FlushFileBuffers(hpack))
+		return GetLastError();
+	auto offset = sizeof(ChunksHeader) + committed * sizeof(ChunkRecord);
+	auto hr = WriteAll(hindex, &records[committed], (records.size() - committed) * sizeof(ChunkRecord), offset);
+	if (hr) return hr;
+	if (!FlushFileBuffers(hindex))
+		return GetLastError();
+	committed = records.size();
+	return 0;
+}
+
+HRESULT ReadStoreIndex(HANDLE h, StoreIndex & index)
+{
+	StoreIndexHeader header;
+	DWORD done;
+	auto hr = ReadHeader(h, &header, sizeof(header), done);
+	if (hr) return hr;
+	if (done<sizeof(header) || memcmp(header.magic, storeIndexMagic, sizeof(storeIndexMagic))!=0)
+		return ERROR_BAD_FORMAT;
+	if (header.version!=storeVersion || header.chunkSize==0 || header.chunkCount!=(header.size + header.chunkSize - 1) / header.chunkSize)
+		return ERROR_BAD_FORMAT;
+	index.chunkSize = header.chunkSize;
+	index.size = header.size;
+	index.chunks.resize((size_t)header.chunkCount);
+	auto bytes = index.chunks.size() * sizeof(BlockHash);
+	hr = ReadAll(h, index.chunks.data(), bytes, storeIndexHeaderSize);
+	if (hr) return hr;
+	if (Crc32c(0, index.chunks.data(), bytes)!=header.chunksCrc)
+		return ERROR_CRC;
+	return 0;
+}
+
+struct Ingester : FrameWork
+{
+	const CopyJob & job;
+	CopyStats & stats;
+	ChunkStore & store;
+	vector<BlockHash> chunks;
+	UINT64 newChunks;
+	UINT64 newBytes;
+
+	Ingester(const CopyJob & j, CopyStats & st, ChunkStore & s) : job(j), stats(st), store(s)
+	{
+		newChunks = 0;
+		newBytes = 0;
+	}
+
+	HRESULT Read(Frame & f)
+	{
+		auto pos = f.index * job.blockSize;
+		f.inLen = job.size - pos < job.blockSize ? (DWORD)(job.size - pos) : job.blockSize;
+		// unbuffered sources can only be read in whole sectors
+		DWORD done;
+		auto hr = ReadSpan(job.hsrc, f.in, f.inLen, job.srcOffset + pos, job.srcSector, done);
+		if (hr) return hr;
+		if (done<f.inLen)
+			return ERROR_HANDLE_EOF;
+		return 0;
+	}
+
+	HRESULT Transform(Frame & f, DWORD)
+	{
+		f.crc = job.checksum ? Crc32c(0, f.in, f.inLen) : 0;
+		return Sha256(f.in, f.inLen, f.out);
+	}
+
+	HRESULT Write(Frame & f)
+	{
+		auto & hash = chunks[(size_t)f.index];
+		memcpy(hash.bytes, f.out, sha256Size);
+		if (job.checksum)
+			AddCrcToDigest(stats, f.index * job.blockSize, f.crc, f.inLen);
+		if (!store.Find(hash))
+		{
+			auto hr = store.Add(hash, f.in, f.inLen);
+			if (hr) return hr;
+			newChunks++;
+			newBytes += f.inLen;
+		}
+		stats.copied += f.inLen;
+		ReportProgress(job, stats, stats.copied);
+		return 0;
+	}
+
+	HRESULT Finish()
+	{
+		// the chunks go first, an index must never name a chunk the store might lose
+		auto hr = store.Commit();
+		if (hr) return hr;
+		auto bytes = chunks.size() * sizeof(BlockHash);
+		hr = WriteAll(job.hdst, chunks.data(), bytes, storeIndexHeaderSize);
+		if (hr) return hr;
+		byte headerBuf[storeIndexHeaderSize];
+		memset(headerBuf, 0, sizeof(headerBuf));
+		auto & header = *(StoreIndexHeader *) headerBuf;
+		memcpy(header.magic, storeIndexMagic, sizeof(storeIndexMagic));
+		header.version = storeVersion;
+		header.chunkSize = job.blockSize;
+		header.size = job.size;
+		header.chunkCount = chunks.size();
+		header.chunksCrc = Crc32c(0, chunks.data(), bytes);
+		hr = WriteAt(job.hdst, headerBuf, sizeof(headerBuf), 0);
+		if (hr) return hr;
+		if (!SetFileSize(job.hdst, storeIndexHeaderSize + bytes))
+			return GetLastError();
+		return 0;
+	}
+};
+
+HRESULT StoreImage(const CopyJob & job, CopyStats & stats, DWORD workers, ChunkStore & store)
+{
+	if (job.dstOffset!=0)
+		return ERROR_INVALID_PARAMETER;
+	if (job.checksum)
+		stats.InitCrcs(job.size);
+	auto start = GetTickCount64();
+	Ingester ingester(job, stats, store);
+	ingester.chunks.resize((size_t)((job.size + job.blockSize - 1) / job.blockSize));
+	auto hr = RunFrames(ingester, ingester.chunks.size(), SpanSize(job.blockSize, job.srcSector), sha256Size, workers, &stats.reads, &stats.writes, job.throttle);
+	if (hr) return hr;
+	hr = ingester.Finish();
+	if (hr) return hr;
+	auto ms = GetTickCount64() - start;
+	if (ingester.newBytes)
+		wprintf(L"Stored %I64u new chunks, %I64u bytes, dedup ratio %I64u.%02I64u\n", ingester.newChunks, ingester.newBytes,
+			job.size / ingester.newBytes, job.size * 100 / ingester.newBytes % 100);
+	else
+		wprintf(L"Stored no new chunks, the store already held all %I64u\n", (UINT64)ingester.chunks.size());
+	wprintf(L"Ingested %I64u MB/s, store holds %I64u chunks, %I64u bytes\n", ms ? job.size * 1000 / ms / 1024 / 1024 : 0,
+		store.ChunkCount(), store.StoredBytes());
+	return 0;
+}
+
+struct Restorer : FrameWork
+{
+	const CopyJob & job;
+	CopyStats & stats;
+	ChunkStore & store;
+	const StoreIndex & index;
+	UINT64 first;
+
+	Restorer(const CopyJob & j, CopyStats & st, ChunkStore & s, const StoreIndex & i) : job(j), stats(st), store(s), index(i)
+	{
+		first = job.srcOffset / index.chunkSize;
+	}
+
+	UINT64 ChunkStart(const Frame & f) const { return (first + f.index) * index.chunkSize; }
+
+	HRESULT Read(Frame & f)
+	{
+		auto r = store.Find(index.chunks[(size_t)(first + f.index)]);
+		if (!r)
+			return ERROR_NOT_FOUND;
+		auto start = ChunkStart(f);
+		f.inLen = index.size - start < index.chunkSize ? (DWORD)(index.size - start) : index.chunkSize;
+		if (r->length!=f.inLen)
+			return ERROR_BAD_FORMAT;
+		return store.Read(*r, f.in);
+	}
+
+	HRESULT Transform(Frame & f, DWORD)
+	{
+		BlockHash hash;
+		auto hr = Sha256(f.in, f.inLen, hash.bytes);
+		if (hr) return hr;
+		if (memcmp(hash.bytes, index.chunks[(size_t)(first + f.index)].bytes, sha256Size)!=0)
+			return ERROR_CRC;
+		f.flags = job.skipZero && IsZero(f.in, f.inLen) ? 1 : 0;
+		return 0;
+	}
+
+	HRESULT Write(Frame & f)
+	{
+		// only the part of the chunk inside the requested range is written
+		auto chunkStart = ChunkStart(f);
+		auto start = chunkStart > job.srcOffset ? chunkStart : job.srcOffset;
+		auto end = chunkStart + f.inLen;
+		if (end>job.srcOffset + job.size)
+			end = job.srcOffset + job.size;
+		auto data = f.in + (start - chunkStart);
+		auto len = (DWORD)(end - start);
+		auto pos = start - job.srcOffset;
+		if (job.checksum)
+			AddToDigest(stats, pos, data, len);
+		if (f.flags)
+			stats.skipped += len;
+		else
+		{
+			if (job.hdst!=INVALID_HANDLE_VALUE)
+			{
+				auto hr = WriteAt(job.hdst, data, len, job.dstOffset + pos);
+				if (hr) return hr;
+			}
+			stats.copied += len;
+		}
+		ReportProgress(job, stats, stats.copied + stats.skipped);
+		return 0;
+	}
+};
+
+HRESULT RestoreImage(const CopyJob & job, CopyStats & stats, DWORD workers, ChunkStore & store, const StoreIndex & index)
+{
+	if (job.srcOffset + job.size > index.size)
+		return ERROR_HANDLE_EOF;
+	if (job.checksum)
+		stats.InitCrcs(job.size);
+	if (job.size==0)
+		return 0;
+	Restorer r(job, stats, store, index);
+	auto last = (job.srcOffset + job.size - 1) / index.chunkSize;
+	return RunFrames(r, last - r.first + 1, index.chunkSize, 0, workers, &stats.reads, &stats.writes, job.throttle);
+}
@@ -0,0 +1,127 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef STORE_H_
+#define STORE_H_
+
+#include <Windows.h>
+#include <vector>
+#include "Checksum.h"
+#include "CopyEngine.h"
+
+using namespace std;
+
+// A content addressed chunk store is a directory holding every distinct chunk
+// once, appended to pack files under packs\, and chunks.idx recording the
+// SHA-256 and pack location of each. An image stored there is only an index
+// file: the header, then the SHA-256 of each chunk of the source in order.
+const DWORD storeIndexHeaderSize = 4096;
+const char storeIndexMagic[8] = { 'R', 'A', 'W', 'D', 'E', 'V', 'S', '1' };
+
+struct StoreIndexHeader
+{
+	char magic[8];
+	DWORD version;
+	DWORD chunkSize;
+	UINT64 size;
+	UINT64 chunkCount;
+	DWORD chunksCrc;
+	DWORD reserved;
+};
+
+struct StoreIndex
+{
+	DWORD chunkSize;
+	UINT64 size;
+	vector<BlockHash> chunks;
+	StoreIndex()
+	{
+		chunkSize = 0;
+		size = 0;
+	}
+};
+
+// One entry of chunks.idx, also kept in memory for every chunk in the store
+struct ChunkRecord
+{
+	BlockHash hash;
+	UINT64 offset;
+	DWORD pack;
+	DWORD length;
+};
+
+// The chunks of a store, looked up by hash through an open addressing table
+// of 8 bytes per slot kept at most 3/4 full, so tens of millions of chunks
+// take about 64 bytes each. Only one writer may have a store open at a time.
+struct ChunkStore
+{
+	ChunkStore();
+	~ChunkStore();
+	HRESULT Open(LPCWSTR dir, bool write);
+	// nullptr when the store has no chunk with this hash
+	const ChunkRecord * Find(const BlockHash & hash) const;
+	HRESULT Add(const BlockHash & hash, const byte * data, DWORD len);
+	HRESULT Read(const ChunkRecord & r, byte * buf);
+	// Makes the added chunks durable, pack data first so chunks.idx never points past it
+	HRESULT Commit();
+	UINT64 ChunkCount() const { return records.size(); }
+	UINT64 StoredBytes() const { return storedBytes; }
+
+private:
+	WCHAR dir[MAX_PATH+1];
+	vector<ChunkRecord> records;
+	size_t committed;
+	UINT64 storedBytes;
+	// tag<<32 | record index + 1 per slot, 0 for an empty slot
+	vector<UINT64> slots;
+	HANDLE hindex;
+	HANDLE hpack;
+	DWORD pack;
+	UINT64 packSize;
+	vector<HANDLE> readers;
+
+	void Insert(DWORD record);
+	// grows the table to fit records.size() and rehashes, false when it already fits
+	bool Resize();
+	HRESULT OpenPack(DWORD n, bool write, HANDLE & h);
+};
+
+// ERROR_BAD_FORMAT when h is not a store index
+HRESULT ReadStoreIndex(HANDLE h, StoreIndex & index);
+
+// Splits job.size bytes of job.hsrc from job.srcOffset into job.blockSize
+// chunks, adds the ones the store lacks and writes the index to job.hdst
+HRESULT StoreImage(const CopyJob & job, CopyStats & stats, DWORD workers, ChunkStore & store);
+
+// Writes job.size bytes of a stored image, starting at image offset
+// job.srcOffset, to job.hdst at job.dstOffset, checking every chunk's hash
+HRESULT RestoreImage(const CopyJob & job, CopyStats & stats, DWORD workers, ChunkStore & store, const StoreIndex & index);
+
+#endif//STORE_H_
@@ -0,0 +1,329 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Stream.h"
+#include "BufferPool.h"
+#include "OsHelpers.h"
+#include <cstdio>
+#include <io.h>
+
+bool IsStream(LPCWSTR name)
+{
+	return lstrcmp(name, L"-")==0;
+}
+
+// stdout as ReserveStdout found it, before it became stderr
+static HANDLE dataOut = nullptr;
+
+HRESULT ReserveStdout()
+{
+	auto standard = GetStdHandle(STD_OUTPUT_HANDLE);
+	if (standard==INVALID_HANDLE_VALUE || standard==nullptr)
+		return ERROR_INVALID_HANDLE;
+	if (!DuplicateHandle(GetCurrentProcess(), standard, GetCurrentProcess(), &dataOut, 0, FALSE, DUPLICATE_SAME_ACCESS))
+		return GetLastError();
+	fflush(stdout);
+	if (_dup2(_fileno(stderr), _fileno(stdout))!=0)
+		return ERROR_INVALID_HANDLE;
+	return 0;
+}
+
+HRESULT OpenStream(bool isRead, HANDLE & h)
+{
+	auto standard = isRead ? GetStdHandle(STD_INPUT_HANDLE) : dataOut;
+	if (standard==INVALID_HANDLE_VALUE || standard==nullptr)
+		return ERROR_INVALID_HANDLE;
+	// the caller closes h like any other handle, so hand out a copy
+	if (!DuplicateHandle(GetCurrentProcess(), standard, GetCurrentProcess(), &h, 0, FALSE, DUPLICATE_SAME_ACCESS))
+		return GetLastError();
+	return 0;
+}
+
+// Pipes return whatever is there, so keep reading until len bytes or the end
+static HRESULT ReadStream(HANDLE h, byte * buf, DWORD len, DWORD & done)
+{
+	done = 0;
+	while (done<len)
+	{
+		DWORD n;
+		if (!ReadFile(h, buf + done, len - done, &n, nullptr))
+		{
+			// the writing end closed the pipe, which is how a piped stream ends
+			auto error = GetLastError();
+			return error==ERROR_BROKEN_PIPE || error==ERROR_HANDLE_EOF ? 0 : error;
+		}
+		if (n==0)
+			return 0;
+		done += n;
+	}
+	return 0;
+}
+
+static HRESULT WriteStream(HANDLE h, const byte * buf, DWORD len)
+{
+	while (len>0)
+	{
+		DWORD n;
+		if (!WriteFile(h, buf, len, &n, nullptr))
+			return GetLastError();
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+struct StreamBuffer
+{
+	byte * buf;
+	UINT64 pos;
+	DWORD len;
+	bool full;
+};
+
+struct Streamer
+{
+	CopyJob & job;
+	CopyStats & stats;
+	bool srcIsStream;
+	bool dstIsStream;
+	DWORD depth;
+	DWORD unit;
+	vector<StreamBuffer> ring;
+	byte * mem;
+	// blocks the reader filled, the last one may be short
+	UINT64 filled;
+	bool ended;
+	bool stopped;
+	HRESULT readError;
+	SRWLOCK lock;
+	CONDITION_VARIABLE changed;
+
+	Streamer(CopyJob & j, CopyStats & st, bool src, bool dst) : job(j), stats(st), srcIsStream(src), dstIsStream(dst)
+	{
+		depth = job.queueDepth<2 ? 2 : job.queueDepth;
+		// an unbuffered device takes whole sectors only
+		unit = job.dstSector>job.alignment ? job.dstSector : job.alignment;
+		if (dstIsStream || unit==0)
+			unit = 1;
+		mem = nullptr;
+		filled = 0;
+		ended = false;
+		stopped = false;
+		readError = 0;
+		InitializeSRWLock(&lock);
+		InitializeConditionVariable(&changed);
+	}
+
+	~Streamer()
+	{
+		FreeIoBuffer(mem);
+	}
+
+	HRESULT Init()
+	{
+		mem = AllocIoBuffer((SIZE_T)job.blockSize * depth);
+		if (!mem)
+			return GetLastError();
+		ring.resize(depth);
+		for (DWORD i=0; i<depth; i++)
+		{
+			ring[i].buf = mem + (SIZE_T)i * job.blockSize;
+			ring[i].full = false;
+		}
+		return 0;
+	}
+
+	void Signal(HRESULT hr, bool end)
+	{
+		AcquireSRWLockExclusive(&lock);
+		readError = hr;
+		ended = end;
+		ReleaseSRWLockExclusive(&lock);
+		WakeAllConditionVariable(&changed);
+	}
+
+	HRESULT Read(byte * buf, DWORD len, UINT64 pos, DWORD & done)
+	{
+		if (srcIsStream)
+			return ReadStream(job.hsrc, buf, len, done);
+		return ReadAt(job.hsrc, buf, len, job.srcOffset + pos, done);
+	}
+
+	// a stream cannot seek, so an offset into it is read and dropped
+	HRESULT Skip(UINT64 len)
+	{
+		while (len>0)
+		{
+			auto n = len < job.blockSize ? (DWORD)len : job.blockSize;
+			DWORD done;
+			auto hr = ReadStream(job.hsrc, mem, n, done);
+			if (hr) return hr;
+			if (done<n)
+				return ERROR_HANDLE_EOF;
+			len -= n;
+		}
+		return 0;
+	}
+
+	void Reader()
+	{
+		auto hr = srcIsStream ? Skip(job.srcOffset) : 0;
+		UINT64 pos = 0;
+		for (UINT64 i=0; !hr; i++)
+		{
+			auto & b = ring[(size_t)(i % depth)];
+			auto t = Now();
+			AcquireSRWLockExclusive(&lock);
+			while (b.full && !stopped)
+				SleepConditionVariableSRW(&changed, &lock, INFINITE, 0);
+			auto stop = stopped;
+			ReleaseSRWLockExclusive(&lock);
+			if (stop)
+				return;
+			auto now = Now();
+			stats.writes.stallNs += TicksToNs(now - t);
+			auto len = job.size - pos < job.blockSize ? (DWORD)(job.size - pos) : job.blockSize;
+			if (len==0)
+				break;
+			if (job.throttle)
+				job.throttle->Take(len);
+			DWORD done;
+			hr = Read(b.buf, len, pos, done);
+			if (hr) break;
+			// only a stream may end early, a file or device has the length it was opened with
+			if (done<len && !(srcIsStream && job.size==streamSize))
+			{
+				hr = ERROR_HANDLE_EOF;
+				break;
+			}
+			stats.reads.latency.Add(TicksToNs(Now() - now));
+			if (done==0)
+				break;
+			b.pos = pos;
+			b.len = done;
+			pos += done;
+			AcquireSRWLockExclusive(&lock);
+			b.full = true;
+			filled = i + 1;
+			ReleaseSRWLockExclusive(&lock);
+			WakeAllConditionVariable(&changed);
+			if (done<len)
+				break;
+		}
+		Signal(hr, true);
+	}
+
+	static DWORD WINAPI ReaderThread(LPVOID p)
+	{
+		((Streamer *) p)->Reader();
+		return 0;
+	}
+
+	HRESULT Write(StreamBuffer & b)
+	{
+		if (dstIsStream)
+			return WriteStream(job.hdst, b.buf, b.len);
+		auto ioLen = (b.len + unit - 1) / unit * unit;
+		if (ioLen>b.len)
+			memset(b.buf + b.len, 0, ioLen - b.len);
+		return WriteAt(job.hdst, b.buf, ioLen, job.dstOffset + b.pos);
+	}
+
+	HRESULT Writer()
+	{
+		HRESULT hr = 0;
+		for (UINT64 i=0; ; i++)
+		{
+			auto wait = Now();
+			AcquireSRWLockExclusive(&lock);
+			while (filled<=i && !ended)
+				SleepConditionVariableSRW(&changed, &lock, INFINITE, 0);
+			auto ready = filled>i;
+			auto error = readError;
+			ReleaseSRWLockExclusive(&lock);
+			stats.reads.stallNs += TicksToNs(Now() - wait);
+			if (!ready)
+				return error;
+			auto & b = ring[(size_t)(i % depth)];
+			if (job.checksum)
+			{
+				// the length of a stream is only known at its end
+				auto ranges = (size_t)((b.pos + b.len + digestRangeSize - 1) / digestRangeSize);
+				if (stats.crcs.size()<ranges)
+					stats.crcs.resize(ranges, 0);
+				AddToDigest(stats, b.pos, b.buf, b.len);
+			}
+			auto t = Now();
+			hr = Write(b);
+			if (hr) return hr;
+			auto ns = TicksToNs(Now() - t);
+			stats.writes.latency.Add(ns);
+			stats.copied += b.len;
+			ReportProgress(job, stats, stats.copied);
+			AcquireSRWLockExclusive(&lock);
+			b.full = false;
+			ReleaseSRWLockExclusive(&lock);
+			WakeAllConditionVariable(&changed);
+		}
+	}
+
+	HRESULT Run()
+	{
+		auto hr = Init();
+		if (hr) return hr;
+		auto thread = CreateThread(nullptr, 0, ReaderThread, this, 0, nullptr);
+		if (!thread)
+			return GetLastError();
+		hr = Writer();
+		// a failed write leaves the reader waiting for a free buffer
+		AcquireSRWLockExclusive(&lock);
+		stopped = true;
+		ReleaseSRWLockExclusive(&lock);
+		WakeAllConditionVariable(&changed);
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
+		return hr;
+	}
+};
+
+HRESULT RunStream(CopyJob & job, CopyStats & stats, bool srcIsStream, bool dstIsStream)
+{
+	if (job.blockSize==0 || job.queueDepth==0 || job.threads>1 || job.journal || job.usedBlocks || job.skipZero)
+		return ERROR_INVALID_PARAMETER;
+	stats.crcs.clear();
+	Streamer s(job, stats, srcIsStream, dstIsStream);
+	auto hr = s.Run();
+	if (hr) return hr;
+	job.size = stats.copied;
+	// a stream may end before the ranges its -l made room for
+	if (job.checksum)
+		stats.crcs.resize((size_t)((job.size + digestRangeSize - 1) / digestRangeSize), 0);
+	return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include <Windows.h>
+#include "CopyEngine.h"
+
+// The length of a stream source that has no -l, read until it ends
+const UINT64 streamSize = ~0ULL;
+
+// Whether name is "-", which is stdin as a source and stdout as a destination
+bool IsStream(LPCWSTR name);
+
+// Keeps stdout for the data and sends everything printed to stderr instead,
+// so messages do not end up in the stream. Call before printing anything.
+HRESULT ReserveStdout();
+
+// A handle to stdin, or to the stdout ReserveStdout kept, for the caller to close
+HRESULT OpenStream(bool isRead, HANDLE & h);
+
+// Copies through a ring of queueDepth buffers, filled by a reader thread and
+// drained in order by the calling thread. A stream end cannot seek, so it is
+// read or written front to back with plain synchronous calls, and a stream
+// source with job.srcOffset has that many bytes read and dropped first.
+// A source of streamSize bytes is read until it ends, and job.size is set
+// to what was read. A device destination gets the last block padded with
+// zeros to a whole sector.
+HRESULT RunStream(CopyJob & job, CopyStats & stats, bool srcIsStream, bool dstIsStream);
+
+#endif//STREAM_H_
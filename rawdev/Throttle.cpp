@@ -0,0 +1,127 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Throttle.h"
+#include "Histogram.h"
+#include <cstdio>
+
+static const double burstSeconds = 0.1;
+
+void TokenBucket::SetRate(double r)
+{
+	rate = r;
+	tokens = 0;
+}
+
+void TokenBucket::Refill(double seconds)
+{
+	if (rate==0)
+		return;
+	tokens += rate * seconds;
+	if (tokens>rate * burstSeconds)
+		tokens = rate * burstSeconds;
+}
+
+double TokenBucket::Spend(double cost)
+{
+	if (rate==0)
+		return 0;
+	tokens -= cost;
+	return tokens<0 ? -tokens / rate : 0;
+}
+
+Throttle::Throttle()
+{
+	controlFile = nullptr;
+	memset(&controlTime, 0, sizeof(controlTime));
+	last = 0;
+	lastCheck = 0;
+	InitializeSRWLock(&lock);
+}
+
+void Throttle::SetLimits(UINT64 bytesPerSecond, DWORD iops)
+{
+	bytes.SetRate((double)bytesPerSecond);
+	ios.SetRate(iops);
+}
+
+void Throttle::CheckControlFile(UINT64 now)
+{
+	if (!controlFile || lastCheck!=0 && TicksToNs(now - lastCheck)<1000000000)
+		return;
+	lastCheck = now;
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesEx(controlFile, GetFileExInfoStandard, &data) || CompareFileTime(&data.ftLastWriteTime, &controlTime)==0)
+		return;
+	controlTime = data.ftLastWriteTime;
+	FILE * f;
+	if (_wfopen_s(&f, controlFile, L"r")!=0)
+		return;
+	UINT64 bytesPerSecond = 0;
+	DWORD iops = 0;
+	auto fields = fwscanf(f, L"%I64u %u", &bytesPerSecond, &iops);
+	fclose(f);
+	// a file caught half written is picked up again once its time changes
+	if (fields<1)
+		return;
+	SetLimits(bytesPerSecond, iops);
+	wprintf(L"Rate limit now %I64u KB/s, %u IOPS (0 is unlimited)\n", bytesPerSecond / 1024, iops);
+}
+
+void Throttle::Take(DWORD len)
+{
+	AcquireSRWLockExclusive(&lock);
+	auto now = Now();
+	CheckControlFile(now);
+	auto seconds = last ? TicksToNs(now - last) / 1e9 : 0;
+	last = now;
+	bytes.Refill(seconds);
+	ios.Refill(seconds);
+	auto wait = bytes.Spend(len);
+	auto iosWait = ios.Spend(1);
+	if (iosWait>wait)
+		wait = iosWait;
+	ReleaseSRWLockExclusive(&lock);
+	// the debt is already booked, so other threads queue up behind this one
+	if (wait>0)
+		Sleep((DWORD)(wait * 1000) + 1);
+}
+
+bool EnterBackgroundMode()
+{
+	return SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN)==TRUE;
+}
+
+bool SetLowIoPriority(HANDLE h)
+{
+	FILE_IO_PRIORITY_HINT_INFO info;
+	info.PriorityHint = IoPriorityHintLow;
+	return SetFileInformationByHandle(h, FileIoPriorityHintInfo, &info, sizeof(info))==TRUE;
+}
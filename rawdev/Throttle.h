@@ -0,0 +1,74 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef THROTTLE_H_
+#define THROTTLE_H_
+
+#include <Windows.h>
+
+// A token bucket refilled at a fixed rate. Taking more than is there leaves
+// a debt that the caller sleeps off, so large transfers still average out
+// to the rate and bursts stay within a tenth of a second of it.
+struct TokenBucket
+{
+	double rate;
+	double tokens;
+	TokenBucket() { rate = 0; tokens = 0; }
+	void SetRate(double r);
+	void Refill(double seconds);
+	// Seconds to wait before cost may go ahead
+	double Spend(double cost);
+};
+
+// Limits the bytes and transfers per second of a copy, 0 for no limit.
+// Every thread issuing reads calls Take, which blocks as long as needed.
+// The limits can be changed while copying by writing "bytesPerSecond iops"
+// to the control file, which is looked at once a second.
+struct Throttle
+{
+	TokenBucket bytes;
+	TokenBucket ios;
+	LPCWSTR controlFile;
+	FILETIME controlTime;
+	UINT64 last;
+	UINT64 lastCheck;
+	SRWLOCK lock;
+
+	Throttle();
+	void SetLimits(UINT64 bytesPerSecond, DWORD iops);
+	void Take(DWORD len);
+	void CheckControlFile(UINT64 now);
+};
+
+// Lowers the I/O priority of this process, or just of the I/O through h
+bool EnterBackgroundMode();
+bool SetLowIoPriority(HANDLE h);
+
+#endif//THROTTLE_H_
@@ -32,11 +32,11 @@
 #define VOLUME_H_
 
 #include <memory>
-#include <list>
+#include <vector>
 #include <Windows.h>
 #include "OsHelpers.h"
 
-typedef list<shared_ptr<DISK_EXTENT>> DiskExtentList;
+typedef vector<DISK_EXTENT> DiskExtentList;
 struct Volume
 {
 	LPWSTR name;
@@ -128,13 +128,7 @@ struct Volume
 		if (!DeviceIoControl(h, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, nullptr, 0, pve, reqSize, &reqSize, nullptr))
 			return;
 		for (DWORD i=0; i<pve->NumberOfDiskExtents; i++)
-		{
-			auto de = new DISK_EXTENT();
-			de->DiskNumber = pve->Extents[i].DiskNumber;
-			de->ExtentLength = pve->Extents[i].ExtentLength;
-			de->StartingOffset = pve->Extents[i].StartingOffset;
-			extents.push_back(shared_ptr<DISK_EXTENT>(de));
-		}
+			extents.push_back(pve->Extents[i]);
 	}
 
 	void GetLabelAndFileSystem(HANDLE h)
@@ -151,7 +145,7 @@ struct Volume
 	bool IsOndisk(DWORD disk)
 	{
 		for (auto &de : extents)
-			if (de->DiskNumber==disk)
+			if (de.DiskNumber==disk)
 				return true;
 		return false;
 	}
@@ -176,6 +170,6 @@ struct Volume
 		return 0;
 	}
 };
-typedef list<shared_ptr<Volume>> VolumeList;
+typedef vector<shared_ptr<Volume>> VolumeList;
 
 #endif//VOLUME_H_
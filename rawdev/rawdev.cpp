@@ -29,10 +29,32 @@
  */
 
 #include <Windows.h>
+#include <algorithm>
+#include "Allocation.h"
 #include "Args.h"
+#include "Batch.h"
+#include "Compare.h"
+#include "Fill.h"
+#include "Bench.h"
+#include "BufferPool.h"
+#include "Checksum.h"
+#include "CopyEngine.h"
 #include "Drive.h"
+#include "FanOut.h"
 #include "Finders.h"
+#include "FramePipeline.h"
+#include "Image.h"
+#include "Journal.h"
+#include "Manifest.h"
+#include "MappedCopy.h"
+#include "OsHelpers.h"
 #include "Partition.h"
+#include "PartitionTable.h"
+#include "Report.h"
+#include "Rescue.h"
+#include "Store.h"
+#include "Stream.h"
+#include "Throttle.h"
 #include "Volume.h"
 
 DriveList g_drives;
@@ -40,7 +62,7 @@ PartitionList g_partitions;
 VolumeList g_volumes;
 Args g_args;
 
-LPCWSTR usageText = L"rawdev <-h|-lv|-lp|-cp from to>";
+LPCWSTR usageText = L"rawdev <-h|-lv|-lp|-cp from to|-cmp a b|-fill name|-bench name>";
 
 int Usage(HRESULT hr = 0, LPCWSTR reason = nullptr)
 {
@@ -50,7 +72,75 @@ int Usage(HRESULT hr = 0, LPCWSTR reason = nullptr)
 		wprintf(L"-lv : list [-all|-a] volumes\n");
 		wprintf(L"-lp : list physical disks and partitions\n");
 		wprintf(L"-cp : copy from/to disk, volume, partition, file\n");
+		wprintf(L"      - : stdin as source, stdout as destination; a source without -l is read until it ends\n");
+		wprintf(L"      file:pN : partition N of a disk image file, found from the MBR or GPT in the image\n");
 		wprintf(L"-cp [-l length] [-so sourceOffset] [-do destOffset]\n");
+		wprintf(L"-cp [-qd queueDepth] [-threads count] [-direct]\n");
+		wprintf(L"      -qd : number of 1 MB buffers in flight, default 4\n");
+		wprintf(L"      -threads : copy 64 MB stripes on this many threads, at most 64\n");
+		wprintf(L"      -direct : bypass the file cache for image files too\n");
+		wprintf(L"-largepages : take I/O buffers from large pages, needs the Lock pages in memory right\n");
+		wprintf(L"-cp [-to dest]...\n");
+		wprintf(L"      -to : also write to this destination, repeat for up to %u more; the source is read once\n", maxTargets);
+		wprintf(L"-cp [-json file]\n");
+		wprintf(L"      -json : write throughput per second and read/write latency percentiles to this file as JSON\n");
+		wprintf(L"-cp [-tune]\n");
+		wprintf(L"      -tune : find the fastest transfer size and depth while copying, remembered per device pair\n");
+		wprintf(L"-cp [-rate bytesPerSecond] [-iops count] [-ratefile file] [-lowprio] [-background]\n");
+		wprintf(L"      -rate, -iops : limit the bytes and blocks read per second\n");
+		wprintf(L"      -ratefile : take new limits from \"bytesPerSecond iops\" in this file whenever it changes\n");
+		wprintf(L"      -lowprio : mark the copy's I/O as low priority to the storage stack\n");
+		wprintf(L"      -background : run the whole process at background (very low) I/O and memory priority\n");
+		wprintf(L"-cp [-journal file [-resume]]\n");
+		wprintf(L"      -journal : record the finished 64 MB ranges in this file every 10 s, removed when the copy succeeds\n");
+		wprintf(L"      -resume : check the last recorded ranges on the destination and copy only what is missing\n");
+		wprintf(L"-cp [-rescue mapfile [-faults file]]\n");
+		wprintf(L"      -rescue : keep going past read errors, zero fill unreadable sectors and record good and bad ranges in mapfile;\n");
+		wprintf(L"                run again with the same mapfile to retry only what is missing\n");
+		wprintf(L"      -faults : fail every read touching an \"offset length\" range listed in this file, for testing\n");
+		wprintf(L"-cp [-map]\n");
+		wprintf(L"      -map : move data straight between memory mapped views of file ends and the other end;\n");
+		wprintf(L"             file to file copies clone the extents where the volume supports block cloning\n");
+		wprintf(L"-cp [-sparse [-zeroed]]\n");
+		wprintf(L"      -sparse : do not write all-zero blocks, a destination file is made sparse\n");
+		wprintf(L"      -zeroed : destination device is known to be zeroed, so -sparse may skip there too\n");
+		wprintf(L"-cp [-used]\n");
+		wprintf(L"      -used : copy only the blocks the NTFS, FAT or ext2/3/4 file system on the source has in use\n");
+		wprintf(L"-cp [-crc] [-verify]\n");
+		wprintf(L"      -crc : print the CRC32C of the copied data\n");
+		wprintf(L"      -verify : read the destination back uncached and compare checksums per 64 MB\n");
+		wprintf(L"-cp [-z]\n");
+		wprintf(L"      -z : write the destination file as a compressed image, -threads sets the compression workers\n");
+		wprintf(L"      A compressed image used as source is expanded, -so and -l address the uncompressed data\n");
+		wprintf(L"-cp [-raw]\n");
+		wprintf(L"      -raw : copy a compressed image or store index source byte for byte instead of expanding it\n");
+		wprintf(L"-cp [-manifest file] [-base file] [-delta file ...]\n");
+		wprintf(L"      -manifest : also write the SHA-256 of every 1 MB block to this file\n");
+		wprintf(L"      -base : manifest of the previous backup, the destination file only gets the changed blocks\n");
+		wprintf(L"      -delta : lay the blocks of this delta over the source, repeat oldest first;\n");
+		wprintf(L"               with -base, the manifest of the source, the source is checked against it\n");
+		wprintf(L"-cp [-store dir]\n");
+		wprintf(L"      -store : keep every distinct 1 MB chunk once in this directory, the destination file only indexes them\n");
+		wprintf(L"      A store index used as source is restored from the store\n");
+		wprintf(L"-cmp : compare two disks, volumes, partitions or files and print the byte ranges that differ\n");
+		wprintf(L"-cmp [-so offsetA] [-do offsetB] [-l length] [-qd queueDepth] [-maxdiffs n]\n");
+		wprintf(L"      differences less than 4 KB apart are one range; without -l the shorter of the two is compared\n");
+		wprintf(L"      -maxdiffs : stop after n ranges\n");
+		wprintf(L"-fill : overwrite a disk, volume, partition or file with zeros, a pattern or pseudo random data\n");
+		wprintf(L"-fill [-pattern hexbytes | -random [-seed n]] [-do offset] [-l length] [-qd queueDepth] [-threads count]\n");
+		wprintf(L"      -pattern : repeat these bytes, for example DEADBEEF\n");
+		wprintf(L"      -random : data that depends only on the seed and offset, so a second run with -verify checks it\n");
+		wprintf(L"      A file keeps its size unless -l is given; -crc, -verify, -rate, -iops and -json work as for -cp\n");
+		wprintf(L"-fill [-discard]\n");
+		wprintf(L"      -discard : TRIM the range of a disk, volume or partition, or deallocate it in a file, instead of writing it\n");
+		wprintf(L"-batch file : run the -cp command lines in file, at the same time where they share no disk,\n");
+		wprintf(L"             and report the throughput of each and of the whole batch\n");
+		wprintf(L"-bench : measure sequential and random reads of a disk, volume, partition or file\n");
+		wprintf(L"-bench [-write] [-bs blockSize] [-qd queueDepth] [-seconds n] [-so offset] [-l length] [-json file]\n");
+		wprintf(L"      -write : also measure writes, destroying the contents; a file is created with -l bytes, default 1 GB\n");
+		wprintf(L"      -bs, -qd : a single block size in bytes or queue depth instead of 4K/64K/1M and 1/4/32\n");
+		wprintf(L"      -seconds : length of each test, default 5\n");
+		wprintf(L"      -json : also write the results to this file as JSON\n");
 		wprintf(L"      Examples of valid from/to names\n");
 		wprintf(L"      \\\\?\\Volume{884d6af9-a72a-11e5-8080-005056c00008}\\\n");
 		wprintf(L"      \\Device\\HarddiskVolume2\n");
@@ -64,6 +154,13 @@ int Usage(HRESULT hr = 0, LPCWSTR reason = nullptr)
 		wprintf(L"-cp \\\\.\\PhysicalDrive0\\Partition1 c:\\temp\\drive0.part1.bin\n");
 		wprintf(L"Example: restore partition\n");
 		wprintf(L"-cp c:\\temp\\drive0.part1.bin \\\\.\\PhysicalDrive0\\Partition1\n");
+		wprintf(L"Example: full then incremental backup, and restore of both\n");
+		wprintf(L"-cp \\\\.\\PhysicalDrive0\\Partition1 c:\\temp\\full.bin -manifest c:\\temp\\full.m\n");
+		wprintf(L"-cp \\\\.\\PhysicalDrive0\\Partition1 c:\\temp\\mon.delta -base c:\\temp\\full.m -manifest c:\\temp\\mon.m\n");
+		wprintf(L"-cp c:\\temp\\full.bin \\\\.\\PhysicalDrive0\\Partition1 -delta c:\\temp\\mon.delta\n");
+		wprintf(L"Example: backup to and restore from a deduplicating store\n");
+		wprintf(L"-cp \\\\.\\PhysicalDrive0 c:\\store\\pc42.idx -store c:\\store\n");
+		wprintf(L"-cp c:\\store\\pc42.idx \\\\.\\PhysicalDrive0 -store c:\\store\n");
 		wprintf(L"Example: hide data between MBR and first partition, which happens to start at offset=1048576 so length is forced to be 1048064\n");
 		wprintf(L"-cp c:\\temp\\tamtam.bin \\\\.\\PhysicalDrive1 -do 512 -l 1048064\n");
 	}
@@ -77,26 +174,95 @@ int Usage(HRESULT hr = 0, LPCWSTR reason = nullptr)
 	return 1;
 }
 
-void EnumerateDrivesAndPartitions()
+const DWORD maxDriveNumber = 1024;
+
+// The numbers of the PhysicalDriveN links the object manager has, so only
+// disks that exist get opened; false if the links cannot be listed
+bool ListDriveNumbers(vector<DWORD> & numbers)
+{
+	vector<WCHAR> names(64*1024);
+	while (QueryDosDevice(nullptr, names.data(), (DWORD)names.size())==0)
+	{
+		if (GetLastError()!=ERROR_INSUFFICIENT_BUFFER || names.size()>=16*1024*1024)
+			return false;
+		names.resize(names.size() * 2);
+	}
+	const WCHAR prefix[] = L"PhysicalDrive";
+	for (auto s=names.data(); *s; s+=wcslen(s) + 1)
+	{
+		if (wcsncmp(s, prefix, ARRAYSIZE(prefix) - 1)!=0)
+			continue;
+		auto digits = s + ARRAYSIZE(prefix) - 1;
+		if (*digits<L'0' || *digits>L'9')
+			continue;
+		auto number = (DWORD)_wtoi(digits);
+		if (number<maxDriveNumber)
+			numbers.push_back(number);
+	}
+	sort(numbers.begin(), numbers.end());
+	return true;
+}
+
+struct DriveProbe
 {
+	vector<DWORD> numbers;
+	vector<shared_ptr<Drive>> drives;
+};
+
+static void ProbeDrive(DWORD i, void * context)
+{
+	auto & probe = *(DriveProbe *) context;
 	WCHAR name[MAX_PATH+1];
-	for (DWORD i=0; i<1024; i++)
+	wsprintf(name, L"\\\\.\\PhysicalDrive%d", probe.numbers[i]);
+	auto h = CreateFile(name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+	if (h==INVALID_HANDLE_VALUE)
+		return;
+	auto d = new Drive();
+	d->Init(h, probe.numbers[i], name);
+	probe.drives[i].reset(d);
+	CloseHandle(h);
+}
+
+// Opens every disk, each slow IOCTL round trip overlapping the others
+void EnumerateDrivesAndPartitions()
+{
+	DriveProbe probe;
+	if (!ListDriveNumbers(probe.numbers))
 	{
-		wsprintf(name, L"\\\\.\\PhysicalDrive%d", i);
-		auto h = CreateFile(name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
-		if (h==INVALID_HANDLE_VALUE)
+		for (DWORD i=0; i<maxDriveNumber; i++)
+			probe.numbers.push_back(i);
+	}
+	probe.drives.resize(probe.numbers.size());
+	ParallelFor((DWORD)probe.numbers.size(), ProbeDrive, &probe);
+	for (auto &d : probe.drives)
+	{
+		if (!d)
 			continue;
-		auto d = new Drive();
-		d->Init(h, i, name);
-		g_drives.push_back(shared_ptr<Drive>(d));
-		CloseHandle(h);
+		g_drives.push_back(d);
+		for (auto &p : d->partitions)
+			g_partitions.push_back(p);
 	}
 }
 
+struct VolumeProbe
+{
+	vector<LPWSTR> names;
+	vector<shared_ptr<Volume>> volumes;
+};
+
+static void ProbeVolume(DWORD i, void * context)
+{
+	auto & probe = *(VolumeProbe *) context;
+	auto v = new Volume();
+	v->Init(probe.names[i], wcslen(probe.names[i]));
+	probe.volumes[i].reset(v);
+}
+
 int EnumerateVolumes()
 {
 	HRESULT error;
     WCHAR volname[MAX_PATH+1];
+	VolumeProbe probe;
 	auto hFind = FindFirstVolume(volname, ARRAYSIZE(volname));
 	if (hFind==INVALID_HANDLE_VALUE)
 		return Usage(GetLastError(), L"FindFirstVolume() failed");
@@ -104,9 +270,8 @@ int EnumerateVolumes()
 	{
 		auto len = wcslen(volname);
 		volname[len] = 0;
-		auto v = new Volume();
-		v->Init(volname, len);
-		g_volumes.push_back(shared_ptr<Volume>(v));
+		// only the names for now, the volumes are opened in parallel below
+		probe.names.push_back(CopyString(volname, len));
 		auto hasNext = FindNextVolume(hFind, volname, ARRAYSIZE(volname));
 		if (hasNext)
 			continue;
@@ -116,11 +281,52 @@ int EnumerateVolumes()
 		break;
 	}
 	FindVolumeClose(hFind);
+	if (error==0)
+	{
+		probe.volumes.resize(probe.names.size());
+		ParallelFor((DWORD)probe.names.size(), ProbeVolume, &probe);
+		for (auto &v : probe.volumes)
+			g_volumes.push_back(v);
+	}
+	for (auto &name : probe.names)
+		delete name;
 	if (error!=0)
 		return Usage(error, L"ProcessLv failed");
 	return 0;
 }
 
+// Whether name can only be a file, so no device needs to be enumerated for
+// it: devices are \\.\, \\?\ or \Device\ names, and volumes can also be
+// named by a drive letter or mount point, which end in a backslash
+bool IsFileName(LPCWSTR name)
+{
+	auto len = wcslen(name);
+	if (len==0 || name[len-1]==L'\\' || len==2 && name[1]==L':')
+		return false;
+	return wcsncmp(name, L"\\\\.\\", 4)!=0 && wcsncmp(name, L"\\\\?\\", 4)!=0 && _wcsnicmp(name, L"\\Device\\", 8)!=0;
+}
+
+// A copy, comparison or benchmark between files needs neither disks nor volumes
+bool NeedsDevices()
+{
+	if (g_args.hasLv || g_args.hasLp || g_args.batch)
+		return true;
+	if (g_args.fill)
+		return !IsFileName(g_args.fill);
+	if (g_args.hasBench)
+		return !IsFileName(g_args.benchTarget);
+	if (g_args.hasCmp)
+		return !IsFileName(g_args.cmpA) || !IsFileName(g_args.cmpB);
+	if (!g_args.hasCp)
+		return false;
+	if (!IsFileName(g_args.cpSource) || !IsFileName(g_args.cpDest))
+		return true;
+	for (DWORD i=0; i<g_args.targetCount; i++)
+		if (!IsFileName(g_args.targets[i]))
+			return true;
+	return false;
+}
+
 void ListVolumes()
 {
 	for (auto &v : g_volumes)
@@ -138,13 +344,13 @@ void ListVolumes()
 		{
 			for (auto &e : v->extents)
 			{
-				auto disk = e->DiskNumber;
-				UINT64 offset = e->StartingOffset.QuadPart;
+				auto disk = e.DiskNumber;
+				UINT64 offset = e.StartingOffset.QuadPart;
 				auto p = FindPartition(disk, offset);
 				auto aligned = p== nullptr
 					? L"not aligned with partition"
 					: L"aligned with partition";
-				wprintf(L"\\\\.\\PhysicalDrive%d  offset=%I64u  size=%I64u  (%s)\n", disk, offset, e->ExtentLength.QuadPart, aligned); 
+				wprintf(L"\\\\.\\PhysicalDrive%d  offset=%I64u  size=%I64u  (%s)\n", disk, offset, e.ExtentLength.QuadPart, aligned); 
 			}
 		}
 		wprintf(L"\n");
@@ -173,11 +379,72 @@ void ListPartitions()
 	}
 }
 
-HRESULT OpenDiskOrVolumeOrFile(HANDLE & h, LPWSTR name, bool isRead, UINT64 * psize = nullptr)
+// "disk.img:p3" names partition 3 of a disk image, found from the partition
+// tables in the image itself, so it can be read without attaching the image
+bool IsImagePartition(LPCWSTR name, LPWSTR file, DWORD len, DWORD & number)
+{
+	if (!SplitPartitionName(name, file, len, number))
+		return false;
+	auto attributes = GetFileAttributes(file);
+	return attributes!=INVALID_FILE_ATTRIBUTES && !(attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+HRESULT OpenImagePartition(HANDLE & h, LPCWSTR file, DWORD number, DWORD desiredAccess, DWORD fileFlags, UINT64 * psize)
+{
+	h = CreateFile(
+				file,
+				desiredAccess,
+				FILE_SHARE_READ,
+				nullptr,
+				OPEN_EXISTING,
+				fileFlags,
+				nullptr);
+	if (h==INVALID_HANDLE_VALUE)
+		return GetLastError();
+	LARGE_INTEGER large;
+	DWORD style;
+	PartitionEntries entries;
+	HRESULT hr = 0;
+	if (!GetFileSizeEx(h, &large))
+		hr = GetLastError();
+	if (!hr)
+		hr = ReadPartitionTable(h, large.QuadPart, style, entries);
+	if (!hr)
+	{
+		hr = ERROR_FILE_NOT_FOUND;
+		for (auto &e : entries)
+		{
+			if (e.number!=number)
+				continue;
+			hr = SetPosition(h, e.offset) ? 0 : GetLastError();
+			if (!hr && psize) *psize = e.size;
+			break;
+		}
+	}
+	// the handle is only kept once it points at the partition
+	if (hr)
+	{
+		CloseHandle(h);
+		h = INVALID_HANDLE_VALUE;
+	}
+	return hr;
+}
+
+HRESULT OpenDiskOrVolumeOrFile(HANDLE & h, LPWSTR name, bool isRead, UINT64 * psize = nullptr, bool * pisFile = nullptr, bool unbuffered = false)
 {
 	DWORD desiredAccess = isRead ? GENERIC_READ : GENERIC_READ|GENERIC_WRITE;
 	DWORD devFlags = isRead ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH;
-	DWORD fileCreation = isRead ? OPEN_EXISTING : CREATE_ALWAYS;
+	devFlags |= FILE_FLAG_OVERLAPPED;
+	// a resumed copy keeps what the destination already holds, a fill keeps the file's size
+	DWORD fileCreation = isRead ? OPEN_EXISTING : g_args.resume || g_args.rescue || g_args.fill ? OPEN_ALWAYS : CREATE_ALWAYS;
+	DWORD fileFlags = g_args.direct || unbuffered ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN;
+	fileFlags |= FILE_FLAG_OVERLAPPED;
+	if (pisFile) *pisFile = false;
+	if (IsStream(name))
+	{
+		if (psize) *psize = streamSize;
+		return OpenStream(isRead, h);
+	}
 	auto v = FindVolume(name);
 	if (v) 
 	{
@@ -202,16 +469,21 @@ HRESULT OpenDiskOrVolumeOrFile(HANDLE & h, LPWSTR name, bool isRead, UINT64 * ps
 		if (psize) *psize = p->size;
 		return 0;
 	}
+	WCHAR file[MAX_PATH];
+	DWORD number;
+	if (IsImagePartition(name, file, ARRAYSIZE(file), number))
+		return OpenImagePartition(h, file, number, desiredAccess, fileFlags, psize);
 	h = CreateFile(
 				name,
 				desiredAccess,
 				FILE_SHARE_READ,
 				nullptr,
 				fileCreation,
-				FILE_FLAG_SEQUENTIAL_SCAN,
+				fileFlags,
 				nullptr);
 	if (h==INVALID_HANDLE_VALUE)
 		return GetLastError();
+	if (pisFile) *pisFile = true;
 	if (psize)
 	{
 		LARGE_INTEGER large;
@@ -222,14 +494,37 @@ HRESULT OpenDiskOrVolumeOrFile(HANDLE & h, LPWSTR name, bool isRead, UINT64 * ps
 	return 0;
 }
 
-HRESULT OpenSource(HANDLE & h, UINT64 & size)
+HRESULT OpenSource(HANDLE & h, UINT64 & size, bool & isFile, bool & isImage, ImageHeader & header, bool & isStored, StoreIndex & index)
 {
-	return OpenDiskOrVolumeOrFile(h, g_args.cpSource, true, &size);
+	isImage = false;
+	isStored = false;
+	auto hr = OpenDiskOrVolumeOrFile(h, g_args.cpSource, true, &size, &isFile);
+	// -raw copies an image or store index byte for byte
+	if (hr || !isFile || g_args.raw)
+		return hr;
+	hr = ReadImageHeader(h, header);
+	if (!hr)
+	{
+		isImage = true;
+		wprintf(L"Source is a compressed image, expanding its %I64u bytes; -raw copies the file as is\n", header.size);
+		size = header.size;
+		return 0;
+	}
+	if (hr!=ERROR_BAD_FORMAT || !g_args.store)
+		return hr==ERROR_BAD_FORMAT ? 0 : hr;
+	hr = ReadStoreIndex(h, index);
+	if (hr==ERROR_BAD_FORMAT)
+		return 0;
+	if (hr) return hr;
+	isStored = true;
+	wprintf(L"Source is a store index, restoring its %I64u bytes from the store; -raw copies the file as is\n", index.size);
+	size = index.size;
+	return 0;
 }
 
-HRESULT OpenDest(HANDLE & h)
+HRESULT OpenDest(HANDLE & h, LPWSTR name, bool & isFile)
 {
-	return OpenDiskOrVolumeOrFile(h, g_args.cpDest, false);
+	return OpenDiskOrVolumeOrFile(h, name, false, nullptr, &isFile);
 }
 
 HRESULT AdjustSource(HANDLE h, UINT64 & size)
@@ -242,7 +537,8 @@ HRESULT AdjustSource(HANDLE h, UINT64 & size)
 	if (g_args.offsetSource!=0)
 	{
 		wprintf(L"Forcing source offset=%I64u\n", g_args.offsetSource);
-		if (!SetPosition(h, g_args.offsetSource))
+		// a stream has the offset read and dropped as the copy starts
+		if (!IsStream(g_args.cpSource) && !SetPosition(h, g_args.offsetSource))
 			return GetLastError();
 	}
 	return 0;
@@ -259,30 +555,436 @@ HRESULT AdjustDest(HANDLE h)
 	return 0;
 }
 
-byte copyBuf[1024*1024];
-int Copy(HANDLE hsrc, HANDLE hdst, UINT64 size)
+// The source side that -cp and -to share: the offset the handle was left
+// at, the sector size unbuffered reads go by, the queue depth, the rate
+// limits and the priority hints
+HRESULT SetUpSource(HANDLE hsrc, CopyJob & job, Throttle & throttle)
 {
-	UINT64 total = 0;
-	UINT64 prevGb = 0;
-	while(true)
+	job.hsrc = hsrc;
+	// the handles are overlapped, so the positions set while opening become explicit offsets
+	if (IsStream(g_args.cpSource))
+		job.srcOffset = g_args.offsetSource;
+	else if (!GetPosition(hsrc, job.srcOffset))
+		return GetLastError();
+	// devices are unbuffered, so -so and -l off their sector boundaries are read in whole sectors
+	job.srcSector = GetSectorSize(hsrc);
+	if (job.srcSector==0 && g_args.direct)
+		job.srcSector = 4096;
+	if (g_args.queueDepth!=0)
+		job.queueDepth = g_args.queueDepth;
+	if (g_args.rate || g_args.iops || g_args.rateFile)
 	{
-		DWORD len;
-		auto toRead = size - total;
-		if (toRead > ARRAYSIZE(copyBuf))
-			toRead = ARRAYSIZE(copyBuf);
-		if (!ReadFile(hsrc, copyBuf, (DWORD)toRead, &len, nullptr))
-			return GetLastError();
-		if (!WriteFile(hdst, copyBuf, len, &len, nullptr))
-			return GetLastError();
-		total += len;
-		if (total==size)
-			return 0;
-		auto gb = total / 1024 / 1024 / 1024;
-		if (gb<=prevGb)
+		throttle.SetLimits(g_args.rate, g_args.iops);
+		throttle.controlFile = g_args.rateFile;
+		job.throttle = &throttle;
+	}
+	if (g_args.lowPriority && !SetLowIoPriority(hsrc))
+		wprintf(L"Could not lower the I/O priority hint of the source, reading at normal priority\n");
+	if (g_args.background && !EnterBackgroundMode())
+		wprintf(L"Could not enter background mode, copying at normal priority\n");
+	return 0;
+}
+
+DWORD Workers()
+{
+	return g_args.threads!=0 ? g_args.threads : DefaultWorkers();
+}
+
+// Tuned transfer sizes are kept in %LOCALAPPDATA%\rawdev.ini, one section per
+// source and destination pair. Files count as the volume they are on.
+bool TuningFile(LPWSTR path, DWORD len)
+{
+	auto n = GetEnvironmentVariable(L"LOCALAPPDATA", path, len);
+	if (n==0 || n + 12 > len)
+		return false;
+	lstrcat(path, L"\\rawdev.ini");
+	return true;
+}
+
+void TuningSection(LPWSTR section)
+{
+	WCHAR src[MAX_PATH+1];
+	WCHAR dst[MAX_PATH+1];
+	if (FindVolume(g_args.cpSource) || FindDrive(g_args.cpSource) || FindPartition(g_args.cpSource) || !GetVolumePathName(g_args.cpSource, src, ARRAYSIZE(src)))
+		lstrcpyn(src, g_args.cpSource, ARRAYSIZE(src));
+	if (FindVolume(g_args.cpDest) || FindDrive(g_args.cpDest) || FindPartition(g_args.cpDest) || !GetVolumePathName(g_args.cpDest, dst, ARRAYSIZE(dst)))
+		lstrcpyn(dst, g_args.cpDest, ARRAYSIZE(dst));
+	wsprintf(section, L"%s -> %s", src, dst);
+}
+
+bool LoadTuning(DWORD & blockSize, DWORD & queueDepth)
+{
+	WCHAR path[MAX_PATH+1];
+	WCHAR section[2*MAX_PATH+8];
+	if (!TuningFile(path, ARRAYSIZE(path)))
+		return false;
+	TuningSection(section);
+	auto bs = GetPrivateProfileInt(section, L"blockSize", 0, path);
+	auto qd = GetPrivateProfileInt(section, L"queueDepth", 0, path);
+	if (bs==0 || qd==0 || bs%4096!=0 || digestRangeSize%bs!=0)
+		return false;
+	blockSize = bs;
+	queueDepth = qd;
+	return true;
+}
+
+void SaveTuning(DWORD blockSize, DWORD queueDepth)
+{
+	WCHAR path[MAX_PATH+1];
+	WCHAR section[2*MAX_PATH+8];
+	WCHAR value[16];
+	if (!TuningFile(path, ARRAYSIZE(path)))
+		return;
+	TuningSection(section);
+	wsprintf(value, L"%u", blockSize);
+	WritePrivateProfileString(section, L"blockSize", value, path);
+	wsprintf(value, L"%u", queueDepth);
+	WritePrivateProfileString(section, L"queueDepth", value, path);
+}
+
+HRESULT Rescue(const CopyJob & job, CopyStats & stats)
+{
+	// the smallest transfer both sides take on their own
+	DWORD sectorSize = 512;
+	auto srcSector = GetSectorSize(job.hsrc);
+	auto dstSector = GetSectorSize(job.hdst);
+	if (srcSector>sectorSize) sectorSize = srcSector;
+	if (dstSector>sectorSize) sectorSize = dstSector;
+	if (job.alignment>sectorSize) sectorSize = job.alignment;
+	// every read and write is whole sectors from the offsets, so off them each one would fail
+	DWORD dstUnit = dstSector>job.alignment ? dstSector : job.alignment;
+	if ((srcSector && job.srcOffset%srcSector!=0) || (dstUnit && job.dstOffset%dstUnit!=0))
+	{
+		wprintf(L"-rescue needs -so and -do on whole sectors of the source and destination\n");
+		return ERROR_INVALID_PARAMETER;
+	}
+	RescueMap map;
+	auto hr = map.Open(g_args.rescue, job.size);
+	if (hr) return hr;
+	wprintf(L"Rescue map: %I64u good, %I64u bad, %I64u failed, %I64u untried bytes, %u byte sectors\n",
+		map.Bytes(RescueGood), map.Bytes(RescueBad), map.Bytes(RescueFailed), map.Bytes(RescueUntried), sectorSize);
+	HandleSource source(job.hsrc);
+	if (g_args.faults)
+	{
+		FaultySource faulty(source);
+		hr = faulty.Load(g_args.faults);
+		if (!hr)
+			hr = RunRescue(job, stats, faulty, map, sectorSize);
+	}
+	else
+		hr = RunRescue(job, stats, source, map, sectorSize);
+	wprintf(L"Rescue map: %I64u good, %I64u bad bytes\n", map.Bytes(RescueGood), map.Bytes(RescueBad));
+	return hr;
+}
+
+int Copy(HANDLE hsrc, HANDLE hdst, bool srcIsFile, bool dstIsFile, const ImageHeader * srcImage, const StoreIndex * srcStored, UINT64 size, CopyJob & job, CopyStats & stats)
+{
+	Throttle throttle;
+	auto hr = SetUpSource(hsrc, job, throttle);
+	if (hr) return hr;
+	job.hdst = hdst;
+	job.size = size;
+	auto srcIsStream = IsStream(g_args.cpSource);
+	auto dstIsStream = IsStream(g_args.cpDest);
+	if (!dstIsStream && !GetPosition(hdst, job.dstOffset))
+		return GetLastError();
+	// devices are unbuffered, so -do and -l off their sector boundaries go through bounce buffers
+	job.dstSector = GetSectorSize(hdst);
+	// an unbuffered image file can only be written in whole sectors, so pad the tail and trim it after
+	if (g_args.direct && dstIsFile)
+		job.alignment = 4096;
+	// compressed frames sit at arbitrary offsets, which unbuffered I/O cannot address
+	if (g_args.direct && (srcImage || g_args.compress))
+		return ERROR_INVALID_PARAMETER;
+	if (g_args.compress && !dstIsFile)
+		return ERROR_INVALID_PARAMETER;
+	// with -delta, -base is the manifest of the source rather than a delta to write
+	auto writingDelta = g_args.base && !g_args.deltaCount;
+	auto hashed = g_args.manifest || writingDelta;
+	if ((hashed || g_args.deltaCount) && (srcImage || g_args.compress))
+		return ERROR_INVALID_PARAMETER;
+	if (hashed && g_args.deltaCount)
+		return ERROR_INVALID_PARAMETER;
+	// without a store index as source, -store makes the destination one
+	auto storing = g_args.store && !srcStored;
+	if (g_args.store && (srcImage || g_args.compress || hashed || g_args.deltaCount))
+		return ERROR_INVALID_PARAMETER;
+	if (storing && !dstIsFile)
+		return ERROR_INVALID_PARAMETER;
+	// the frame based paths use -threads for their workers instead of striping
+	auto framed = srcImage || g_args.compress || hashed || g_args.deltaCount || g_args.store;
+	if (g_args.threads!=0 && !framed)
+		job.threads = g_args.threads;
+	if (g_args.used && framed)
+		return ERROR_INVALID_PARAMETER;
+	// free space is left as it was on a device, so it only reads back as zeros from a new file
+	if (g_args.used && g_args.verify && !dstIsFile && !g_args.zeroed)
+		return ERROR_INVALID_PARAMETER;
+	// a delta is not an image of the source, so there is nothing to verify it against
+	if (writingDelta && (!dstIsFile || g_args.verify))
+		return ERROR_INVALID_PARAMETER;
+	// a rescue fills in the destination out of order, one reader at a time
+	if (g_args.rescue && (framed || g_args.threads>1 || g_args.tune || g_args.journal || g_args.used || g_args.sparse || g_args.crc || g_args.verify))
+		return ERROR_INVALID_PARAMETER;
+	if (g_args.faults && !g_args.rescue)
+		return ERROR_INVALID_PARAMETER;
+	// a stream is read or written once, front to back
+	auto streaming = srcIsStream || dstIsStream;
+	if (streaming && (framed || g_args.rescue || job.threads>1 || g_args.tune || g_args.journal || g_args.used || g_args.sparse || g_args.map))
+		return ERROR_INVALID_PARAMETER;
+	// the mapped path copies one range front to back, in plain bytes
+	if (g_args.map && (framed || g_args.rescue || job.threads>1 || g_args.tune || g_args.journal || g_args.used || g_args.sparse || g_args.direct || !srcIsFile && !dstIsFile))
+		return ERROR_INVALID_PARAMETER;
+	// only RunCopy bounces ends off the sectors of an unbuffered side; the
+	// frame, stream and mapped paths do their I/O straight at the offsets
+	if (framed || streaming || g_args.map)
+	{
+		DWORD dstUnit = job.dstSector>job.alignment ? job.dstSector : job.alignment;
+		// framed sources are read in whole sectors, but a restored frame is
+		// written from wherever -so falls in it
+		auto srcOff = framed
+			? (srcImage || srcStored) && dstUnit>1 && job.srcOffset%dstUnit!=0
+			: !srcIsStream && job.srcSector>1 && (job.srcOffset%job.srcSector!=0 || size%job.srcSector!=0);
+		auto dstOff = !dstIsStream && dstUnit>1 && job.dstOffset%dstUnit!=0;
+		// an unbuffered file is padded and trimmed after, a device is not written past -l
+		auto tailOff = !dstIsStream && job.dstSector>1 && (!srcIsStream || g_args.length) && size%job.dstSector!=0;
+		if (srcOff || dstOff || tailOff)
+		{
+			wprintf(L"Only a plain copy takes -so, -do and -l off the sectors of a device or -direct file\n");
+			return ERROR_INVALID_PARAMETER;
+		}
+	}
+	job.checksum = g_args.crc || g_args.verify;
+	Allocation alloc;
+	if (g_args.used)
+	{
+		hr = ReadAllocation(hsrc, job.srcOffset, size, job.blockSize, alloc);
+		if (hr) return hr;
+		auto usedBlocks = (UINT64)count(alloc.usedBlocks.begin(), alloc.usedBlocks.end(), true);
+		wprintf(L"%s, %u byte clusters, %I64u of %I64u in use (%I64u%%), copying %I64u of %I64u MB\n",
+			alloc.fileSystem, alloc.clusterSize, alloc.usedClusters, alloc.clusters, alloc.clusters ? alloc.usedClusters * 100 / alloc.clusters : 0,
+			usedBlocks * job.blockSize / 1024 / 1024, (UINT64)alloc.usedBlocks.size() * job.blockSize / 1024 / 1024);
+		job.usedBlocks = &alloc.usedBlocks;
+		job.usedBlockSize = job.blockSize;
+		if (dstIsFile && !Control(hdst, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0))
+			wprintf(L"Destination file system does not support sparse files, free space is still allocated\n");
+	}
+	if (g_args.sparse && !storing)
+	{
+		if (dstIsFile)
+		{
+			if (!Control(hdst, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0))
+				wprintf(L"Destination file system does not support sparse files, skipped blocks are still allocated\n");
+			job.skipZero = true;
+		}
+		else if (g_args.zeroed)
+			job.skipZero = true;
+		else
+			wprintf(L"Destination is a device, zero blocks are written unless -zeroed is given\n");
+	}
+	if (g_args.tune)
+	{
+		// only the single threaded engine changes its transfers on the fly
+		if (framed || job.threads>1)
+			return ERROR_INVALID_PARAMETER;
+		// tuning against a limit would only find the limit
+		if (job.throttle)
+			return ERROR_INVALID_PARAMETER;
+		job.autotune = true;
+		job.autotuneCached = LoadTuning(job.blockSize, job.queueDepth);
+		if (job.autotuneCached)
+			wprintf(L"Autotune: starting from %u KB x %u tuned before\n", job.blockSize / 1024, job.queueDepth);
+	}
+	if (g_args.lowPriority && !SetLowIoPriority(hdst))
+		wprintf(L"Could not lower the I/O priority hint of the destination, writing at normal priority\n");
+	Journal journal;
+	if (g_args.resume && !g_args.journal)
+		return ERROR_INVALID_PARAMETER;
+	if (g_args.journal)
+	{
+		// only the raw copy engines record the ranges they finish
+		if (framed)
+			return ERROR_INVALID_PARAMETER;
+		// a tuned block size can end an epoch off a range boundary, so a
+		// later block would straddle a resumed range and a missing one
+		if (job.autotune)
+		{
+			wprintf(L"-journal cannot be combined with -tune\n");
+			return ERROR_INVALID_PARAMETER;
+		}
+		// bounced ends shift the blocks off the journal's ranges
+		if (IsBounced(job))
+		{
+			wprintf(L"-journal needs -so, -do and -l on whole sectors of the source and destination, or of 4096 bytes with -direct\n");
+			return ERROR_INVALID_PARAMETER;
+		}
+		JournalIdentity id;
+		memset(&id, 0, sizeof(id));
+		lstrcpyn(id.source, g_args.cpSource, ARRAYSIZE(id.source));
+		lstrcpyn(id.dest, g_args.cpDest, ARRAYSIZE(id.dest));
+		// devices have neither, a source file that changed is not resumed
+		LARGE_INTEGER large;
+		if (GetFileSizeEx(hsrc, &large))
+			id.sourceSize = large.QuadPart;
+		GetFileTime(hsrc, nullptr, nullptr, &id.sourceTime);
+		id.srcOffset = job.srcOffset;
+		id.dstOffset = job.dstOffset;
+		id.size = job.size;
+		// the journal keeps the checksum of every range
+		job.checksum = true;
+		hr = journal.Open(g_args.journal, id, hdst, g_args.resume);
+		if (hr) return hr;
+		if (g_args.resume)
+		{
+			hr = journal.CheckLast(job.dstSector ? job.dstSector : job.alignment);
+			if (hr) return hr;
+			wprintf(L"Resuming, %I64u of %I64u bytes were copied before\n", journal.ResumedBytes(), job.size);
+		}
+		job.journal = &journal;
+	}
+	// workers write out of order, so give a new file its final size up front
+	if (job.threads>1 && dstIsFile && !SetFileSize(hdst, job.dstOffset + size))
+		return GetLastError();
+	Manifest manifest;
+	Manifest base;
+	ChunkStore store;
+	if (g_args.base)
+	{
+		hr = base.Load(g_args.base);
+		if (hr) return hr;
+	}
+	if (g_args.store)
+	{
+		hr = store.Open(g_args.store, storing);
+		if (hr) return hr;
+	}
+	stats.Start();
+	if (srcStored)
+		hr = RestoreImage(job, stats, Workers(), store, *srcStored);
+	else if (storing)
+		hr = StoreImage(job, stats, Workers(), store);
+	else if (srcImage)
+		hr = ExpandImage(job, stats, *srcImage, Workers());
+	else if (g_args.compress)
+		hr = CompressImage(job, stats, Workers());
+	else if (g_args.deltaCount)
+		hr = ApplyDeltas(job, stats, Workers(), g_args.deltas, g_args.deltaCount, g_args.base ? &base : nullptr);
+	else if (g_args.rescue)
+		hr = Rescue(job, stats);
+	else if (hashed)
+		hr = HashedCopy(job, stats, Workers(), manifest, writingDelta ? &base : nullptr);
+	else if (streaming)
+		hr = RunStream(job, stats, srcIsStream, dstIsStream);
+	else if (g_args.map)
+		hr = MappedCopy(job, stats, srcIsFile, dstIsFile);
+	else
+		hr = RunCopy(job, stats);
+	if (hr)
+	{
+		// keep what did get copied for -resume
+		if (job.journal)
+			journal.Save();
+		return hr;
+	}
+	stats.Finish();
+	if (job.autotune)
+		SaveTuning(stats.blockSize, stats.queueDepth);
+	if (g_args.manifest)
+	{
+		hr = manifest.Save(g_args.manifest);
+		if (hr) return hr;
+	}
+	// skipped blocks at the end must still count towards the file size
+	if ((job.alignment!=0 || job.skipZero || job.usedBlocks) && dstIsFile && !g_args.compress && !writingDelta && !storing && !SetFileSize(hdst, job.dstOffset + job.size))
+		return GetLastError();
+	if (job.journal)
+	{
+		hr = journal.Remove();
+		if (hr) return hr;
+	}
+	wprintf(L"Copied %I64u bytes", stats.copied);
+	if (job.skipZero || job.usedBlocks || stats.skipped!=0)
+		wprintf(L", skipped %I64u %s bytes", stats.skipped, !job.usedBlocks ? L"zero" : job.skipZero ? L"free or zero" : L"free");
+	if (writingDelta)
+		wprintf(L", %I64u bytes unchanged", stats.unchanged);
+	if (stats.resumed)
+		wprintf(L", %I64u bytes resumed", stats.resumed);
+	if (g_args.rescue)
+		wprintf(L", %I64u unreadable bytes zero filled, %I64u bytes read again", stats.unreadable, stats.retried);
+	if (job.checksum)
+		wprintf(L", CRC32C %08X", stats.StreamCrc(job.size));
+	wprintf(L"\n");
+	wprintf(L"%.1f s, waited %.1f s on reads (p99 %I64u us), %.1f s on writes (p99 %I64u us)\n", stats.elapsedNs / 1e9,
+		stats.reads.stallNs / 1e9, stats.reads.latency.Percentile(990) / 1000, stats.writes.stallNs / 1e9, stats.writes.latency.Percentile(990) / 1000);
+	return 0;
+}
+
+// Reads the destination back, bypassing the cache, and compares its checksums with those taken while copying
+int Verify(const CopyJob & job, const CopyStats & stats, bool stored, LPWSTR dest)
+{
+	HANDLE h;
+	bool isFile;
+	// a compressed image or store index is read back through its frames, which needs the cache
+	auto unbuffered = !g_args.compress && !stored;
+	auto hr = OpenDiskOrVolumeOrFile(h, dest, true, nullptr, &isFile, unbuffered);
+	if (hr) return hr;
+	// an unbuffered file, or partition of an image, is read in the whole sectors
+	// around an unaligned -do or length; nothing is written, so nothing is padded
+	WCHAR image[MAX_PATH];
+	DWORD number;
+	auto inFile = isFile || IsImagePartition(dest, image, ARRAYSIZE(image), number);
+	CopyJob check = job;
+	check.hsrc = h;
+	check.hdst = INVALID_HANDLE_VALUE;
+	check.srcOffset = job.dstOffset;
+	check.skipZero = false;
+	check.alignment = 0;
+	check.srcSector = inFile ? (unbuffered ? 4096 : 0) : GetSectorSize(h);
+	check.dstSector = 0;
+	check.checksum = true;
+	check.journal = nullptr;
+	check.generator = nullptr;
+	CopyStats checkStats;
+	if (g_args.compress)
+	{
+		ImageHeader header;
+		check.srcOffset = 0;
+		check.alignment = 0;
+		hr = ReadImageHeader(h, header);
+		if (!hr)
+			hr = ExpandImage(check, checkStats, header, Workers());
+	}
+	else if (stored)
+	{
+		// the chunks are read back from the packs, so this checks what the store really holds
+		ChunkStore store;
+		StoreIndex index;
+		check.srcOffset = 0;
+		check.alignment = 0;
+		hr = store.Open(g_args.store, false);
+		if (!hr)
+			hr = ReadStoreIndex(h, index);
+		if (!hr)
+			hr = RestoreImage(check, checkStats, Workers(), store, index);
+	}
+	else
+		hr = RunCopy(check, checkStats);
+	CloseHandle(h);
+	if (hr) return hr;
+	UINT64 mismatches = 0;
+	for (size_t i=0; i<stats.crcs.size(); i++)
+	{
+		if (stats.crcs[i]==checkStats.crcs[i])
 			continue;
-		wprintf(L"Copied %I64u GB\n", gb);
-		prevGb = gb;
+		auto offset = i * digestRangeSize;
+		auto len = job.size - offset < digestRangeSize ? job.size - offset : digestRangeSize;
+		wprintf(L"Mismatch offset=%I64u length=%I64u\n", job.dstOffset + offset, len);
+		mismatches++;
 	}
+	if (mismatches)
+		return ERROR_CRC;
+	wprintf(L"Verified %I64u bytes, CRC32C %08X\n", job.size, checkStats.StreamCrc(job.size));
+	return 0;
 }
 
 int Copy()
@@ -291,23 +993,446 @@ int Copy()
 	auto hdst = INVALID_HANDLE_VALUE;
 	LPWSTR reason = L"OpenSource";
 	UINT64 size;
-	auto hr = OpenSource(hsrc, size);
+	bool srcIsFile;
+	bool dstIsFile;
+	bool srcIsImage;
+	ImageHeader srcImage;
+	bool srcIsStored;
+	StoreIndex srcStored;
+	CopyJob job;
+	CopyStats stats;
+	// store indexes and packs are read at arbitrary offsets, which unbuffered I/O cannot address
+	if (g_args.store && g_args.direct)
+		return Usage(0, L"-store cannot be combined with -direct");
+	// stdout is only written front to back and cannot be read back
+	if (IsStream(g_args.cpDest) && (g_args.offsetDest || g_args.verify))
+		return Usage(0, L"- as destination cannot be combined with -do or -verify");
+	auto hr = OpenSource(hsrc, size, srcIsFile, srcIsImage, srcImage, srcIsStored, srcStored);
 	if (!hr)
 	{
 		hr = AdjustSource(hsrc, size);
 		if (hr) return hr;
 		reason = L"OpenDestination";
-		hr = OpenDest(hdst);
+		hr = OpenDest(hdst, g_args.cpDest, dstIsFile);
 		if (!hr)
 		{
 			hr = AdjustDest(hdst);
 			if (hr) return hr;
 			reason = L"Copy";
-			hr = Copy(hsrc, hdst, size);
+			hr = Copy(hsrc, hdst, srcIsFile, dstIsFile, srcIsImage ? &srcImage : nullptr, srcIsStored ? &srcStored : nullptr, size, job, stats);
 		}
 	}
 	if (hsrc!=INVALID_HANDLE_VALUE) CloseHandle(hsrc);
 	if (hdst!=INVALID_HANDLE_VALUE) CloseHandle(hdst);
+	if (!hr && g_args.verify)
+	{
+		reason = L"Verify";
+		hr = Verify(job, stats, g_args.store && !srcIsStored, g_args.cpDest);
+	}
+	if (!hr && g_args.json)
+	{
+		reason = L"SaveCopyJson";
+		hr = SaveCopyJson(g_args.json, g_args.cpSource, g_args.cpDest, job, stats);
+	}
+	if (hr)
+		return Usage(hr, reason);
+	return 0;
+}
+
+// Copies the source to the -cp destination and every -to target, reading it once
+int FanOut()
+{
+	// only a plain copy is the same for every target
+	if (g_args.compress || g_args.manifest || g_args.base || g_args.deltaCount || g_args.store || g_args.used || g_args.tune || g_args.journal || g_args.rescue || g_args.threads>1 || g_args.sparse)
+		return Usage(0, L"-to can only be combined with -l, -so, -do, -qd, -direct, -crc, -verify, -rate, -iops, -ratefile, -lowprio, -background, -raw, -json");
+	if (IsStream(g_args.cpSource) || IsStream(g_args.cpDest))
+		return Usage(0, L"-to cannot be combined with - as source or destination");
+	for (DWORD i=0; i<g_args.targetCount; i++)
+		if (IsStream(g_args.targets[i]))
+			return Usage(0, L"-to cannot be combined with - as source or destination");
+	auto hsrc = INVALID_HANDLE_VALUE;
+	LPWSTR reason = L"OpenSource";
+	UINT64 size;
+	bool isFile;
+	bool isImage;
+	ImageHeader image;
+	bool isStored;
+	StoreIndex index;
+	CopyJob job;
+	CopyStats stats;
+	Throttle throttle;
+	vector<FanOutTarget> targets(g_args.targetCount + 1);
+	vector<bool> targetIsFile(targets.size());
+	auto copied = false;
+	auto hr = OpenSource(hsrc, size, isFile, isImage, image, isStored, index);
+	// the ring holds raw source blocks, there are no frames to expand on the way
+	if (!hr && isImage)
+	{
+		if (hsrc!=INVALID_HANDLE_VALUE) CloseHandle(hsrc);
+		return Usage(0, L"-to cannot expand a compressed image, expand it with -cp first or give -raw to copy it as is");
+	}
+	if (!hr)
+		hr = AdjustSource(hsrc, size);
+	if (!hr)
+		hr = SetUpSource(hsrc, job, throttle);
+	job.size = size;
+	if (g_args.direct)
+		job.alignment = 4096;
+	job.checksum = g_args.crc || g_args.verify;
+	for (size_t i=0; !hr && i<targets.size(); i++)
+	{
+		auto & t = targets[i];
+		bool file;
+		t.name = i==0 ? g_args.cpDest : g_args.targets[i-1];
+		reason = L"OpenDestination";
+		hr = OpenDest(t.h, t.name, file);
+		if (!hr)
+			hr = AdjustDest(t.h);
+		if (!hr && !GetPosition(t.h, t.offset))
+			hr = GetLastError();
+		targetIsFile[i] = file;
+		if (hr)
+			wprintf(L"%s: cannot open\n", t.name);
+		// every target is written straight at its offset, nothing is bounced
+		auto sector = hr ? 0 : GetSectorSize(t.h);
+		DWORD unit = sector>job.alignment ? sector : job.alignment;
+		if (!hr && unit>1 && (t.offset%unit!=0 || (sector>1 && size%sector!=0)))
+		{
+			wprintf(L"%s: -do and -l must be on whole sectors of a device or -direct file with -to\n", t.name);
+			hr = ERROR_INVALID_PARAMETER;
+		}
+		else if (g_args.lowPriority && !SetLowIoPriority(t.h))
+			wprintf(L"%s: could not lower the I/O priority hint, writing at normal priority\n", t.name);
+	}
+	if (!hr)
+	{
+		reason = L"Copy";
+		stats.Start();
+		hr = RunFanOut(job, stats, targets);
+		stats.Finish();
+		copied = !hr;
+	}
+	for (size_t i=0; i<targets.size(); i++)
+	{
+		auto & t = targets[i];
+		if (t.h==INVALID_HANDLE_VALUE)
+			continue;
+		// an unbuffered file got whole sectors, trim the padding
+		if (!hr && !t.status && job.alignment!=0 && targetIsFile[i] && !SetFileSize(t.h, t.offset + size))
+			t.status = GetLastError();
+		CloseHandle(t.h);
+		if (hr)
+			continue;
+		auto seconds = t.elapsedNs / 1e9;
+		if (t.status)
+			wprintf(L"%s: FAILED HRESULT=%d after %I64u bytes\n", t.name, t.status, t.written);
+		else
+			wprintf(L"%s: OK, %I64u bytes in %.1f s, %.1f MB/s\n", t.name, t.written, seconds, seconds>0 ? t.written / seconds / 1024 / 1024 : 0.0);
+	}
+	if (hsrc!=INVALID_HANDLE_VALUE) CloseHandle(hsrc);
+	// the targets that did get a full copy are still verified
+	for (size_t i=0; !hr && i<targets.size(); i++)
+	{
+		if (targets[i].status)
+		{
+			reason = L"Target";
+			hr = targets[i].status;
+		}
+	}
+	for (size_t i=0; copied && g_args.verify && i<targets.size(); i++)
+	{
+		if (targets[i].status)
+			continue;
+		wprintf(L"%s: ", targets[i].name);
+		job.dstOffset = targets[i].offset;
+		auto vhr = Verify(job, stats, false, targets[i].name);
+		if (vhr && !hr)
+		{
+			reason = L"Verify";
+			hr = vhr;
+		}
+	}
+	if (!hr && g_args.json)
+	{
+		reason = L"SaveCopyJson";
+		hr = SaveCopyJson(g_args.json, g_args.cpSource, g_args.cpDest, job, stats);
+	}
+	if (hr)
+		return Usage(hr, reason);
+	return 0;
+}
+
+int Compare()
+{
+	if (IsStream(g_args.cmpA) || IsStream(g_args.cmpB))
+		return Usage(ERROR_INVALID_PARAMETER, L"-cmp needs two devices or files");
+	CompareJob job;
+	UINT64 sizeA, sizeB;
+	auto hr = OpenDiskOrVolumeOrFile(job.a, g_args.cmpA, true, &sizeA);
+	if (hr) return Usage(hr, L"OpenA");
+	hr = OpenDiskOrVolumeOrFile(job.b, g_args.cmpB, true, &sizeB);
+	if (hr)
+	{
+		CloseHandle(job.a);
+		return Usage(hr, L"OpenB");
+	}
+	// a partition, or a partition of an image, starts where opening it left the handle
+	UINT64 baseA, baseB;
+	if (!GetPosition(job.a, baseA) || !GetPosition(job.b, baseB))
+	{
+		hr = GetLastError();
+		CloseHandle(job.a);
+		CloseHandle(job.b);
+		return Usage(hr, L"GetPosition");
+	}
+	job.offsetA = baseA + g_args.offsetSource;
+	job.offsetB = baseB + g_args.offsetDest;
+	auto restA = sizeA > g_args.offsetSource ? sizeA - g_args.offsetSource : 0;
+	auto restB = sizeB > g_args.offsetDest ? sizeB - g_args.offsetDest : 0;
+	job.size = restA < restB ? restA : restB;
+	if (g_args.length!=0)
+	{
+		if (g_args.length>job.size)
+		{
+			wprintf(L"Only %I64u bytes of -l %I64u are there to compare\n", job.size, g_args.length);
+			hr = ERROR_HANDLE_EOF;
+		}
+		else
+			job.size = g_args.length;
+	}
+	else if (restA!=restB)
+		wprintf(L"Sizes differ: %I64u and %I64u bytes, comparing the first %I64u\n", restA, restB, job.size);
+	if (g_args.queueDepth!=0)
+		job.queueDepth = g_args.queueDepth;
+	job.maxRanges = g_args.maxDiffs;
+	// devices are read unbuffered, so whole sectors only
+	auto sectorA = GetSectorSize(job.a);
+	auto sectorB = GetSectorSize(job.b);
+	if (!hr && (sectorA && (job.offsetA%sectorA || job.size%sectorA) || sectorB && (job.offsetB%sectorB || job.size%sectorB)))
+	{
+		wprintf(L"Offsets and length must be whole sectors on a device\n");
+		hr = ERROR_INVALID_PARAMETER;
+	}
+	vector<CompareRange> ranges;
+	UINT64 compared = 0;
+	UINT64 ticks = 0;
+	if (!hr)
+	{
+		ticks = Now();
+		hr = RunCompare(job, ranges, compared);
+		ticks = Now() - ticks;
+	}
+	CloseHandle(job.a);
+	CloseHandle(job.b);
+	UINT64 differing = 0;
+	for (auto &r : ranges)
+	{
+		// offsets within each name, as -so and -do take them
+		if (g_args.offsetSource==g_args.offsetDest)
+			wprintf(L"Differ offset=%I64u length=%I64u\n", g_args.offsetSource + r.pos, r.size);
+		else
+			wprintf(L"Differ offset=%I64u/%I64u length=%I64u\n", g_args.offsetSource + r.pos, g_args.offsetDest + r.pos, r.size);
+		differing += r.size;
+	}
+	if (hr)
+		return Usage(hr, L"Compare");
+	auto seconds = TicksToNs(ticks) / 1e9;
+	wprintf(L"Compared %I64u bytes in %.1f s, %.1f MB/s\n", compared, seconds, seconds>0 ? compared / seconds / 1024 / 1024 : 0.0);
+	if (g_args.maxDiffs && ranges.size()>=g_args.maxDiffs && compared<job.size)
+		wprintf(L"Stopped after %u ranges\n", g_args.maxDiffs);
+	if (ranges.empty() && (g_args.length!=0 || restA==restB))
+	{
+		wprintf(L"Identical\n");
+		return 0;
+	}
+	wprintf(L"%I64u ranges differ, %I64u bytes\n", (UINT64)ranges.size(), differing);
+	return ERROR_CRC;
+}
+
+// Writes generated data over the -fill target, or discards it, through the copy engine without a source
+int Fill()
+{
+	if (IsStream(g_args.fill))
+		return Usage(ERROR_INVALID_PARAMETER, L"-fill needs a device or file");
+	Generator generator;
+	if (g_args.pattern && !generator.SetPattern(g_args.pattern))
+		return Usage(ERROR_INVALID_PARAMETER, L"-pattern takes pairs of hex digits");
+	// one kind of data, and a discard writes none
+	if (g_args.pattern && g_args.random)
+		return Usage(0, L"-pattern cannot be combined with -random");
+	if (g_args.discard && (g_args.pattern || g_args.random || g_args.crc || g_args.verify || g_args.threads>1))
+		return Usage(0, L"-discard writes no data, so takes no -pattern, -random, -crc, -verify or -threads");
+	if (g_args.random)
+	{
+		generator.kind = FillRandom;
+		generator.seed = g_args.seed;
+	}
+	auto h = INVALID_HANDLE_VALUE;
+	UINT64 size;
+	bool isFile;
+	auto hr = OpenDiskOrVolumeOrFile(h, g_args.fill, false, &size, &isFile);
+	if (hr) return Usage(hr, L"OpenFill");
+	// a partition, or a partition of an image, starts where opening it left the handle
+	WCHAR image[MAX_PATH];
+	DWORD number;
+	auto inImage = IsImagePartition(g_args.fill, image, ARRAYSIZE(image), number);
+	UINT64 base;
+	if (!GetPosition(h, base))
+	{
+		hr = GetLastError();
+		CloseHandle(h);
+		return Usage(hr, L"GetPosition");
+	}
+	CopyJob job;
+	CopyStats stats;
+	job.hdst = h;
+	job.dstOffset = base + g_args.offsetDest;
+	job.generator = &generator;
+	// a file grows or shrinks to -l past -do, anything else is filled to its end and no further
+	if (isFile && g_args.length!=0)
+		size = g_args.offsetDest + g_args.length;
+	job.size = size > g_args.offsetDest ? size - g_args.offsetDest : 0;
+	if (g_args.length!=0 && g_args.length<=job.size)
+		job.size = g_args.length;
+	else if (g_args.length!=0)
+	{
+		CloseHandle(h);
+		wprintf(L"-do %I64u -l %I64u runs past the end of %s, %I64u bytes\n", g_args.offsetDest, g_args.length, g_args.fill, size);
+		return Usage(ERROR_INVALID_PARAMETER, L"Fill");
+	}
+	job.dstSector = GetSectorSize(h);
+	// padding would run into whatever follows a partition, so its unaligned tail is patched in place
+	if (g_args.direct && isFile)
+		job.alignment = 4096;
+	else if (g_args.direct && inImage)
+		job.dstSector = 4096;
+	if (g_args.queueDepth!=0)
+		job.queueDepth = g_args.queueDepth;
+	if (g_args.threads!=0)
+		job.threads = g_args.threads;
+	job.checksum = g_args.crc || g_args.verify;
+	Throttle throttle;
+	if (g_args.rate || g_args.iops)
+	{
+		throttle.SetLimits(g_args.rate, g_args.iops);
+		job.throttle = &throttle;
+	}
+	LPWSTR reason = L"Fill";
+	if (job.size==0)
+	{
+		wprintf(L"Nothing to fill, a new file needs -l\n");
+		hr = ERROR_INVALID_PARAMETER;
+	}
+	if (!hr)
+		wprintf(L"Writing to %s, its contents are destroyed\n", g_args.fill);
+	// workers write out of order, so give a file its final size up front
+	if (!hr && isFile && !g_args.discard && (job.threads>1 || g_args.length!=0) && !SetFileSize(h, job.dstOffset + job.size))
+		hr = GetLastError();
+	if (!hr)
+	{
+		stats.Start();
+		// an image partition is part of a file, so it is punched out rather than trimmed
+		hr = g_args.discard ? Discard(job, stats, isFile || inImage) : RunCopy(job, stats);
+		stats.Finish();
+	}
+	// an unbuffered file got whole sectors, trim the padding
+	if (!hr && isFile && job.alignment!=0 && !SetFileSize(h, job.dstOffset + job.size))
+		hr = GetLastError();
+	CloseHandle(h);
+	if (hr==ERROR_NOT_SUPPORTED && g_args.discard)
+		wprintf(L"%s does not support discarding, fill it with zeros instead\n", g_args.fill);
+	if (hr)
+		return Usage(hr, reason);
+	wprintf(L"%s %I64u bytes", g_args.discard ? L"Discarded" : L"Filled", stats.copied);
+	if (g_args.random)
+		wprintf(L", seed %I64u", generator.seed);
+	if (job.checksum)
+		wprintf(L", CRC32C %08X", stats.StreamCrc(job.size));
+	wprintf(L"\n");
+	auto seconds = stats.elapsedNs / 1e9;
+	wprintf(L"%.1f s, %.1f MB/s, waited %.1f s on writes (p99 %I64u us)\n", seconds, seconds>0 ? stats.copied / seconds / 1024 / 1024 : 0.0,
+		stats.writes.stallNs / 1e9, stats.writes.latency.Percentile(990) / 1000);
+	if (g_args.verify)
+	{
+		reason = L"Verify";
+		hr = Verify(job, stats, false, g_args.fill);
+	}
+	if (!hr && g_args.json)
+	{
+		reason = L"SaveCopyJson";
+		auto source = g_args.discard ? L"discard" : g_args.random ? L"random" : g_args.pattern ? g_args.pattern : L"zero";
+		hr = SaveCopyJson(g_args.json, source, g_args.fill, job, stats);
+	}
+	if (hr)
+		return Usage(hr, reason);
+	return 0;
+}
+
+const UINT64 benchFileSize = 1024*1024*1024;
+
+int Bench()
+{
+	auto h = INVALID_HANDLE_VALUE;
+	UINT64 size;
+	bool isFile;
+	BenchJob job;
+	// a file to write to is created afresh, so its size comes from -l
+	auto hr = OpenDiskOrVolumeOrFile(h, g_args.benchTarget, !g_args.write, &size, &isFile, true);
+	if (hr) return Usage(hr, L"OpenBenchTarget");
+	// a partition starts where opening it left the handle
+	UINT64 base;
+	if (!GetPosition(h, base))
+	{
+		hr = GetLastError();
+		CloseHandle(h);
+		return Usage(hr, L"GetPosition");
+	}
+	job.h = h;
+	job.write = g_args.write;
+	job.offset = base + g_args.offsetSource;
+	if (isFile && g_args.write)
+		size = g_args.offsetSource + (g_args.length ? g_args.length : benchFileSize);
+	job.size = size > g_args.offsetSource ? size - g_args.offsetSource : 0;
+	if (g_args.length!=0 && g_args.length<job.size)
+		job.size = g_args.length;
+	if (g_args.seconds!=0)
+		job.seconds = g_args.seconds;
+	const DWORD blockSizes[] = { 4096, 65536, 1024*1024 };
+	const DWORD queueDepths[] = { 1, 4, 32 };
+	if (g_args.blockSize!=0)
+		job.blockSizes.push_back(g_args.blockSize);
+	else
+		job.blockSizes.assign(blockSizes, blockSizes + ARRAYSIZE(blockSizes));
+	if (g_args.queueDepth!=0)
+		job.queueDepths.push_back(g_args.queueDepth);
+	else
+		job.queueDepths.assign(queueDepths, queueDepths + ARRAYSIZE(queueDepths));
+	LPWSTR reason = L"Bench";
+	// unbuffered transfers must be whole sectors at sector offsets
+	if (job.offset%4096!=0 || g_args.blockSize%4096!=0)
+		hr = ERROR_INVALID_PARAMETER;
+	if (!hr && g_args.write)
+		wprintf(L"Writing to %s, its contents are destroyed\n", g_args.benchTarget);
+	if (!hr && isFile && g_args.write)
+	{
+		reason = L"PrepareBench";
+		job.size = job.size / (1024*1024) * (1024*1024);
+		if (!SetFileSize(h, job.offset + job.size))
+			hr = GetLastError();
+		// written once up front, a new file would otherwise read back zeros without touching the disk
+		if (!hr)
+			hr = PrepareBench(job);
+		reason = L"Bench";
+	}
+	vector<BenchResult> results;
+	if (!hr)
+		hr = RunBench(job, results);
+	CloseHandle(h);
+	if (!hr && g_args.json)
+	{
+		reason = L"SaveBenchJson";
+		hr = SaveBenchJson(g_args.json, g_args.benchTarget, results);
+	}
 	if (hr)
 		return Usage(hr, reason);
 	return 0;
@@ -319,12 +1444,32 @@ int wmain(int argc, LPWSTR argv[])
 	if (!g_args.Parse(argc, argv))
 		return Usage();
 	if (g_args.hasHelp) return Usage();
-	EnumerateDrivesAndPartitions();
-	auto hr = EnumerateVolumes();
-	if (hr) return Usage(hr, L"EnumerateVolumes");
+	if (g_args.hasCp && IsStream(g_args.cpDest))
+	{
+		auto hr = ReserveStdout();
+		if (hr) return Usage(hr, L"ReserveStdout");
+	}
+	if (g_args.largePages && !EnableLargePages())
+		wprintf(L"Could not enable large pages, which needs the Lock pages in memory right; using normal pages\n");
+	if (NeedsDevices())
+	{
+		EnumerateDrivesAndPartitions();
+		auto hr = EnumerateVolumes();
+		if (hr) return Usage(hr, L"EnumerateVolumes");
+		IndexDevices();
+	}
 	if (g_args.hasLv) ListVolumes();
 	else if (g_args.hasLp) ListPartitions();
+	else if (g_args.batch)
+	{
+		auto hr = RunBatch(g_args.batch);
+		if (hr) return Usage(hr, L"Batch");
+	}
+	else if (g_args.hasCp && g_args.targetCount) return FanOut();
 	else if (g_args.hasCp) return Copy();
+	else if (g_args.hasCmp) return Compare();
+	else if (g_args.fill) return Fill();
+	else if (g_args.hasBench) return Bench();
 	else return Usage(0, L"Incorrect arguments");
 	return 0;
 }
@@ -0,0 +1,157 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Times the device finders against 10000 synthetic volumes, drives and
+// partitions: IndexDevices() once, then a lookup of every name, number and
+// (disk, offset) that ListVolumes and the device arguments go through. The
+// ordered list search the finders used before is timed on the same devices
+// for comparison, and every lookup is checked to find the right device.
+//
+// Build from this directory with
+//   cl /EHsc /O2 /I..\rawdev FinderBench.cpp ..\rawdev\Finders.cpp ..\rawdev\OsHelpers.cpp advapi32.lib
+// and run FinderBench.exe [count]; it exits non-zero if a lookup fails.
+
+#include <Windows.h>
+#include <cstdio>
+#include <cstdlib>
+#include "Finders.h"
+#include "Globals.h"
+
+DriveList g_drives;
+PartitionList g_partitions;
+VolumeList g_volumes;
+Args g_args;
+
+static LPWSTR Name(LPCWSTR format, DWORD i)
+{
+	WCHAR s[MAX_PATH+1];
+	wsprintf(s, format, i);
+	return CopyString(s, wcslen(s));
+}
+
+static void MakeDevices(DWORD count)
+{
+	for (DWORD i=0; i<count; i++)
+	{
+		auto d = new Drive();
+		d->number = i;
+		d->name = Name(L"\\\\.\\PhysicalDrive%u", i);
+		g_drives.push_back(shared_ptr<Drive>(d));
+		auto p = new Partition();
+		p->disk = i;
+		p->number = 1;
+		p->offset = 1024*1024;
+		p->name = Name(L"\\\\?\\GLOBALROOT\\Device\\Harddisk%uPartition1", i);
+		g_partitions.push_back(shared_ptr<Partition>(p));
+		d->partitions.push_back(g_partitions.back());
+		auto v = new Volume();
+		v->name = Name(L"\\\\?\\Volume{%08x-0000-0000-0000-000000000000}\\", i);
+		v->deviceName = Name(L"\\Device\\HarddiskVolume%u", i);
+		v->dosName = Name(L"C:\\mnt\\v%u\\", i);
+		DISK_EXTENT e;
+		e.DiskNumber = i;
+		e.StartingOffset.QuadPart = p->offset;
+		e.ExtentLength.QuadPart = 1024*1024*1024;
+		v->extents.push_back(e);
+		g_volumes.push_back(shared_ptr<Volume>(v));
+	}
+}
+
+// The search the finders did before they were indexed
+static Volume * ListFindVolume(LPWSTR s)
+{
+	for (auto &v : g_volumes)
+	{
+		if (lstrcmp(s, v->dosName)==0) return v.get();
+		else if (lstrcmp(s, v->deviceName)==0) return v.get();
+		else if (lstrcmp(s, v->name)==0) return v.get();
+	}
+	return nullptr;
+}
+
+static Partition * ListFindPartition(DWORD disk, UINT64 offset)
+{
+	for (auto &p : g_partitions)
+	{
+		if (p->disk==disk && p->offset==offset)
+			return p.get();
+	}
+	return nullptr;
+}
+
+static double Seconds(const LARGE_INTEGER & start)
+{
+	LARGE_INTEGER now, freq;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&freq);
+	return (double) (now.QuadPart - start.QuadPart) / freq.QuadPart;
+}
+
+int wmain(int argc, LPWSTR argv[])
+{
+	DWORD count = argc>1 ? wcstoul(argv[1], nullptr, 10) : 10000;
+	MakeDevices(count);
+	DWORD failures = 0;
+
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+	IndexDevices();
+	auto build = Seconds(start);
+	QueryPerformanceCounter(&start);
+	for (DWORD i=0; i<count; i++)
+	{
+		auto &v = g_volumes[i];
+		if (FindVolume(v->name)!=v.get() || FindVolume(v->deviceName)!=v.get() || FindVolume(v->dosName)!=v.get())
+			failures++;
+		if (FindDrive(g_drives[i]->name)!=g_drives[i].get() || FindDrive(i)!=g_drives[i].get())
+			failures++;
+		auto &p = g_partitions[i];
+		if (FindPartition(p->name)!=p.get() || FindPartition(v->extents[0].DiskNumber, v->extents[0].StartingOffset.QuadPart)!=p.get())
+			failures++;
+	}
+	WCHAR missing[] = L"\\Device\\HarddiskVolumeX";
+	if (FindVolume(missing) || FindDrive((DWORD) count) || FindPartition((DWORD) count, 0))
+		failures++;
+	auto indexed = Seconds(start);
+
+	QueryPerformanceCounter(&start);
+	for (DWORD i=0; i<count; i++)
+	{
+		auto &v = g_volumes[i];
+		if (ListFindVolume(v->dosName)!=v.get() || ListFindPartition(v->extents[0].DiskNumber, v->extents[0].StartingOffset.QuadPart)!=g_partitions[i].get())
+			failures++;
+	}
+	auto listed = Seconds(start);
+
+	wprintf(L"%u devices: index built in %.3f ms, %u lookups in %.3f ms\n", count, build * 1000, count * 7, indexed * 1000);
+	wprintf(L"list search: %u lookups in %.3f ms\n", count * 2, listed * 1000);
+	wprintf(L"%u failed lookups\n", failures);
+	return failures ? 1 : 0;
+}
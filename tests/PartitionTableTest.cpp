@@ -0,0 +1,245 @@
+/*
+ Copyright (c) 2016, Nicolai R. Nyberg
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice,
+ this list of conditions and the following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ 3. Neither the name of the copyright holder nor the names of its contributors
+ may be used to endorse or promote products derived from this software
+ without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Checks ReadPartitionTable against disk images built here: primary MBR
+// partitions, an EBR chain of logical partitions, GPT with more than 128
+// entries on 512 and 4096 byte sectors, and a GPT whose primary header is
+// damaged so the backup at the end of the disk is used.
+//
+// Build from this directory with
+//   cl /EHsc /I..\rawdev PartitionTableTest.cpp ..\rawdev\PartitionTable.cpp ..\rawdev\OsHelpers.cpp advapi32.lib
+// and run PartitionTableTest.exe; it prints every failed check and exits non-zero if any failed.
+
+#include <Windows.h>
+#include <cstdio>
+#include <vector>
+#include "OsHelpers.h"
+#include "PartitionTable.h"
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { wprintf(L"%S(%d): %S failed\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+struct Image
+{
+	vector<byte> bytes;
+	Image(UINT64 size) : bytes((size_t)size) {}
+	void Put32(UINT64 at, DWORD v) { memcpy(&bytes[(size_t)at], &v, 4); }
+	void Put64(UINT64 at, UINT64 v) { memcpy(&bytes[(size_t)at], &v, 8); }
+	void Signature(UINT64 sector) { bytes[(size_t)sector*512 + 510] = 0x55; bytes[(size_t)sector*512 + 511] = 0xAA; }
+	// Entry i (0..3) of the MBR style table in the 512 byte sector at lba
+	void MbrEntry(UINT64 lba, DWORD i, byte type, DWORD first, DWORD sectors)
+	{
+		auto at = lba*512 + 446 + i*16;
+		bytes[(size_t)at + 4] = type;
+		Put32(at + 8, first);
+		Put32(at + 12, sectors);
+	}
+};
+
+// The zlib CRC-32 GPT uses
+static DWORD Crc32(const byte * p, size_t len)
+{
+	DWORD crc = 0xFFFFFFFF;
+	for (size_t i=0; i<len; i++)
+	{
+		crc ^= p[i];
+		for (int k=0; k<8; k++)
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+	}
+	return ~crc;
+}
+
+struct GptPart
+{
+	DWORD index;
+	UINT64 first;
+	UINT64 last;
+};
+
+static void GptHeader(Image & img, DWORD sector, UINT64 lba, UINT64 alternate, UINT64 entriesLba, DWORD count, DWORD entriesCrc)
+{
+	auto at = lba * sector;
+	memcpy(&img.bytes[(size_t)at], "EFI PART", 8);
+	img.Put32(at + 8, 0x00010000);
+	img.Put32(at + 12, 92);
+	img.Put64(at + 24, lba);
+	img.Put64(at + 32, alternate);
+	img.Put64(at + 72, entriesLba);
+	img.Put32(at + 80, count);
+	img.Put32(at + 84, 128);
+	img.Put32(at + 88, entriesCrc);
+	img.Put32(at + 16, Crc32(&img.bytes[(size_t)at], 92));
+}
+
+// A protective MBR, the entry array after the primary header and a backup
+// header and array at the end of the disk
+static void Gpt(Image & img, DWORD sector, DWORD count, const vector<GptPart> & parts)
+{
+	auto sectors = img.bytes.size() / sector;
+	img.MbrEntry(0, 0, 0xEE, 1, (DWORD)(sectors - 1));
+	img.Signature(0);
+	auto entrySectors = (count * 128 + sector - 1) / sector;
+	vector<byte> entries(count * 128);
+	for (auto &p : parts)
+	{
+		auto e = &entries[p.index * 128];
+		e[0] = 0xA2;
+		e[16] = (byte)(p.index + 1);
+		memcpy(e + 32, &p.first, 8);
+		memcpy(e + 40, &p.last, 8);
+	}
+	auto crc = Crc32(entries.data(), entries.size());
+	auto backupEntries = sectors - 1 - entrySectors;
+	memcpy(&img.bytes[2 * sector], entries.data(), entries.size());
+	memcpy(&img.bytes[(size_t)backupEntries * sector], entries.data(), entries.size());
+	GptHeader(img, sector, 1, sectors - 1, 2, count, crc);
+	GptHeader(img, sector, sectors - 1, 1, backupEntries, count, crc);
+}
+
+// Writes the image to a temporary file and reads its table back
+static HRESULT Read(const Image & img, DWORD & style, PartitionEntries & entries)
+{
+	WCHAR dir[MAX_PATH];
+	WCHAR name[MAX_PATH];
+	if (!GetTempPath(ARRAYSIZE(dir), dir) || !GetTempFileName(dir, L"ptt", 0, name))
+		return GetLastError();
+	auto h = CreateFile(name, GENERIC_READ|GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+	if (h==INVALID_HANDLE_VALUE)
+		return GetLastError();
+	auto hr = WriteAll(h, img.bytes.data(), img.bytes.size(), 0);
+	if (!hr)
+		hr = ReadPartitionTable(h, img.bytes.size(), style, entries);
+	CloseHandle(h);
+	return hr;
+}
+
+static void Expect(const PartitionEntries & entries, size_t i, DWORD number, UINT64 offset, UINT64 size)
+{
+	CHECK(i<entries.size());
+	if (i>=entries.size())
+		return;
+	CHECK(entries[i].number==number);
+	CHECK(entries[i].offset==offset);
+	CHECK(entries[i].size==size);
+}
+
+static void TestMbr()
+{
+	Image img(64*1024*1024);
+	img.MbrEntry(0, 0, 0x07, 2048, 20480);
+	img.MbrEntry(0, 1, 0x83, 22528, 40960);
+	img.MbrEntry(0, 3, 0x0C, 63488, 2048);
+	img.Signature(0);
+	DWORD style;
+	PartitionEntries entries;
+	CHECK(Read(img, style, entries)==0);
+	CHECK(style==PARTITION_STYLE_MBR);
+	CHECK(entries.size()==3);
+	Expect(entries, 0, 1, 2048*512ULL, 20480*512ULL);
+	Expect(entries, 1, 2, 22528*512ULL, 40960*512ULL);
+	Expect(entries, 2, 3, 63488*512ULL, 2048*512ULL);
+}
+
+static void TestEbrChain()
+{
+	// a primary, then an extended partition holding three logical ones
+	Image img(64*1024*1024);
+	const DWORD extended = 10240;
+	img.MbrEntry(0, 0, 0x07, 2048, 8192);
+	img.MbrEntry(0, 1, 0x0F, extended, 100000);
+	img.Signature(0);
+	const DWORD ebrs[] = { 0, 20000, 50000 };
+	const DWORD sizes[] = { 10000, 20000, 30000 };
+	for (DWORD i=0; i<3; i++)
+	{
+		auto lba = extended + ebrs[i];
+		// the logical partition is relative to its EBR, the link to the extended partition
+		img.MbrEntry(lba, 0, 0x83, 63, sizes[i]);
+		if (i<2)
+			img.MbrEntry(lba, 1, 0x05, ebrs[i+1], sizes[i+1] + 63);
+		img.Signature(lba);
+	}
+	DWORD style;
+	PartitionEntries entries;
+	CHECK(Read(img, style, entries)==0);
+	CHECK(style==PARTITION_STYLE_MBR);
+	CHECK(entries.size()==4);
+	Expect(entries, 0, 1, 2048*512ULL, 8192*512ULL);
+	for (DWORD i=0; i<3; i++)
+		Expect(entries, i + 1, i + 2, (UINT64)(extended + ebrs[i] + 63) * 512, (UINT64)sizes[i] * 512);
+	// a link from the last EBR back to the second one loops forever, which must be refused
+	img.MbrEntry(extended + ebrs[2], 1, 0x05, ebrs[1], sizes[1] + 63);
+	CHECK(Read(img, style, entries)==ERROR_BAD_FORMAT);
+}
+
+static void TestGpt(DWORD sector)
+{
+	// 200 entries, used ones spread across the array including past entry 128
+	Image img(sector==512 ? 64*1024*1024 : 256*1024*1024);
+	vector<GptPart> parts;
+	const DWORD used[] = { 0, 1, 127, 128, 150, 199 };
+	UINT64 lba = 2048;
+	for (auto index : used)
+	{
+		GptPart p = { index, lba, lba + 999 };
+		parts.push_back(p);
+		lba += 1000;
+	}
+	Gpt(img, sector, 200, parts);
+	DWORD style;
+	PartitionEntries entries;
+	CHECK(Read(img, style, entries)==0);
+	CHECK(style==PARTITION_STYLE_GPT);
+	CHECK(entries.size()==parts.size());
+	for (size_t i=0; i<parts.size(); i++)
+		Expect(entries, i, (DWORD)i + 1, parts[i].first * sector, 1000ULL * sector);
+	// with the primary header damaged the backup at the end of the disk still describes the same partitions
+	img.bytes[sector + 20] ^= 0xFF;
+	CHECK(Read(img, style, entries)==0);
+	CHECK(entries.size()==parts.size());
+	if (!parts.empty())
+		Expect(entries, parts.size() - 1, (DWORD)parts.size(), parts.back().first * sector, 1000ULL * sector);
+	// and a backup entry array that does not match its CRC is refused
+	img.bytes[(img.bytes.size() / sector - 2) * sector] ^= 0xFF;
+	CHECK(Read(img, style, entries)==ERROR_BAD_FORMAT);
+}
+
+int wmain()
+{
+	TestMbr();
+	TestEbrChain();
+	TestGpt(512);
+	TestGpt(4096);
+	wprintf(failures ? L"%d checks failed\n" : L"All checks passed\n", failures);
+	return failures ? 1 : 0;
+}
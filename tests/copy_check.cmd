@@ -0,0 +1,70 @@
+@echo off
+rem
+rem Copyright (c) 2016, Nicolai R. Nyberg
+rem All rights reserved.
+rem
+rem Redistribution and use in source and binary forms, with or without
+rem modification, are permitted provided that the following conditions are met:
+rem
+rem 1. Redistributions of source code must retain the above copyright notice,
+rem this list of conditions and the following disclaimer.
+rem
+rem 2. Redistributions in binary form must reproduce the above copyright notice,
+rem this list of conditions and the following disclaimer in the documentation
+rem and/or other materials provided with the distribution.
+rem
+rem 3. Neither the name of the copyright holder nor the names of its contributors
+rem may be used to endorse or promote products derived from this software
+rem without specific prior written permission.
+rem
+rem THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+rem AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+rem IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+rem DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+rem FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+rem DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+rem SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+rem CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+rem OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+rem OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+rem
+rem Copies a generated multi-GB image file with the overlapped copy engine at
+rem several queue depths, with and without the file cache, and striped over
+rem several threads, and compares each copy with the source byte for byte.
+rem The size crosses the 4 GB mark and ends off a sector boundary, so 64-bit
+rem offsets and the padded tail are covered too.
+rem
+rem   copy_check.cmd [path\to\rawdev.exe] [work directory]
+rem
+rem Needs 11 GB free in the work directory, %TEMP% by default. Prints PASSED
+rem and exits 0, or prints which copy failed and exits 1.
+
+setlocal
+set RAWDEV=%~1
+if "%RAWDEV%"=="" set RAWDEV=rawdev.exe
+set WORK=%~2
+if "%WORK%"=="" set WORK=%TEMP%
+set SRC=%WORK%\copy_src.bin
+set DST=%WORK%\copy_dst.bin
+rem 5 GB and 12345 bytes
+set SIZE=5368721465
+del /q "%SRC%" "%DST%" 2>nul
+
+"%RAWDEV%" -fill "%SRC%" -random -seed 1 -l %SIZE% >nul || (echo FAILED: -fill & goto fail)
+call :check -qd 1 || goto fail
+call :check -qd 4 || goto fail
+call :check -qd 32 || goto fail
+call :check -qd 8 -direct || goto fail
+call :check -threads 4 || goto fail
+del /q "%SRC%" "%DST%"
+echo PASSED
+exit /b 0
+
+:check
+del /q "%DST%" 2>nul
+"%RAWDEV%" -cp "%SRC%" "%DST%" %* || (echo FAILED: -cp %* & exit /b 1)
+"%RAWDEV%" -cmp "%SRC%" "%DST%" || (echo FAILED: -cp %* is not identical to the source & exit /b 1)
+exit /b 0
+
+:fail
+exit /b 1
@@ -0,0 +1,73 @@
+@echo off
+rem
+rem Copyright (c) 2016, Nicolai R. Nyberg
+rem All rights reserved.
+rem
+rem Redistribution and use in source and binary forms, with or without
+rem modification, are permitted provided that the following conditions are met:
+rem
+rem 1. Redistributions of source code must retain the above copyright notice,
+rem this list of conditions and the following disclaimer.
+rem
+rem 2. Redistributions in binary form must reproduce the above copyright notice,
+rem this list of conditions and the following disclaimer in the documentation
+rem and/or other materials provided with the distribution.
+rem
+rem 3. Neither the name of the copyright holder nor the names of its contributors
+rem may be used to endorse or promote products derived from this software
+rem without specific prior written permission.
+rem
+rem THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+rem AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+rem IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+rem DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+rem FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+rem DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+rem SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+rem CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+rem OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+rem OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+rem
+rem Times the same file to file copy through the mapped path (-map) and
+rem through the default overlapped engine, alternating so both see the file
+rem cache in the same state, and prints the MB/s each run reports in its
+rem -json summary.
+rem
+rem   map_bench.cmd [path\to\rawdev.exe] [work directory] [size] [rounds]
+rem
+rem The size defaults to 4 GB and the rounds to 3; twice the size must be
+rem free in the work directory, %TEMP% by default. Exits 1 if a copy fails.
+
+setlocal
+set RAWDEV=%~1
+if "%RAWDEV%"=="" set RAWDEV=rawdev.exe
+set WORK=%~2
+if "%WORK%"=="" set WORK=%TEMP%
+set SIZE=%~3
+if "%SIZE%"=="" set SIZE=4294967296
+set ROUNDS=%~4
+if "%ROUNDS%"=="" set ROUNDS=3
+set SRC=%WORK%\bench_src.bin
+set DST=%WORK%\bench_dst.bin
+set JSON=%WORK%\bench.json
+del /q "%SRC%" "%DST%" "%JSON%" 2>nul
+
+"%RAWDEV%" -fill "%SRC%" -random -l %SIZE% >nul || (echo FAILED: -fill & goto fail)
+echo round  path     seconds   MB/s
+for /l %%R in (1,1,%ROUNDS%) do (
+	call :time %%R engine || goto fail
+	call :time %%R -map || goto fail
+)
+del /q "%SRC%" "%DST%" "%JSON%"
+exit /b 0
+
+:time
+set FLAG=%2
+if "%FLAG%"=="engine" set FLAG=
+del /q "%DST%" 2>nul
+"%RAWDEV%" -cp "%SRC%" "%DST%" %FLAG% -json "%JSON%" >nul || (echo FAILED: -cp %FLAG% & exit /b 1)
+for /f "tokens=1-4 delims=:, " %%a in ('findstr /c:"mbPerSecond" "%JSON%"') do echo %1      %2   %%b     %%d
+exit /b 0
+
+:fail
+exit /b 1
@@ -0,0 +1,84 @@
+@echo off
+rem
+rem Copyright (c) 2016, Nicolai R. Nyberg
+rem All rights reserved.
+rem
+rem Redistribution and use in source and binary forms, with or without
+rem modification, are permitted provided that the following conditions are met:
+rem
+rem 1. Redistributions of source code must retain the above copyright notice,
+rem this list of conditions and the following disclaimer.
+rem
+rem 2. Redistributions in binary form must reproduce the above copyright notice,
+rem this list of conditions and the following disclaimer in the documentation
+rem and/or other materials provided with the distribution.
+rem
+rem 3. Neither the name of the copyright holder nor the names of its contributors
+rem may be used to endorse or promote products derived from this software
+rem without specific prior written permission.
+rem
+rem THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+rem AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+rem IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+rem DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+rem FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+rem DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+rem SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+rem CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+rem OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+rem OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+rem
+rem Rescues a generated image through -faults, which fails every read that
+rem touches the listed ranges as a bad sector would. Checks that the map
+rem marks exactly those ranges bad, that they read back as zeros and that
+rem everything else matches the source. A second run with the same map must
+rem retry only the bad sectors, and a third without -faults must recover
+rem them.
+rem
+rem   rescue_check.cmd [path\to\rawdev.exe] [work directory]
+rem
+rem Needs 600 MB free in the work directory, %TEMP% by default. Prints
+rem PASSED and exits 0, or prints what failed and exits 1.
+
+setlocal
+set RAWDEV=%~1
+if "%RAWDEV%"=="" set RAWDEV=rawdev.exe
+set WORK=%~2
+if "%WORK%"=="" set WORK=%TEMP%
+set SRC=%WORK%\rescue_src.bin
+set DST=%WORK%\rescue_dst.bin
+set ZERO=%WORK%\rescue_zero.bin
+set MAP=%WORK%\rescue.map
+set FAULTS=%WORK%\rescue_faults.txt
+set OUT=%WORK%\rescue_out.txt
+set COPY="%SRC%" "%DST%" -rescue "%MAP%"
+del /q "%SRC%" "%DST%" "%ZERO%" "%MAP%" "%FAULTS%" "%OUT%" 2>nul
+
+rem 4 KB at 10 MB and one 512 byte sector at 128 MB, 4608 bytes in all
+> "%FAULTS%" echo 10485760 4096
+>> "%FAULTS%" echo 134217728 512
+"%RAWDEV%" -fill "%SRC%" -random -seed 15 -l 268435456 >nul || (echo FAILED: -fill & goto fail)
+"%RAWDEV%" -fill "%ZERO%" -l 4096 >nul || (echo FAILED: -fill of zeros & goto fail)
+
+"%RAWDEV%" -cp %COPY% -faults "%FAULTS%" >"%OUT%" || (type "%OUT%" & echo FAILED: -rescue & goto fail)
+findstr /x /c:"10485760 4096 -" "%MAP%" >nul || (echo FAILED: the map does not mark 10485760 4096 bad & goto fail)
+findstr /x /c:"134217728 512 -" "%MAP%" >nul || (echo FAILED: the map does not mark 134217728 512 bad & goto fail)
+for /f %%N in ('findstr /r /c:" [-*?]$" "%MAP%" ^| find /c /v ""') do if not "%%N"=="2" (type "%MAP%" & echo FAILED: the map has other ranges that are not good & goto fail)
+"%RAWDEV%" -cmp "%ZERO%" "%DST%" -do 10485760 -l 4096 >nul || (echo FAILED: 10485760 4096 is not zero filled & goto fail)
+"%RAWDEV%" -cmp "%ZERO%" "%DST%" -do 134217728 -l 512 >nul || (echo FAILED: 134217728 512 is not zero filled & goto fail)
+"%RAWDEV%" -cmp "%SRC%" "%DST%" >"%OUT%" && (echo FAILED: the bad ranges were not left out & goto fail)
+findstr /c:"2 ranges differ" "%OUT%" >nul || (type "%OUT%" & echo FAILED: more differs than the bad ranges & goto fail)
+
+"%RAWDEV%" -cp %COPY% -faults "%FAULTS%" >"%OUT%" || (type "%OUT%" & echo FAILED: second -rescue & goto fail)
+findstr /c:", 0 unreadable bytes zero filled, 4608 bytes read again" "%OUT%" >nul || (type "%OUT%" & echo FAILED: the second run did not retry only the bad sectors & goto fail)
+
+"%RAWDEV%" -cp %COPY% >"%OUT%" || (type "%OUT%" & echo FAILED: -rescue without -faults & goto fail)
+findstr /c:"4608 bytes read again" "%OUT%" >nul || (type "%OUT%" & echo FAILED: the third run did not retry only the bad sectors & goto fail)
+"%RAWDEV%" -cmp "%SRC%" "%DST%" >nul || (echo FAILED: the recovered sectors differ from the source & goto fail)
+
+del /q "%SRC%" "%DST%" "%ZERO%" "%MAP%" "%FAULTS%" "%OUT%"
+echo PASSED
+exit /b 0
+
+:fail
+exit /b 1
@@ -0,0 +1,80 @@
+@echo off
+rem
+rem Copyright (c) 2016, Nicolai R. Nyberg
+rem All rights reserved.
+rem
+rem Redistribution and use in source and binary forms, with or without
+rem modification, are permitted provided that the following conditions are met:
+rem
+rem 1. Redistributions of source code must retain the above copyright notice,
+rem this list of conditions and the following disclaimer.
+rem
+rem 2. Redistributions in binary form must reproduce the above copyright notice,
+rem this list of conditions and the following disclaimer in the documentation
+rem and/or other materials provided with the distribution.
+rem
+rem 3. Neither the name of the copyright holder nor the names of its contributors
+rem may be used to endorse or promote products derived from this software
+rem without specific prior written permission.
+rem
+rem THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+rem AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+rem IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+rem DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+rem FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+rem DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+rem SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+rem CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+rem OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+rem OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+rem
+rem Kills a journaled copy part way and resumes it, then compares the result
+rem with the source. The destination is an unbuffered file written at a
+rem sector aligned offset, so -resume reads the last journaled ranges back
+rem past the start of the file. -journal refuses offsets and lengths off the
+rem sectors, which the first run here also checks.
+rem
+rem   resume_check.cmd [path\to\rawdev.exe] [work directory]
+rem
+rem Needs 4 GB free in the work directory, %TEMP% by default, and takes
+rem about a minute. Prints PASSED and exits 0, or prints what failed and
+rem exits 1. Other running copies of rawdev.exe are killed with this one.
+
+setlocal
+set RAWDEV=%~1
+if "%RAWDEV%"=="" set RAWDEV=rawdev.exe
+set WORK=%~2
+if "%WORK%"=="" set WORK=%TEMP%
+for %%F in ("%RAWDEV%") do set IMAGE=%%~nxF
+set SRC=%WORK%\resume_src.bin
+set DST=%WORK%\resume_dst.bin
+set JOURNAL=%WORK%\resume.journal
+set OUT=%WORK%\resume_out.txt
+rem 2 GB at 40 MB/s is still copying when it is killed after 3 journal saves
+set SIZE=2147483648
+set COPY="%SRC%" "%DST%" -do 4096 -direct -journal "%JOURNAL%"
+del /q "%SRC%" "%DST%" "%JOURNAL%" "%OUT%" 2>nul
+
+"%RAWDEV%" -fill "%SRC%" -random -seed 14 -l %SIZE% >nul || (echo FAILED: -fill & goto fail)
+"%RAWDEV%" -cp "%SRC%" "%DST%" -do 1536 -direct -journal "%JOURNAL%" >nul && (echo FAILED: -journal took an unaligned -do & goto fail)
+del /q "%DST%" "%JOURNAL%" 2>nul
+start "" /b "%RAWDEV%" -cp %COPY% -rate 41943040 >nul
+timeout /t 35 /nobreak >nul
+taskkill /f /im %IMAGE% >nul || (echo FAILED: the copy ended before it was killed & goto fail)
+rem let the process exit and release the files
+timeout /t 2 /nobreak >nul
+if not exist "%JOURNAL%" (echo FAILED: no journal left by the killed copy & goto fail)
+
+"%RAWDEV%" -cp %COPY% -resume >"%OUT%" || (type "%OUT%" & echo FAILED: -resume & goto fail)
+type "%OUT%"
+findstr /c:"Resuming, 0 of" "%OUT%" >nul && (echo FAILED: nothing was resumed & goto fail)
+findstr /c:"did not read back" "%OUT%" >nul && (echo FAILED: journaled ranges did not read back & goto fail)
+if exist "%JOURNAL%" (echo FAILED: the journal was not removed & goto fail)
+
+"%RAWDEV%" -cmp "%SRC%" "%DST%" -do 4096 || (echo FAILED: the destination differs from the source & goto fail)
+del /q "%SRC%" "%DST%" "%OUT%"
+echo PASSED
+exit /b 0
+
+:fail
+exit /b 1